@@ -2,7 +2,19 @@
 #define GLOBAL_H
 
 #include "platform.h"
+#include "cpu_trace.h"
+#include "gl_stats.h"
 #include "buffer_management.h"
+#include "gpu_layout.h"
+#include "mesh_processing.h"
+#include "transform_system.h"
+#include "gpu_profiler.h"
+#include "render_targets.h"
+#include "frame_graph.h"
+#include "material_table.h"
+#include "texture_streaming.h"
+#include "shadow_atlas.h"
+#include "frame_capture.h"
 #include "ModelLoader.h"
 #include "Camera.h"
 #include "engine.h"
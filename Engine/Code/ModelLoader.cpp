@@ -3,41 +3,127 @@
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtx/euler_angles.hpp>
+#include <float.h>
 
+#define LOD_REDUCTION_RATIO 0.5f  // Each level tries to halve the triangles of the previous one
+#define LOD_MIN_INDEX_COUNT 3*64  // Don't bother simplifying below this
+#define LOD_MAX_ERROR       0.05f // Relative to the submesh extent
+
+#define VERTEX_CACHE_SIZE 16 // FIFO entries used to measure the cache efficiency
 
 class Entity;
 
-void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+// Transient data kept between the two import passes. The vertices are written straight
+// from the aiMesh into the mapped buffer, only the indices need memory of their own to be
+// reordered and simplified before their final size is known.
+struct SubmeshImport
+{
+    const aiMesh* mesh;
+    bool hasTexCoords;
+    bool hasTangentSpace;
+    bool quantized;
+    u32  firstIndex;  // In MeshImport::indices
+    u32  firstVertex; // In MeshImport::vertexRemap
+};
+
+// The big arrays live in the scratch arena of the loading thread. The indices are pushed
+// last so they can keep growing at the top of the arena as the LODs are generated.
+struct MeshImport
 {
-    std::vector<float> vertices;
-    std::vector<u32> indices;
+    std::vector<SubmeshImport> submeshes;
+    Arena* arena;
+    u32*   indices;          // Every submesh (and its LODs), one after the other
+    u32    indexCount;
+    u32*   vertexRemap;      // Final position of every source vertex
+    u32    vertexRemapCount;
+    u32*   scratch;          // Reused by the index processing of every submesh
+};
+
+u32* PushImportIndices(MeshImport& import, u32 count)
+{
+    u32* indices = ArenaPushArray(import.arena, u32, count);
+    ASSERT(indices == import.indices + import.indexCount, "Import indices must stay at the top of the arena");
+    import.indexCount += count;
+    return indices;
+}
 
-    bool hasTexCoords = false;
-    bool hasTangentSpace = false;
+u32 GetIndexSize(GLenum indexType)
+{
+    return indexType == GL_UNSIGNED_SHORT ? sizeof(u16) : sizeof(u32);
+}
 
-    // process vertices
-    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+VertexBufferLayout BuildVertexBufferLayout(bool hasTexCoords, bool hasTangentSpace, bool quantized)
+{
+    VertexBufferLayout vertexBufferLayout = {};
+
+    if (quantized)
     {
-        vertices.push_back(mesh->mVertices[i].x);
-        vertices.push_back(mesh->mVertices[i].y);
-        vertices.push_back(mesh->mVertices[i].z);
-        vertices.push_back(mesh->mNormals[i].x);
-        vertices.push_back(mesh->mNormals[i].y);
-        vertices.push_back(mesh->mNormals[i].z);
-
-        if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+        // 16 bit positions relative to the submesh bounds, 10 bit normals/tangents and half float texture coordinates
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0, GL_UNSIGNED_SHORT, true });
+        vertexBufferLayout.stride = 4 * sizeof(u16);
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 4, vertexBufferLayout.stride, GL_INT_2_10_10_10_REV, true });
+        vertexBufferLayout.stride += sizeof(u32);
+        if (hasTexCoords)
         {
-            hasTexCoords = true;
-            vertices.push_back(mesh->mTextureCoords[0][i].x);
-            vertices.push_back(mesh->mTextureCoords[0][i].y);
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride, GL_HALF_FLOAT, false });
+            vertexBufferLayout.stride += 2 * sizeof(u16);
         }
+        if (hasTangentSpace)
+        {
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 4, vertexBufferLayout.stride, GL_INT_2_10_10_10_REV, true });
+            vertexBufferLayout.stride += sizeof(u32);
+
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 4, vertexBufferLayout.stride, GL_INT_2_10_10_10_REV, true });
+            vertexBufferLayout.stride += sizeof(u32);
+        }
+    }
+    else
+    {
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0, GL_FLOAT, false });
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float), GL_FLOAT, false });
+        vertexBufferLayout.stride = 6 * sizeof(float);
+        if (hasTexCoords)
+        {
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride, GL_FLOAT, false });
+            vertexBufferLayout.stride += 2 * sizeof(float);
+        }
+        if (hasTangentSpace)
+        {
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride, GL_FLOAT, false });
+            vertexBufferLayout.stride += 3 * sizeof(float);
+
+            vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride, GL_FLOAT, false });
+            vertexBufferLayout.stride += 3 * sizeof(float);
+        }
+    }
+
+    return vertexBufferLayout;
+}
+
+// Writes the vertices of the submesh (interleaved, in their final order) to dst
+void WriteSubmeshVertices(u8* dst, const SubmeshImport& submeshImport, const Submesh& submesh, const u32* vertexRemap)
+{
+    const aiMesh* mesh = submeshImport.mesh;
+    const u32 stride = submesh.vertexBufferLayout.stride;
+
+    glm::vec3 extent = submesh.dequantizeScale;
+    glm::vec3 invExtent = glm::vec3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                                    extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                                    extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        glm::vec3 position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        glm::vec3 normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+        glm::vec2 texCoord = submeshImport.hasTexCoords ? glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y) : glm::vec2(0.0f);
+        glm::vec3 tangent = glm::vec3(0.0f);
+        glm::vec3 bitangent = glm::vec3(0.0f);
 
-        if (mesh->mTangents != nullptr && mesh->mBitangents)
+        if (submeshImport.hasTangentSpace)
         {
-            hasTangentSpace = true;
-            vertices.push_back(mesh->mTangents[i].x);
-            vertices.push_back(mesh->mTangents[i].y);
-            vertices.push_back(mesh->mTangents[i].z);
+            tangent = glm::vec3(mesh->mTangents[i].x, mesh->mTangents[i].y, mesh->mTangents[i].z);
 
             // For some reason ASSIMP gives me the bitangents flipped.
             // Maybe it's my fault, but when I generate my own geometry
@@ -47,49 +133,188 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
             // I think that (even if the documentation says the opposite)
             // it returns a left-handed tangent space matrix.
             // SOLUTION: I invert the components of the bitangent here.
-            vertices.push_back(-mesh->mBitangents[i].x);
-            vertices.push_back(-mesh->mBitangents[i].y);
-            vertices.push_back(-mesh->mBitangents[i].z);
+            bitangent = -glm::vec3(mesh->mBitangents[i].x, mesh->mBitangents[i].y, mesh->mBitangents[i].z);
+        }
+
+        u8* vertex = dst + (u64)vertexRemap[i] * stride;
+
+        if (submeshImport.quantized)
+        {
+            glm::vec3 relativePosition = glm::clamp((position - submesh.dequantizeOffset) * invExtent, 0.0f, 1.0f);
+            u16 quantizedPosition[4] = {
+                (u16)(relativePosition.x * 65535.0f + 0.5f),
+                (u16)(relativePosition.y * 65535.0f + 0.5f),
+                (u16)(relativePosition.z * 65535.0f + 0.5f),
+                0 };
+            memcpy(vertex, quantizedPosition, sizeof(quantizedPosition));
+            vertex += sizeof(quantizedPosition);
+
+            u32 packedNormal = glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+            memcpy(vertex, &packedNormal, sizeof(packedNormal));
+            vertex += sizeof(packedNormal);
+
+            if (submeshImport.hasTexCoords)
+            {
+                u32 packedTexCoord = glm::packHalf2x16(texCoord);
+                memcpy(vertex, &packedTexCoord, sizeof(packedTexCoord));
+                vertex += sizeof(packedTexCoord);
+            }
+            if (submeshImport.hasTangentSpace)
+            {
+                u32 packedTangent = glm::packSnorm3x10_1x2(glm::vec4(glm::normalize(tangent), 0.0f));
+                u32 packedBitangent = glm::packSnorm3x10_1x2(glm::vec4(glm::normalize(bitangent), 0.0f));
+                memcpy(vertex, &packedTangent, sizeof(packedTangent));
+                memcpy(vertex + sizeof(packedTangent), &packedBitangent, sizeof(packedBitangent));
+            }
+        }
+        else
+        {
+            memcpy(vertex, glm::value_ptr(position), sizeof(position));
+            memcpy(vertex + 3 * sizeof(float), glm::value_ptr(normal), sizeof(normal));
+            vertex += 6 * sizeof(float);
+
+            if (submeshImport.hasTexCoords)
+            {
+                memcpy(vertex, glm::value_ptr(texCoord), sizeof(texCoord));
+                vertex += sizeof(texCoord);
+            }
+            if (submeshImport.hasTangentSpace)
+            {
+                memcpy(vertex, glm::value_ptr(tangent), sizeof(tangent));
+                memcpy(vertex + sizeof(tangent), glm::value_ptr(bitangent), sizeof(bitangent));
+            }
         }
     }
+}
 
-    // process indices
+void WriteSubmeshIndices(u8* dst, const Submesh& submesh, const u32* indices)
+{
+    if (submesh.indexType == GL_UNSIGNED_SHORT)
+    {
+        u16* dstIndices = (u16*)dst;
+        for (u32 i = 0; i < submesh.indexCount; ++i)
+            dstIndices[i] = (u16)indices[i];
+    }
+    else
+    {
+        memcpy(dst, indices, submesh.indexCount * sizeof(u32));
+    }
+}
+
+void BuildSubmeshLods(Submesh& submesh, MeshImport& import, u32 firstIndex, const f32* positions, u32 positionStride)
+{
+    submesh.lods.push_back(SubmeshLod{ 0, import.indexCount - firstIndex, 0.0f });
+
+    for (u32 i = 1; i < MAX_MESH_LODS; ++i)
+    {
+        const SubmeshLod previous = submesh.lods.back();
+        const u32 targetIndexCount = (u32)(previous.indexCount * LOD_REDUCTION_RATIO) / 3 * 3;
+        if (targetIndexCount < LOD_MIN_INDEX_COUNT)
+            break;
+
+        f32 error = 0.0f;
+        u32 indexCount = SimplifyMesh(import.scratch, &import.indices[firstIndex + previous.indexOffset], previous.indexCount,
+                                      positions, submesh.vertexCount, positionStride, targetIndexCount, LOD_MAX_ERROR, &error);
+
+        // The simplifier got stuck (too many locked vertices, error limit reached...)
+        if (indexCount > previous.indexCount * 0.9f)
+            break;
+
+        OptimizeVertexCache(import.scratch, import.scratch, indexCount, submesh.vertexCount);
+
+        SubmeshLod lod = {};
+        lod.indexOffset = import.indexCount - firstIndex;
+        lod.indexCount = indexCount;
+        lod.error = glm::max(error, previous.error);
+        memcpy(PushImportIndices(import, indexCount), import.scratch, indexCount * sizeof(u32));
+        submesh.lods.push_back(lod);
+    }
+}
+
+// First import pass: everything but the vertex data itself, which is written once the
+// final buffer size is known (see LoadModel)
+void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices, u32 importFlags, MeshImport& import)
+{
+    SubmeshImport submeshImport = {};
+    submeshImport.mesh = mesh;
+    submeshImport.hasTexCoords = mesh->mTextureCoords[0] != nullptr;
+    submeshImport.hasTangentSpace = mesh->mTangents != nullptr && mesh->mBitangents != nullptr;
+    submeshImport.quantized = (importFlags & IMPORT_QUANTIZE) != 0;
+    submeshImport.firstIndex = import.indexCount;
+    submeshImport.firstVertex = import.vertexRemapCount;
+
+    const u32 vertexCount = mesh->mNumVertices;
+    const f32* positions = &mesh->mVertices[0].x;
+    const u32 positionStride = sizeof(aiVector3D);
+
+    // process indices (only triangles, aiProcess_SortByPType leaves points and lines in their own meshes)
+    u32 indexCount = 0;
     for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+        if (mesh->mFaces[i].mNumIndices == 3) indexCount += 3;
+
+    u32* indices = PushImportIndices(import, indexCount);
+    for (unsigned int i = 0, j = 0; i < mesh->mNumFaces; i++)
     {
-        aiFace face = mesh->mFaces[i];
-        for (unsigned int j = 0; j < face.mNumIndices; j++)
-        {
-            indices.push_back(face.mIndices[j]);
-        }
+        const aiFace& face = mesh->mFaces[i];
+        if (face.mNumIndices != 3) continue;
+        indices[j++] = face.mIndices[0];
+        indices[j++] = face.mIndices[1];
+        indices[j++] = face.mIndices[2];
     }
 
     // store the proper (previously proceessed) material for this mesh
     submeshMaterialIndices.push_back(baseMeshMaterialIndex + mesh->mMaterialIndex);
 
-    // create the vertex format
-    VertexBufferLayout vertexBufferLayout = {};
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
-    vertexBufferLayout.stride = 6 * sizeof(float);
-    if (hasTexCoords)
+    // reorder the triangles for the post-transform cache first, then by clusters to reduce overdraw
+    VertexCacheStatistics cacheStatsBefore = AnalyzeVertexCache(indices, indexCount, vertexCount, VERTEX_CACHE_SIZE);
+
+    OptimizeVertexCache(indices, indices, indexCount, vertexCount);
+    OptimizeOverdraw(import.scratch, indices, indexCount, positions, vertexCount, positionStride);
+    memcpy(indices, import.scratch, indexCount * sizeof(u32));
+
+    // add the submesh into the mesh
+    Submesh submesh = {};
+    submesh.vertexBufferLayout = BuildVertexBufferLayout(submeshImport.hasTexCoords, submeshImport.hasTangentSpace, submeshImport.quantized);
+    submesh.vertexCount = vertexCount;
+    BuildSubmeshLods(submesh, import, submeshImport.firstIndex, positions, positionStride);
+    submesh.indexCount = import.indexCount - submeshImport.firstIndex;
+
+    // sort the vertices by first use (all the LODs share them, the finest one goes first)
+    u32* vertexRemap = import.vertexRemap + submeshImport.firstVertex;
+    import.vertexRemapCount += vertexCount;
+    OptimizeVertexFetchRemap(vertexRemap, indices, submesh.indexCount, vertexCount);
+
+    for (u32 i = 0; i < submesh.indexCount; ++i)
+        indices[i] = vertexRemap[indices[i]];
+
+    submesh.cacheStatsBefore = cacheStatsBefore;
+    submesh.cacheStatsAfter = AnalyzeVertexCache(indices, submesh.lods[0].indexCount, vertexCount, VERTEX_CACHE_SIZE);
+    ILOG("Submesh %u (%u triangles): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f", (u32)myMesh->submeshes.size(), submesh.lods[0].indexCount / 3,
+         submesh.cacheStatsBefore.acmr, submesh.cacheStatsAfter.acmr, submesh.cacheStatsBefore.atvr, submesh.cacheStatsAfter.atvr);
+
+    submesh.boundsMin = glm::vec3(FLT_MAX);
+    submesh.boundsMax = glm::vec3(-FLT_MAX);
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
     {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 2 * sizeof(float);
+        glm::vec3 position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+        submesh.boundsMin = glm::min(submesh.boundsMin, position);
+        submesh.boundsMax = glm::max(submesh.boundsMax, position);
     }
-    if (hasTangentSpace)
-    {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
 
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
+    if (submeshImport.quantized)
+    {
+        submesh.dequantizeOffset = submesh.boundsMin;
+        submesh.dequantizeScale = submesh.boundsMax - submesh.boundsMin;
+        submesh.indexType = vertexCount < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    }
+    else
+    {
+        submesh.dequantizeOffset = glm::vec3(0.0f);
+        submesh.dequantizeScale = glm::vec3(1.0f);
+        submesh.indexType = GL_UNSIGNED_INT;
     }
 
-    // add the submesh into the mesh
-    Submesh submesh = {};
-    submesh.vertexBufferLayout = vertexBufferLayout;
-    submesh.vertices.swap(vertices);
-    submesh.indices.swap(indices);
+    import.submeshes.push_back(submeshImport);
     myMesh->submeshes.push_back(submesh);
 }
 
@@ -112,70 +337,83 @@ void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial,
     myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
     myMaterial.smoothness = shininess / 256.0f;
 
-    aiString aiFilename;
-    if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
-    {
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
-    {
-        material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
-    {
-        material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
-    {
-        material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
+    // Only registered, the textures are decoded once a program sampling their slot draws the
+    // material, so the slots no shader reads never take memory
+    const aiTextureType slotTypes[MATERIAL_TEXTURE_SLOT_COUNT] = { aiTextureType_DIFFUSE, aiTextureType_EMISSIVE, aiTextureType_SPECULAR, aiTextureType_NORMALS, aiTextureType_HEIGHT };
+    for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
     {
-        material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
+        myMaterial.textureIdx[slot] = UINT32_MAX;
+        if (material->GetTextureCount(slotTypes[slot]) > 0)
+        {
+            aiString aiFilename;
+            material->GetTexture(slotTypes[slot], 0, &aiFilename);
+            String filename = MakeString(aiFilename.C_Str());
+            String filepath = MakePath(directory, filename);
+            myMaterial.textureIdx[slot] = RegisterTexture2D(app, filepath.str);
+            if (myMaterial.textureIdx[slot] != UINT32_MAX)
+                app->textures[myMaterial.textureIdx[slot]].streamed = true;
+        }
     }
 
     //myMaterial.createNormalFromBump();
 }
 
-void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices, u32 importFlags, MeshImport& import)
 {
     // process all the node's meshes (if any)
     for (unsigned int i = 0; i < node->mNumMeshes; i++)
     {
         aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-        ProcessAssimpMesh(scene, mesh, myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        ProcessAssimpMesh(scene, mesh, myMesh, baseMeshMaterialIndex, submeshMaterialIndices, importFlags, import);
     }
 
     // then do the same for each of its children
     for (unsigned int i = 0; i < node->mNumChildren; i++)
     {
-        ProcessAssimpNode(scene, node->mChildren[i], myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        ProcessAssimpNode(scene, node->mChildren[i], myMesh, baseMeshMaterialIndex, submeshMaterialIndices, importFlags, import);
+    }
+}
+
+// Creates an entity for the node (and its children) referencing the submeshes of the node
+void ProcessAssimpNodeHierarchy(App* app, const aiNode* node, u32 meshIdx, const std::vector<u32>& materialIdx, u32 parentTransform)
+{
+    // Assimp matrices are row major
+    glm::mat4 local = glm::transpose(glm::make_mat4(&node->mTransformation.a1));
+
+    glm::vec3 position = glm::vec3(local[3]);
+    glm::vec3 scale = glm::vec3(glm::length(glm::vec3(local[0])), glm::length(glm::vec3(local[1])), glm::length(glm::vec3(local[2])));
+    glm::mat4 rotationMatrix = glm::mat4(glm::mat3(glm::vec3(local[0]) / scale.x, glm::vec3(local[1]) / scale.y, glm::vec3(local[2]) / scale.z));
+
+    glm::vec3 rotation;
+    glm::extractEulerAngleXYZ(rotationMatrix, rotation.x, rotation.y, rotation.z);
+
+    Entity entity = {};
+    entity.name = node->mName.C_Str();
+    entity.modelIndex = meshIdx;
+    entity.transformIndex = AddTransform(app->transforms, position, glm::degrees(rotation), scale, parentTransform);
+    entity.materialIdx = materialIdx;
+    entity.submeshIndices.assign(node->mMeshes, node->mMeshes + node->mNumMeshes);
+    app->entities.push_back(entity);
+
+    for (unsigned int i = 0; i < node->mNumChildren; ++i)
+    {
+        ProcessAssimpNodeHierarchy(app, node->mChildren[i], meshIdx, materialIdx, entity.transformIndex);
     }
 }
 
-u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 position, glm::vec3 rotation, glm::vec3 scale)
+u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 position, glm::vec3 rotation, glm::vec3 scale, u32 importFlags)
 {
+    TRACE_FUNCTION();
+
+    // Keeping the node hierarchy, the meshes stay in node space and are shared by every node using them
+    const bool keepHierarchy = (importFlags & IMPORT_NODE_HIERARCHY) != 0;
+
     const aiScene* scene = aiImportFile(filename,
         aiProcess_Triangulate |
         aiProcess_GenSmoothNormals |
         aiProcess_CalcTangentSpace |
         aiProcess_JoinIdenticalVertices |
-        aiProcess_PreTransformVertices |
+        (keepHierarchy ? 0 : aiProcess_PreTransformVertices) |
         aiProcess_ImproveCacheLocality |
         aiProcess_OptimizeMeshes |
         aiProcess_SortByPType);
@@ -194,9 +432,7 @@ u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 positio
     Entity& entity = app->entities.back();
     entity.modelIndex = meshIdx;
     entity.name = name;
-    entity.position = position;
-    entity.rotation = rotation;
-    entity.scale    = scale;
+    entity.transformIndex = AddTransform(app->transforms, position, rotation, scale);
     u32 modelIdx = (u32)app->entities.size() - 1u;
 
     String directory = GetDirectoryPart(MakeString(filename));
@@ -210,48 +446,113 @@ u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 positio
         ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
     }
 
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, entity.materialIdx);
+    // Transient import memory, released at the end of the load
+    TempArena tempArena = BeginTempArena(GetScratchArena());
 
-    aiReleaseImport(scene);
+    u32 totalVertexCount = 0;
+    u32 maxIndexCount = 0;
+    for (unsigned int i = 0; i < scene->mNumMeshes; ++i)
+    {
+        totalVertexCount += scene->mMeshes[i]->mNumVertices;
+        maxIndexCount = glm::max(maxIndexCount, scene->mMeshes[i]->mNumFaces * 3);
+    }
+
+    MeshImport import = {};
+    import.arena = tempArena.arena;
+    import.vertexRemap = ArenaPushArray(import.arena, u32, totalVertexCount);
+    import.scratch = ArenaPushArray(import.arena, u32, maxIndexCount);
+    import.indices = ArenaPushArray(import.arena, u32, 0);
+
+    if (keepHierarchy)
+    {
+        // One submesh per aiMesh, in the same order, so the node mesh indices are submesh indices
+        for (unsigned int i = 0; i < scene->mNumMeshes; ++i)
+            ProcessAssimpMesh(scene, scene->mMeshes[i], &mesh, baseMeshMaterialIndex, entity.materialIdx, importFlags, import);
+    }
+    else
+    {
+        ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, entity.materialIdx, importFlags, import);
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            entity.submeshIndices.push_back(i);
+    }
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
+    // Bounds and LOD errors of the whole mesh
+    glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+    glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+    mesh.lodCount = 1;
+    for (u32 i = 0; i < MAX_MESH_LODS; ++i)
+        mesh.lodErrors[i] = 0.0f;
 
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
+        const Submesh& submesh = mesh.submeshes[i];
+        boundsMin = glm::min(boundsMin, submesh.boundsMin);
+        boundsMax = glm::max(boundsMax, submesh.boundsMax);
+
+        glm::vec3 size = submesh.boundsMax - submesh.boundsMin;
+        f32 extent = glm::max(size.x, glm::max(size.y, size.z));
+        mesh.lodCount = glm::max(mesh.lodCount, (u32)submesh.lods.size());
+        for (u32 lod = 0; lod < submesh.lods.size(); ++lod)
+            mesh.lodErrors[lod] = glm::max(mesh.lodErrors[lod], submesh.lods[lod].error * extent);
+    }
+    for (u32 lod = 1; lod < mesh.lodCount; ++lod)
+        mesh.lodErrors[lod] = glm::max(mesh.lodErrors[lod], mesh.lodErrors[lod - 1]);
+
+    mesh.boundsCenter = mesh.submeshes.empty() ? glm::vec3(0.0f) : (boundsMin + boundsMax) * 0.5f;
+    mesh.boundsRadius = mesh.submeshes.empty() ? 0.0f : glm::length(boundsMax - boundsMin) * 0.5f;
+
+    // Second pass: with the exact sizes known, the vertices (first) and the indices (after them)
+    // are written straight into a single buffer, mapped once
+    u32 bufferSize = 0;
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        submesh.vertexOffset = bufferSize;
+        bufferSize += submesh.vertexCount * submesh.vertexBufferLayout.stride;
+    }
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        bufferSize = Align(bufferSize, sizeof(u32));
+        submesh.indexOffset = bufferSize;
+        bufferSize += submesh.indexCount * GetIndexSize(submesh.indexType);
     }
 
     glGenBuffers(1, &mesh.vertexBufferHandle);
     glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, bufferSize, NULL, GL_STATIC_DRAW);
 
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    if (bufferSize > 0)
+    {
+        u8* bufferData = (u8*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            const SubmeshImport& submeshImport = import.submeshes[i];
+            WriteSubmeshVertices(bufferData + submesh.vertexOffset, submeshImport, submesh, import.vertexRemap + submeshImport.firstVertex);
+            WriteSubmeshIndices(bufferData + submesh.indexOffset, submesh, import.indices + submeshImport.firstIndex);
+        }
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-    {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        if (!glUnmapBuffer(GL_ARRAY_BUFFER))
+            ELOG("Mesh buffer of %s got corrupted while mapped", filename);
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+    // Indices live in the same buffer, after the vertices
+    mesh.indexBufferHandle = mesh.vertexBufferHandle;
+
+    EndTempArena(tempArena);
+
+    // The entity of the model becomes the parent of the entities of the nodes (this invalidates entity)
+    if (keepHierarchy)
+    {
+        std::vector<u32> materialIdx = entity.materialIdx;
+        ProcessAssimpNodeHierarchy(app, scene->mRootNode, meshIdx, materialIdx, entity.transformIndex);
+    }
+
+    aiReleaseImport(scene);
+
     return modelIdx;
 }
 Entity Entity::GetModelFromName(std::string name, App* app)
@@ -18,6 +18,8 @@ struct VertexBufferAttribute
 	u8 location;
 	u8 componentCount;
 	u8 offset;
+	GLenum type;     // GL_FLOAT, GL_HALF_FLOAT, GL_UNSIGNED_SHORT, GL_INT_2_10_10_10_REV...
+	bool normalized; // Integer types are mapped to [0, 1] or [-1, 1]
 };
 struct VertexBufferLayout
 {
@@ -43,15 +45,12 @@ class Entity
 {
 public:
 	std::string name;
-	glm::vec3 position;
-	glm::vec3 rotation;
-	glm::vec3 scale;
-	glm::mat4 worldMatrix;
-	glm::mat4 worldMatrixProjection;
+	u32 transformIndex; // In App::transforms
 
 	u32 modelIndex;
-	u32 localParamsOffset;
-	u32 localParamSize;
+	std::vector<u32> submeshIndices; // Submeshes of the model drawn by this entity
+	u32 lodLevel;
+	u32 objectIndex; // In App::objectBuffer
 	std::vector<u32> materialIdx;
 
 	glm::mat4 TransformScale(const glm::vec3& scaleFactors);
@@ -111,6 +110,8 @@ public:
 	glm::vec3 direction;
 	glm::vec3 position;
 	float intesity;
+	bool isStatic = true;     // Its shadow is kept until something within its reach moves
+	bool castsShadows = true;
 };
 
 struct Vao
@@ -118,35 +119,75 @@ struct Vao
 	GLuint handle;
 	GLuint programHandle;
 };
+
+#define MAX_MESH_LODS 5
+
+struct SubmeshLod
+{
+	u32 indexOffset; // In indices, relative to the first index of the submesh
+	u32 indexCount;
+	f32 error;       // Relative to the largest side of the submesh bounds
+};
 struct Submesh
 {
 	VertexBufferLayout vertexBufferLayout;
-	std::vector<float> vertices;
-	std::vector<u32> indices;
-	u32 vertexOffset;
-	u32 indexOffset;
+	std::vector<SubmeshLod> lods;
+	u32 vertexCount;
+	u32 indexCount;   // All the LODs, one after the other
+	u32 vertexOffset; // In bytes, in the mesh buffer
+	u32 indexOffset;  // In bytes, in the mesh buffer
+	GLenum indexType; // Indices are stored as u16 when possible
+
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	glm::vec3 dequantizeOffset; // position = dequantizeOffset + aPosition * dequantizeScale
+	glm::vec3 dequantizeScale;
+
+	VertexCacheStatistics cacheStatsBefore; // As given by Assimp
+	VertexCacheStatistics cacheStatsAfter;  // After our own index/vertex reordering
 
 	std::vector<Vao> vaos;
 };
+enum MaterialTextureSlot
+{
+	MATERIAL_TEXTURE_ALBEDO,
+	MATERIAL_TEXTURE_EMISSIVE,
+	MATERIAL_TEXTURE_SPECULAR,
+	MATERIAL_TEXTURE_NORMALS,
+	MATERIAL_TEXTURE_BUMP,
+	MATERIAL_TEXTURE_SLOT_COUNT
+};
+
 struct Material
 {
 	std::string name;
 	glm::vec3 albedo;
 	glm::vec3 emissive;
 	f32 smoothness;
-	u32 albedoTextureIdx;
-	u32 emissiveTextureIdx;
-	u32 specularTextureIdx;
-	u32 normalsTextureIdx;
-	u32 bumpTextureIdx;
+	u32 textureIdx[MATERIAL_TEXTURE_SLOT_COUNT]; // In App::textures, UINT32_MAX if the slot is empty
+	u32 requestedSlots;                          // Slot bits already requested by the programs drawing it
 };
 struct Mesh
 {
 	std::vector<Submesh> submeshes;
 	GLuint vertexBufferHandle;
 	GLuint indexBufferHandle;
+
+	glm::vec3 boundsCenter;
+	f32 boundsRadius;
+	u32 lodCount;
+	f32 lodErrors[MAX_MESH_LODS]; // Worst error of each level among all the submeshes, in model units
 };
 
-u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
+enum ModelImportFlags
+{
+	IMPORT_DEFAULT  = 0,
+	IMPORT_QUANTIZE       = 1 << 0, // Packed vertex attributes and 16 bit indices
+	IMPORT_NODE_HIERARCHY = 1 << 1  // One child entity per node sharing the meshes, instead of baking the node transforms into the vertices
+};
+
+u32 GetIndexSize(GLenum indexType);
+
+u32 LoadModel(App* app, const char* filename, std::string name,glm::vec3 position, glm::vec3 rotation, glm::vec3 scale, u32 importFlags = IMPORT_DEFAULT);
 
 #endif // MODEL_LOADER_H
\ No newline at end of file
@@ -24,6 +24,18 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
     return buffer;
 }
 
+// New storage for the buffer, the old contents are lost. The handle is kept, so the VAOs and
+// bindings referencing the buffer don't need updating
+void ResizeBuffer(Buffer& buffer, u32 size, GLenum usage, const void* data)
+{
+    buffer.size = size;
+    buffer.head = 0;
+
+    glBindBuffer(buffer.type, buffer.handle);
+    glBufferData(buffer.type, buffer.size, data, usage);
+    glBindBuffer(buffer.type, 0);
+}
+
 #define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
@@ -40,6 +52,20 @@ void MapBuffer(Buffer& buffer, GLenum access)
     buffer.head = 0;
 }
 
+// Maps the first size bytes. Unlike MapBuffer, the head is kept so the data already laid out
+// can be rewritten in place
+void MapBufferRange(Buffer& buffer, u32 size, GLbitfield access)
+{
+    glBindBuffer(buffer.type, buffer.handle);
+    buffer.data = (u8*)glMapBufferRange(buffer.type, 0, size, access);
+}
+
+// Only for buffers mapped with GL_MAP_FLUSH_EXPLICIT_BIT
+void FlushBufferRange(Buffer& buffer, u32 offset, u32 size)
+{
+    glFlushMappedBufferRange(buffer.type, offset, size);
+}
+
 void UnmapBuffer(Buffer& buffer)
 {
     glUnmapBuffer(buffer.type);
@@ -11,8 +11,11 @@ struct Buffer
 bool IsPowerOf2(u32 value);
 u32 Align(u32 value, u32 alignment);
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
+void ResizeBuffer(Buffer& buffer, u32 size, GLenum usage, const void* data = NULL);
 void BindBuffer(const Buffer& buffer);
 void MapBuffer(Buffer& buffer, GLenum access);
+void MapBufferRange(Buffer& buffer, u32 size, GLbitfield access);
+void FlushBufferRange(Buffer& buffer, u32 offset, u32 size);
 void UnmapBuffer(Buffer& buffer);
 void AlignHead(Buffer& buffer, u32 alignment);
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "Global.h"
+#include <chrono>
+#include <mutex>
+
+// Written only by its thread. The writer never waits for the readers, so a reader copies the
+// events and then discards the ones that may have been overwritten meanwhile.
+struct TraceRing
+{
+    std::atomic<u64> head;
+    u32              threadId;
+    TraceRing*       next;
+    TraceEvent       events[TRACE_RING_SIZE];
+};
+
+std::atomic<bool> GlobalTraceEnabled(false);
+TraceRing*        GlobalTraceRings = NULL; // Never released, the events of finished threads can still be written
+std::mutex        GlobalTraceRingsMutex;
+u32               GlobalTraceThreadCount = 0;
+thread_local TraceRing* GlobalThreadTraceRing = NULL;
+
+u64 GetTraceTimestamp()
+{
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RecordTraceEvent(const char* name, u64 begin, u64 end)
+{
+    TraceRing* ring = GlobalThreadTraceRing;
+    if (!ring)
+    {
+        ring = new TraceRing;
+        ring->head = 0;
+
+        // Threads of the job system keep their index, so the main thread is always 0
+        std::lock_guard<std::mutex> lock(GlobalTraceRingsMutex);
+        u32 jobThreadIndex = GetJobThreadIndex();
+        ring->threadId = jobThreadIndex != UINT32_MAX ? jobThreadIndex : MAX_JOB_THREADS + GlobalTraceThreadCount++;
+        ring->next = GlobalTraceRings;
+        GlobalTraceRings = ring;
+        GlobalThreadTraceRing = ring;
+    }
+
+    u64 head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& event = ring->events[head & (TRACE_RING_SIZE - 1)];
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void SetTraceEnabled(bool enabled)
+{
+    GlobalTraceEnabled = enabled;
+}
+
+bool WriteChromeTrace(const char* filepath)
+{
+    FILE* file = fopen(filepath, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing trace %s", filepath);
+        return false;
+    }
+
+    TempArena temp = BeginTempArena(GetScratchArena());
+    TraceEvent* events = ArenaPushArray(temp.arena, TraceEvent, TRACE_RING_SIZE);
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    u32 eventCount = 0;
+
+    std::lock_guard<std::mutex> lock(GlobalTraceRingsMutex);
+    for (TraceRing* ring = GlobalTraceRings; ring; ring = ring->next)
+    {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                first ? "" : ",\n", ring->threadId, ring->threadId == 0 ? "Main thread" : "Thread", ring->threadId);
+        first = false;
+
+        u64 end = ring->head.load(std::memory_order_acquire);
+        u64 begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (u64 i = begin; i < end; ++i)
+            events[i - begin] = ring->events[i & (TRACE_RING_SIZE - 1)];
+
+        // Whatever the writer lapped while copying is not reliable
+        u64 newEnd = ring->head.load(std::memory_order_acquire);
+        u64 validBegin = newEnd > TRACE_RING_SIZE ? newEnd - TRACE_RING_SIZE : 0;
+
+        for (u64 i = glm::max(begin, validBegin); i < end; ++i)
+        {
+            const TraceEvent& event = events[i - begin];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    event.name, ring->threadId, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+            eventCount++;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    EndTempArena(temp);
+
+    ILOG("Trace written to %s (%u events)", filepath, eventCount);
+    return true;
+}
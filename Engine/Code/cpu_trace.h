@@ -0,0 +1,61 @@
+//
+// cpu_trace.h: Scoped CPU timing markers. Every thread records its markers into its own ring
+// buffer and the last events of all the threads can be written as a Chrome trace_event JSON
+// (open it with chrome://tracing or ui.perfetto.dev).
+//
+
+#pragma once
+#ifndef CPU_TRACE_H
+#define CPU_TRACE_H
+
+#define TRACE_RING_SIZE 16384 // Events per thread, power of 2
+
+extern std::atomic<bool> GlobalTraceEnabled;
+
+struct TraceEvent
+{
+    const char* name;
+    u64         begin; // Nanoseconds
+    u64         end;
+};
+
+u64 GetTraceTimestamp();
+
+void RecordTraceEvent(const char* name, u64 begin, u64 end);
+
+void SetTraceEnabled(bool enabled);
+
+/**
+ * Writes the events still in the ring buffers of every thread. Returns false if the file
+ * can't be written.
+ */
+bool WriteChromeTrace(const char* filepath);
+
+/**
+ * When tracing is disabled a marker costs a load and a branch. name must be a string
+ * literal (only the pointer is recorded).
+ */
+struct TraceScope
+{
+    const char* name;
+    u64         begin;
+
+    TraceScope(const char* name) : name(name), begin(0)
+    {
+        if (GlobalTraceEnabled.load(std::memory_order_relaxed))
+            begin = GetTraceTimestamp();
+    }
+
+    ~TraceScope()
+    {
+        if (begin != 0)
+            RecordTraceEvent(name, begin, GetTraceTimestamp());
+    }
+};
+
+#define TRACE_SCOPE_CONCAT2(a, b) a##b
+#define TRACE_SCOPE_CONCAT(a, b) TRACE_SCOPE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_SCOPE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_FUNCTION() TRACE_SCOPE(__FUNCTION__)
+
+#endif // CPU_TRACE_H
@@ -93,6 +93,8 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
 {
+    TRACE_FUNCTION();
+
     String programSource = ReadTextFile(filepath);
 
     Program program = {};
@@ -100,8 +102,16 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
     program.filepath = filepath;
     program.programName = programName;
     program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.materialTextureSlots = GetMaterialTextureSlots(program.handle);
     app->programs.push_back(program);
 
+    // The blocks written from C++ structs must have the same layout in every program
+    ValidateGpuBlock<GlobalParams>(program.handle, "GlobalParams");
+    ValidateGpuStorageArray<ObjectParams>(program.handle, "ObjectBuffer");
+    ValidateGpuStorageArray<GpuMaterial>(program.handle, "MaterialBuffer");
+    ValidateGpuStorageArray<ShadowView>(program.handle, "ShadowBuffer");
+    ValidateGpuBlock<ViewParams>(program.handle, "ViewParams");
+
     return app->programs.size() - 1;
 }
 
@@ -154,30 +164,70 @@ GLuint CreateTexture2DFromImage(Image image)
     return texHandle;
 }
 
-u32 LoadTexture2D(App* app, const char* filepath)
+u32 RegisterTexture2D(App* app, const char* filepath)
 {
     for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
         if (app->textures[texIdx].filepath == filepath)
             return texIdx;
 
-    Image image = LoadImage(filepath);
+    // Only the header is read
+    Texture tex = {};
+    i32 channels = 0;
+    if (!stbi_info(filepath, &tex.size.x, &tex.size.y, &channels))
+    {
+        ELOG("Could not open file %s", filepath);
+        return UINT32_MAX;
+    }
+    tex.filepath = filepath;
+    tex.levelCount = GetMipLevelCount(tex.size);
+
+    app->textures.push_back(tex);
+    return app->textures.size() - 1;
+}
+
+void MakeTextureResident(App* app, u32 textureIdx)
+{
+    TRACE_FUNCTION();
+
+    Texture& tex = app->textures[textureIdx];
+    if (tex.handle)
+        return;
 
+    Image image = LoadImage(tex.filepath.c_str());
     if (image.pixels)
     {
-        Texture tex = {};
         tex.handle = CreateTexture2DFromImage(image);
-        tex.filepath = filepath;
-
-        u32 texIdx = app->textures.size();
-        app->textures.push_back(tex);
-
+        tex.size = image.size;
+        tex.levelCount = GetMipLevelCount(tex.size);
+        tex.residentLevel = 0;
         FreeImage(image);
-        return texIdx;
     }
-    else
+}
+
+u32 LoadTexture2D(App* app, const char* filepath)
+{
+    TRACE_FUNCTION();
+
+    u32 texIdx = RegisterTexture2D(app, filepath);
+    if (texIdx != UINT32_MAX)
+        MakeTextureResident(app, texIdx);
+    return texIdx;
+}
+
+void RequestMaterialTextures(App* app, u32 materialIdx, const Program& program)
+{
+    Material& material = app->materials[materialIdx];
+    u32 newSlots = program.materialTextureSlots & ~material.requestedSlots;
+    if (!newSlots)
+        return;
+
+    for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
     {
-        return UINT32_MAX;
+        u32 texIdx = material.textureIdx[slot];
+        if ((newSlots & (1 << slot)) && texIdx != UINT32_MAX && !app->textures[texIdx].handle)
+            app->textures[texIdx].requested = true;
     }
+    material.requestedSlots |= newSlots;
 }
 
 bool DrawVec3(const char* name, glm::vec3& vec)
@@ -259,32 +309,28 @@ void ReadyProgramAttributes(Program& program)
         program.vertexInputLayout.attributes.push_back({ (u8)attributeLocation, (u8)size });
     }
 }
-void ReadyTexture2D(App* app, GLuint* i, int m_a, int m_b, int m_c)
+// The water targets follow the render size and the resolution scale. The reflection is kept
+// between frames, so it's only released when its size changes.
+void ResizeWaterBuffer(App* app)
 {
-    glGenTextures(1, i);
-    glBindTexture(GL_TEXTURE_2D, *i);
-    glTexImage2D(GL_TEXTURE_2D, 0, m_a, app->displaySize.x, app->displaySize.y, 0, m_b, m_c, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-}
-void ReadyTextureWaterBuffer(App* app, GLuint* i, int m_t, int m_v)
-{
-    glGenTextures(1, i);
-    glBindTexture(GL_TEXTURE_2D, *i);
-    glTexImage2D(GL_TEXTURE_2D, 0, m_t, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, m_v, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    WaterBuffer& water = app->waterbuffer;
+    ivec2 size = glm::max(ivec2(glm::vec2(app->renderTargets.size) * water.resolutionScale), ivec2(1, 1));
+    if (size == water.size)
+        return;
+
+    water.size = size;
+    water.reflectionValid = false;
+    if (water.rtReflection)
+    {
+        ReleaseRenderTarget(app->renderTargets, water.rtReflection);
+        water.rtReflection = 0;
+    }
 }
 
 void Init(App* app)
 {
+    TRACE_FUNCTION();
+
     // TODO: Initialize your resources here!
     // - vertex buffers
     // - element/index buffers
@@ -320,8 +366,13 @@ void Init(App* app)
     app->texturedMeshProgramIdx = LoadProgram(app, "geometryShaders.glsl", "TEXTURED_GEOMETRY");
     app->frameBufferProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
     app->forwardBufferProgramIdx = LoadProgram(app, "ForwardShader.glsl", "TEXTURED_GEOMETRY");
+    app->programs[app->forwardBufferProgramIdx].materialTextureSlots = 1 << MATERIAL_TEXTURE_ALBEDO; // Bound as uTexture
     app->skyboxProgramIdx = LoadProgram(app, "skyboxShader.glsl", "TEXTURED_GEOMETRY");
+    app->shadowDepthProgramIdx = LoadProgram(app, "geometryShaders.glsl", "SHADOW_DEPTH");
     app->waterProgramIdx = LoadProgram(app, "waterShader.glsl", "TEXTURED_GEOMETRY");
+    app->waterSceneProgramIdx = LoadProgram(app, "waterShader.glsl", "WATER_SCENE");
+    app->waterOcclusionProgramIdx = LoadProgram(app, "waterShader.glsl", "WATER_OCCLUSION");
+    glGenQueries(WATER_OCCLUSION_QUERIES, app->waterbuffer.occlusionQueries);
 
     Program& textureMeshProgram = app->programs[app->texturedMeshProgramIdx];
     glGetProgramiv(textureMeshProgram.handle, GL_ACTIVE_ATTRIBUTES, &textureMeshProgram.lenght);
@@ -343,8 +394,19 @@ void Init(App* app)
     glGetProgramiv(waterBufferProgram.handle, GL_ACTIVE_ATTRIBUTES, &waterBufferProgram.lenght);
     ReadyProgramAttributes(waterBufferProgram);
 
+    Program& waterSceneProgram = app->programs[app->waterSceneProgramIdx];
+    glGetProgramiv(waterSceneProgram.handle, GL_ACTIVE_ATTRIBUTES, &waterSceneProgram.lenght);
+    ReadyProgramAttributes(waterSceneProgram);
+
+    Program& shadowDepthProgram = app->programs[app->shadowDepthProgramIdx];
+    glGetProgramiv(shadowDepthProgram.handle, GL_ACTIVE_ATTRIBUTES, &shadowDepthProgram.lenght);
+    ReadyProgramAttributes(shadowDepthProgram);
+
     app->depth = 0;
 
+    app->lodEnabled = true;
+    app->lodErrorThreshold = 1.0f;
+
 
     app->glInfo.glVersion = reinterpret_cast<const char*> (glGetString(GL_VERSION));
     app->glInfo.glRender = reinterpret_cast<const char*> (glGetString(GL_RENDERER));
@@ -354,15 +416,24 @@ void Init(App* app)
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
     glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
 
-    app->uniformBuffer = CreateBuffer(app->maxUniformBufferSize, GL_UNIFORM_BUFFER, GL_STREAM_DRAW);
+    // Allocated by Update once the entities are known
+    app->objectBuffer = CreateBuffer(0, GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+    app->objectIndexBuffer = CreateBuffer(0, GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+    InitMaterialTable(app->materialTable);
+    InitTextureStreaming(app->textureStreaming);
+    InitShadowAtlas(app->shadowAtlas);
+    InitFrameCapture(app->frameCapture);
+
+    InitGpuProfiler(app->gpuProfiler);
 
     app->lightBuffer = CreateBuffer(app->maxUniformBufferSize, GL_UNIFORM_BUFFER, GL_STREAM_DRAW);
+    app->viewBuffer = CreateBuffer(VIEW_COUNT * Align(sizeof(ViewParams), app->uniformBlockAlignment), GL_UNIFORM_BUFFER, GL_STREAM_DRAW);
 
     app->waterPlane = LoadModel(app,"Water/Plane.obj", std::string("Plane"), {0,-2,0}, {0,0,0}, {1,1,1});
     app->waterID = LoadTexture2D(app, "Water/dudvmap.png");
     //app->entities[app->waterPlane].materialIdx.push_back(app->waterID);
-    app->modelPatrick = LoadModel(app,"Patrick/Patrick.obj", std::string("Patrick"), {-5,1,1}, {0,0,0}, {1,1,1});
-    app->modelPatrick1 = LoadModel(app,"Patrick/Patrick.obj", std::string("Patri"), {1,1,1}, {0,0,0}, {1,1,1});
+    app->modelPatrick = LoadModel(app,"Patrick/Patrick.obj", std::string("Patrick"), {-5,1,1}, {0,0,0}, {1,1,1}, IMPORT_QUANTIZE);
+    app->modelPatrick1 = LoadModel(app,"Patrick/Patrick.obj", std::string("Patri"), {1,1,1}, {0,0,0}, {1,1,1}, IMPORT_QUANTIZE);
     
 
     app->boxFaces = {   "EnviromentMapping/right.jpg", 
@@ -390,64 +461,7 @@ void Init(App* app)
     //app->lights.emplace_back(lightdios1);
 
     ///////////////////////////////////////////FrameBuffer///////////////////////////////////////////
-
-    ReadyTexture2D(app, &app->frameBuffer.colorAttachmentHandle, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
-    ReadyTexture2D(app, &app->frameBuffer.normalAttachment, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
-    ReadyTexture2D(app, &app->frameBuffer.positionAttachment, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
-    ReadyTexture2D(app, &app->frameBuffer.depthAttachmentHandle, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT);
-
-    glGenFramebuffers(1, &app->frameBuffer.frameBufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->frameBuffer.frameBufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->frameBuffer.colorAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->frameBuffer.normalAttachment, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->frameBuffer.positionAttachment, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->frameBuffer.depthAttachmentHandle,0);
-
-    app->frameBuffer.frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (app->frameBuffer.frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (app->frameBuffer.frameBufferStatus)
-        {
-            case GL_FRAMEBUFFER_UNDEFINED:                      ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:          ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:  ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-            case GL_FRAMEBUFFER_UNSUPPORTED:                    ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:       ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-            default: ELOG("Unknown framebuffer status error");
-        }
-    }
-
-    glDrawBuffers(1, &app->frameBuffer.colorAttachmentHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    /////////////////////////////////////////water buffer//////////////////////////////
-    ReadyTextureWaterBuffer(app, &app->waterbuffer.rtReflection, GL_RGBA8, GL_UNSIGNED_BYTE);
-    ReadyTextureWaterBuffer(app, &app->waterbuffer.rtRefraction, GL_RGBA8, GL_UNSIGNED_BYTE);
-    ReadyTextureWaterBuffer(app, &app->waterbuffer.rtRefractionDepth, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT);
-    ReadyTextureWaterBuffer(app, &app->waterbuffer.rtReflectionDepth, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT);
-
-    glGenFramebuffers(1, &app->waterbuffer.fboReflection.frameBufferHandle);
-    app->waterbuffer.fboReflection.bind();
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->waterbuffer.rtReflection, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->waterbuffer.rtReflectionDepth, 0);
-
-
-    GLuint drawReflections[] = { GL_COLOR_ATTACHMENT0 };
-    glDrawBuffers(ARRAY_COUNT(drawReflections), drawReflections);
-
-    app->waterbuffer.fboReflection.unbind();
-
-    glGenFramebuffers(1, &app->waterbuffer.fboRefraction.frameBufferHandle);
-    app->waterbuffer.fboRefraction.bind();
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->waterbuffer.rtRefraction, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->waterbuffer.rtRefractionDepth, 0);
-    GLuint drawRefractions[] = { GL_COLOR_ATTACHMENT0 };
-    glDrawBuffers(ARRAY_COUNT(drawRefractions), drawRefractions);
-    app->waterbuffer.fboRefraction.unbind();
-
+    // The G-buffer and water targets come from app->renderTargets every frame
 
     GLint numExtensions = 0;
     glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
@@ -456,7 +470,7 @@ void Init(App* app)
         app->glInfo.glExtension.push_back(reinterpret_cast<const char*> (glGetStringi(GL_EXTENSIONS, GLuint(i))));
     }
 
-    app->finalAttachment = app->frameBuffer.colorAttachmentHandle;
+    app->displayedAttachment = GBUFFER_ALBEDO;
 
     ///////////////////////////////////////////Envir Map///////////////////////////////////////////
 
@@ -573,9 +587,182 @@ void ShowChildren(App* app)
 
 void Gui(App* app)
 {
+    TRACE_FUNCTION();
+
     ImGui::Begin("Info");
     ImGui::Dummy(ImVec2(0.0f, 15.0f));
     ImGui::Text("FPS: %f", 1.0f / app->deltaTime);
+#ifdef GL_STATS_ENABLED
+    const GlStats& glStats = GetGlStats();
+    ImGui::Text("Draw calls: %u  Triangles: %llu", glStats.drawCalls, glStats.triangles);
+    ImGui::Text("Binds: %u programs, %u VAOs, %u textures, %u buffers, %u framebuffers",
+                glStats.programBinds, glStats.vertexArrayBinds, glStats.textureBinds, glStats.bufferBinds, glStats.framebufferBinds);
+    ImGui::Text("Uniform updates: %u  Uploaded: %.2f KB", glStats.uniformUpdates, glStats.uploadedBytes / 1024.0f);
+#endif
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+    ImGui::Separator();
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    ImGui::Checkbox("Mesh LODs", &app->lodEnabled);
+    ImGui::SliderFloat("LOD error (px)", &app->lodErrorThreshold, 0.1f, 10.0f, "%.1f");
+    ImGui::Text("Triangles: %u (saved by LODs: %u)", app->lodTrianglesRendered, app->lodTrianglesSaved);
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("GPU passes (ms)"))
+    {
+        for (const GpuPassTiming& timing : app->gpuProfiler.timings)
+        {
+            ImGui::Text("%*s%s: %.3f (last %.3f)", timing.depth * 2, "", timing.name, timing.averageMs, timing.lastMs);
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Memory arenas"))
+    {
+        ArenaStats arenaStats[32];
+        u32 arenaCount = glm::min(GetArenaStats(arenaStats, ARRAY_COUNT(arenaStats)), (u32)ARRAY_COUNT(arenaStats));
+        for (u32 i = 0; i < arenaCount; ++i)
+        {
+            const ArenaStats& stats = arenaStats[i];
+            ImGui::Text("%s: %.2f KB used, %.2f KB peak, %.2f MB committed", stats.name,
+                        stats.used / 1024.0f, stats.highWaterMark / 1024.0f, stats.committed / (1024.0f * 1024.0f));
+        }
+        ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Water"))
+    {
+        WaterBuffer& water = app->waterbuffer;
+        ImGui::SliderFloat("Resolution scale", &water.resolutionScale, 0.25f, 1.0f, "%.2f");
+        ImGui::Text("Targets: %dx%d", water.size.x, water.size.y);
+        int reflectionInterval = (int)water.reflectionInterval;
+        if (ImGui::SliderInt("Reflection every N frames", &reflectionInterval, 1, 8))
+        {
+            water.reflectionInterval = (u32)reflectionInterval;
+        }
+        ImGui::SliderFloat("Slow camera speed", &water.slowCameraSpeed, 0.0f, 20.0f, "%.1f");
+        ImGui::Text("Submeshes: %u reflected, %u refracted, %u culled", water.reflectionSubmeshes, water.refractionSubmeshes, water.culledSubmeshes);
+        ImGui::Checkbox("Refraction from a copy of the scene", &water.refractionFromSceneCopy);
+        ImGui::Checkbox("Occlusion culling", &water.occlusionCulling);
+        ImGui::Text("Water passes discarded in %u of %u tested frames", water.occlusionHiddenFrames, water.occlusionTestedFrames);
+
+        const char* reflectionModes[] = { "Planar", "Screen-space" };
+        int reflectionMode = (int)water.reflectionMode;
+        if (ImGui::Combo("Reflection", &reflectionMode, reflectionModes, IM_ARRAYSIZE(reflectionModes)))
+        {
+            water.reflectionMode = (u32)reflectionMode;
+        }
+        for (u32 i = 0; i < WATER_REFLECTION_MODE_COUNT; ++i)
+        {
+            if (water.reflectionCostMs[i] > 0.0f)
+                ImGui::Text("%s reflection + water: %.3f ms", reflectionModes[i], water.reflectionCostMs[i]);
+            else
+                ImGui::Text("%s reflection + water: not measured", reflectionModes[i]);
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Frame graph"))
+    {
+        for (const FrameGraphPass& pass : app->frameGraph.passes)
+        {
+            ImGui::Text("%s%s", pass.name, pass.culled ? " (culled)" : "");
+        }
+        ImGui::Text("%u textures, %u versions", (u32)app->frameGraph.textures.size(), (u32)app->frameGraph.nodes.size());
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Render targets"))
+    {
+        const RenderTargetPool& pool = app->renderTargets;
+        ImGui::Text("Render size: %dx%d", pool.size.x, pool.size.y);
+
+        u64 totalBytes = 0;
+        for (const RenderTarget& target : pool.targets)
+        {
+            totalBytes += GetRenderTargetBytes(target);
+            ImGui::Text("0x%04x %dx%d x%u%s", target.format, target.size.x, target.size.y, target.samples, target.acquired ? " (acquired)" : "");
+        }
+        ImGui::Text("%u targets, %.2f MB, %u framebuffers", (u32)pool.targets.size(), totalBytes / (1024.0f * 1024.0f), (u32)pool.framebuffers.size());
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Material table"))
+    {
+        const MaterialTable& table = app->materialTable;
+        for (const TextureArray& array : table.arrays)
+        {
+            ImGui::Text("0x%04x %dx%d, %u layers, mips %u to %u", array.format, array.size.x, array.size.y, array.layerCount, array.baseLevel, array.levels - 1);
+        }
+        ImGui::Text("%u materials, %u arrays, %.2f MB", table.materialCount, (u32)table.arrays.size(), table.bytes / (1024.0f * 1024.0f));
+        ImGui::Text("Textures: %u resident, %u never sampled (%.2f MB saved)", table.residentTextures, table.deferredTextures, table.deferredBytes / (1024.0f * 1024.0f));
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Texture streaming"))
+    {
+        TextureStreaming& streaming = app->textureStreaming;
+        ImGui::Checkbox("Enabled (the levels are frozen otherwise)", &streaming.enabled);
+        ImGui::SliderInt("Budget (MB)", &streaming.budgetMB, 8, 1024);
+        ImGui::Text("Resident: %.2f MB textures + %.2f MB material table, %u streamed in, %u evicted",
+                    streaming.residentBytes / (1024.0f * 1024.0f), app->materialTable.bytes / (1024.0f * 1024.0f), streaming.streamedIn, streaming.evicted);
+        for (const Texture& texture : app->textures)
+        {
+            if (texture.streamed && texture.handle)
+                ImGui::Text("%s: level %u (needs %u) of %u", texture.filepath.c_str(), texture.residentLevel, texture.wantedLevel, texture.levelCount);
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Shadow atlas"))
+    {
+        ShadowAtlas& atlas = app->shadowAtlas;
+        ImGui::Checkbox("Enabled", &atlas.enabled);
+        ImGui::Text("Tiles: %u of %u, %u rendered and %u cached this frame", atlas.usedViews, SHADOW_MAX_VIEWS, atlas.renderedViews, atlas.cachedViews);
+        ImGui::Text("Submeshes: %u drawn, %u culled", atlas.drawnSubmeshes, atlas.culledSubmeshes);
+        ImGui::Text("Renders since the start: %u static, %u dynamic", atlas.staticRenders, atlas.dynamicRenders);
+        for (u32 i = 0; i < (u32)app->lights.size(); ++i)
+        {
+            Light& light = app->lights[i];
+            ImGui::PushID(i);
+            ImGui::Text("%s %u:", light.name.c_str(), i);
+            ImGui::SameLine();
+            ImGui::Checkbox("Shadows", &light.castsShadows);
+            ImGui::SameLine();
+            ImGui::Checkbox("Static", &light.isStatic);
+            ImGui::PopID();
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    if (ImGui::TreeNode("Frame capture"))
+    {
+        FrameCapture& capture = app->frameCapture;
+        const char* sources[] = { "Final", "G-buffer albedo", "G-buffer normals", "G-buffer position", "G-buffer depth" };
+        const char* formats[] = { "PNG", "Raw" };
+        ImGui::Combo("Source", &capture.source, sources, CAPTURE_SOURCE_COUNT);
+        ImGui::Combo("Format", &capture.format, formats, CAPTURE_FORMAT_COUNT);
+        if (ImGui::Button("Capture frame"))
+            capture.requested = true;
+        ImGui::SameLine();
+        ImGui::Checkbox("Every frame", &capture.continuous);
+        ImGui::Text("%u captured, %u written, %u queued, %u dropped", capture.captureCount, GetFrameCaptureWritten(), GetFrameCaptureQueued(), capture.dropped);
+        ImGui::TreePop();
+    }
+    ImGui::Dummy(ImVec2(0.0f, 15.0f));
+
+    bool traceEnabled = GlobalTraceEnabled;
+    if (ImGui::Checkbox("CPU trace (T to save trace.json)", &traceEnabled))
+    {
+        SetTraceEnabled(traceEnabled);
+    }
     ImGui::Dummy(ImVec2(0.0f, 15.0f));
     ImGui::Separator();
     ImGui::Dummy(ImVec2(0.0f, 15.0f));
@@ -584,9 +771,24 @@ void Gui(App* app)
     {
         ImGui::OpenPopup("OpenGL Info");
     }
-    if (DrawVec3("Position: ", app->entities[app->selectedEntity].position))
+    u32 selectedTransform = app->entities[app->selectedEntity].transformIndex;
+    glm::vec3 selectedPosition = GetPosition(app->transforms, selectedTransform);
+    if (DrawVec3("Position: ", selectedPosition))
+    {
+        SetPosition(app->transforms, selectedTransform, selectedPosition);
+    }
+
+    Mesh& selectedMesh = app->meshes[app->entities[app->selectedEntity].modelIndex];
+    if (ImGui::TreeNode("Vertex cache (ACMR / ATVR)"))
     {
-        app->entities[app->selectedEntity].worldMatrix = app->entities[app->selectedEntity].TransformPositionScale(app->entities[app->selectedEntity].position, glm::vec3(1.0f));
+        for (u32 i = 0; i < selectedMesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = selectedMesh.submeshes[i];
+            ImGui::Text("Submesh %u: %.3f -> %.3f / %.3f -> %.3f", i,
+                        submesh.cacheStatsBefore.acmr, submesh.cacheStatsAfter.acmr,
+                        submesh.cacheStatsBefore.atvr, submesh.cacheStatsAfter.atvr);
+        }
+        ImGui::TreePop();
     }
     ImGui::Dummy(ImVec2(0.0f, 15.0f));
     ImGui::Separator();
@@ -609,23 +811,23 @@ void Gui(App* app)
                 switch (n)
                 {
                 case 0:
-                    app->finalAttachment = app->frameBuffer.colorAttachmentHandle;
+                    app->displayedAttachment = GBUFFER_ALBEDO;
                     app->depth = 0;
                     break;
                 case 1:
-                    app->finalAttachment = app->frameBuffer.normalAttachment;
+                    app->displayedAttachment = GBUFFER_NORMALS;
                     app->depth = 0;
                     break;
                 case 2:
-                    app->finalAttachment = app->frameBuffer.positionAttachment;
+                    app->displayedAttachment = GBUFFER_POSITION;
                     app->depth = 0;
                     break;
                 case 3:
-                    app->finalAttachment = app->frameBuffer.depthAttachmentHandle;
+                    app->displayedAttachment = GBUFFER_DEPTH;
                     app->depth = 1;
                     break;
                 default:
-                    app->finalAttachment = app->frameBuffer.colorAttachmentHandle;
+                    app->displayedAttachment = GBUFFER_ALBEDO;
                     break;
                 }
             }
@@ -698,65 +900,177 @@ void Gui(App* app)
     ImGui::End();
 }
 
-void Update(App* app)
+#define ENTITY_CONSTANTS_PER_JOB 64
+#define LOD_HYSTERESIS 0.25f // Switching to a coarser level requires this much margin
+
+void SelectEntityLods(App* app)
 {
-    app->camera.Update(app->displaySize, app);
+    app->lodTrianglesRendered = 0;
+    app->lodTrianglesSaved = 0;
 
-    ///////////////////////////////////////////Lights///////////////////////////////////////////
-    //Global Param
-    MapBuffer(app->lightBuffer, GL_WRITE_ONLY);
+    // Pixels covered by one world unit at distance 1
+    const f32 pixelsPerUnit = app->displaySize.y * 0.5f * app->camera.projection[1][1];
 
-    app->globalParamsOffset = app->lightBuffer.head;
+    for (Entity& entity : app->entities)
+    {
+        Mesh& mesh = app->meshes[entity.modelIndex];
+
+        u32 lodLevel = 0;
+        if (app->lodEnabled)
+        {
+            const glm::mat4& world = app->transforms.worldMatrices[entity.transformIndex];
+            f32 scale = glm::max(glm::length(glm::vec3(world[0])), glm::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+            glm::vec3 center = glm::vec3(world * glm::vec4(mesh.boundsCenter, 1.0f));
+            f32 distance = glm::length(center - app->camera.cameraPos) - mesh.boundsRadius * scale;
+            distance = glm::max(distance, app->camera.zNear);
+
+            for (u32 i = mesh.lodCount - 1; i > 0; --i)
+            {
+                f32 threshold = app->lodErrorThreshold;
+                if (i > entity.lodLevel)
+                    threshold *= 1.0f - LOD_HYSTERESIS;
+
+                f32 projectedError = mesh.lodErrors[i] * scale * pixelsPerUnit / distance;
+                if (projectedError <= threshold)
+                {
+                    lodLevel = i;
+                    break;
+                }
+            }
+        }
+        entity.lodLevel = lodLevel;
+
+        for (u32 i : entity.submeshIndices)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            const SubmeshLod& lod = submesh.lods[glm::min(lodLevel, (u32)submesh.lods.size() - 1)];
+            app->lodTrianglesRendered += lod.indexCount / 3;
+            app->lodTrianglesSaved += (submesh.lods[0].indexCount - lod.indexCount) / 3;
+        }
+    }
+}
+
+// Makes room for objectCount objects in the per-object buffers. The capacity doubles, so
+// adding entities one by one only reallocates a few times, and the contents are rewritten by
+// the caller.
+void ReserveObjectBuffers(App* app, u32 objectCount)
+{
+    u32 capacity = app->objectBuffer.size / sizeof(ObjectParams);
+    if (objectCount <= capacity)
+        return;
+
+    capacity = glm::max(capacity, (u32)OBJECT_BUFFER_MIN_CAPACITY);
+    while (capacity < objectCount)
+        capacity *= 2;
 
-    PushVec3(app->lightBuffer, app->camera.cameraPos);
-    PushUInt(app->lightBuffer, app->lights.size());
+    std::vector<u32> indices(capacity);
+    for (u32 i = 0; i < capacity; ++i)
+        indices[i] = i;
 
-    for (u32 i = 0; i < app->lights.size(); ++i)
+    ResizeBuffer(app->objectBuffer, capacity * sizeof(ObjectParams), GL_DYNAMIC_DRAW);
+    ResizeBuffer(app->objectIndexBuffer, capacity * sizeof(u32), GL_STATIC_DRAW, indices.data());
+    ILOG("Per-object buffers grown to %u objects", capacity);
+}
+
+// Job over a range of entities
+void WriteEntityConstants(void* data, u32 begin, u32 end)
+{
+    App* app = (App*)data;
+    for (u32 i = begin; i < end; ++i)
     {
-        AlignHead(app->lightBuffer, sizeof(vec4));
+        const Entity& entity = app->entities[i];
+        if (!IsTransformChanged(app->transforms, entity.transformIndex))
+            continue;
+
+        ObjectParams objectParams = {};
+        objectParams.worldMatrix = app->transforms.worldMatrices[entity.transformIndex];
+        memcpy((u8*)app->objectBuffer.data + entity.objectIndex * sizeof(ObjectParams), &objectParams, sizeof(ObjectParams));
+    }
+}
+
+void Update(App* app)
+{
+    TRACE_FUNCTION();
 
-        Light& light = app->lights[i];
-        PushUInt(app->lightBuffer, light.type);
-        PushVec3(app->lightBuffer, light.color);
-        PushVec3(app->lightBuffer, light.direction);
-        PushVec3(app->lightBuffer, light.position);
-        PushData(app->lightBuffer, &light.intesity, sizeof(float));
-        int insda = 0;
+    app->camera.Update(app->displaySize, app);
 
+    ///////////////////////////////////////////Materials///////////////////////////////////////////
+    // Textures the last frame's draws asked for, then the table is rebuilt with them. It's
+    // uploaded once, and again only when a model brings new materials or textures.
+    bool texturesLoaded = false;
+    for (u32 i = 0; i < (u32)app->textures.size(); ++i)
+    {
+        if (app->textures[i].requested)
+        {
+            MakeTextureResident(app, i);
+            app->textures[i].requested = false;
+            texturesLoaded = true;
+        }
     }
 
-    app->globalParamsSize = app->lightBuffer.head - app->globalParamsOffset;
-    UnmapBuffer(app->lightBuffer);
-    ///////////////////////////////////////////EndLights//////////////////////////////////////////
+    if (texturesLoaded || app->materialTable.materialCount != app->materials.size())
+        BuildMaterialTable(app->materialTable, app->materials, app->textures);
+    ///////////////////////////////////////////EndMaterials///////////////////////////////////////////
     ///////////////////////////////////////////Entities///////////////////////////////////////////
-    MapBuffer(app->uniformBuffer, GL_WRITE_ONLY);
-    for (Entity& entity : app->entities)
+    // The per-object constants keep their place in the buffer, only new entities need laying out
+    if (app->entityConstantsCount != app->entities.size())
     {
-        entity.worldMatrix = entity.TransformPositionScale(entity.position, glm::vec3(1.0f));
-        entity.worldMatrixProjection = app->camera.projection * app->camera.view * glm::translate(entity.worldMatrix, vec3(0, 0, 0));
-        glBindBuffer(GL_UNIFORM_BUFFER, app->uniformBuffer.handle);
-                
-        AlignHead(app->uniformBuffer, app->uniformBlockAlignment);
-
-        entity.localParamsOffset = app->uniformBuffer.head;
+        ReserveObjectBuffers(app, app->entities.size());
+        for (u32 i = 0; i < (u32)app->entities.size(); ++i)
+            app->entities[i].objectIndex = i;
+        app->entityConstantsCount = app->entities.size();
+        MarkAllTransformsDirty(app->transforms);
+    }
 
-        glm::mat4 trans = entity.worldMatrix;
-        trans = glm::translate(trans, glm::vec3(0.0f, 0.0f, 0.0f));
-        PushMat4(app->uniformBuffer, trans);
-        PushMat4(app->uniformBuffer, app->camera.projection * app->camera.view * trans);
+    // Only the transforms that moved are recomposed and uploaded, the camera lives in ViewParams
+    u32 changedTransforms = UpdateTransforms(app->transforms);
+    if (changedTransforms > 0)
+    {
+        // The worker threads write the constants straight into the mapped buffer, at the offsets
+        // laid out above, and only the ranges written are flushed
+        MapBufferRange(app->objectBuffer, app->entities.size() * sizeof(ObjectParams), GL_MAP_WRITE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+        ParallelFor(app->entities.size(), ENTITY_CONSTANTS_PER_JOB, WriteEntityConstants, app);
 
-        entity.localParamSize = app->uniformBuffer.head - entity.localParamsOffset;
+        for (const Entity& entity : app->entities)
+            if (IsTransformChanged(app->transforms, entity.transformIndex))
+                FlushBufferRange(app->objectBuffer, entity.objectIndex * sizeof(ObjectParams), sizeof(ObjectParams));
 
+        UnmapBuffer(app->objectBuffer);
     }
+
+    SelectEntityLods(app);
+    UpdateTextureStreaming(app);
+    UpdateShadowAtlas(app);
     ///////////////////////////////////////////EndEntities///////////////////////////////////////////
-    UnmapBuffer(app->uniformBuffer);
+    ///////////////////////////////////////////Lights///////////////////////////////////////////
+    //Global Param, after the shadow atlas so the lights point at the tiles they have this frame
+    GlobalParams globalParams = {};
+    globalParams.lightCount = glm::min((u32)app->lights.size(), (u32)MAX_LIGHTS);
+    for (u32 i = 0; i < globalParams.lightCount; ++i)
+    {
+        const Light& light = app->lights[i];
+        GpuLight& gpuLight = globalParams.lights[i];
+        gpuLight.type = light.type;
+        gpuLight.color = light.color;
+        gpuLight.direction = light.direction;
+        gpuLight.position = light.position;
+        gpuLight.intensity = light.intesity;
+        gpuLight.shadowView = GetLightShadowView(app->shadowAtlas, i);
+    }
+
+    MapBuffer(app->lightBuffer, GL_WRITE_ONLY);
+    app->globalParamsOffset = app->lightBuffer.head;
+    app->globalParamsSize = sizeof(GlobalParams);
+    PushData(app->lightBuffer, &globalParams, sizeof(GlobalParams));
+    UnmapBuffer(app->lightBuffer);
+    ///////////////////////////////////////////EndLights//////////////////////////////////////////
 
     app->waterbuffer.move += 0.005 * app->deltaTime;
     app->waterbuffer.move = fmod(app->waterbuffer.move, 1);
     
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+GLuint FindVAO(App* app, Mesh& mesh, u32 submeshIndex, const Program& program)
 {
     Submesh& submesh = mesh.submeshes[submeshIndex];
     for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
@@ -772,8 +1086,15 @@ GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
     glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
 
+    bool usesObjectIndex = false;
     for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
     {
+        if (program.vertexInputLayout.attributes[i].location == OBJECT_INDEX_LOCATION)
+        {
+            usesObjectIndex = true;
+            continue;
+        }
+
         bool attributeWasLinked = false;
 
         for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
@@ -784,13 +1105,24 @@ GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
                 const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
                 const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset;
                 const u32 stride = submesh.vertexBufferLayout.stride;
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
+                const GLenum type = submesh.vertexBufferLayout.attributes[j].type;
+                const GLboolean normalized = submesh.vertexBufferLayout.attributes[j].normalized ? GL_TRUE : GL_FALSE;
+                glVertexAttribPointer(index, ncomp, type, normalized, stride, (void*)(u64)offset);
                 glEnableVertexAttribArray(index);
                 attributeWasLinked = true;
             }
         }
         assert(attributeWasLinked);
     }
+
+    // One value per instance, so the draws pick their object with the base instance
+    if (usesObjectIndex)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, app->objectIndexBuffer.handle);
+        glVertexAttribIPointer(OBJECT_INDEX_LOCATION, 1, GL_UNSIGNED_INT, sizeof(u32), (void*)0);
+        glVertexAttribDivisor(OBJECT_INDEX_LOCATION, 1);
+        glEnableVertexAttribArray(OBJECT_INDEX_LOCATION);
+    }
     glBindVertexArray(0);
 
     Vao vao = { vaoHandle, program.handle };
@@ -798,173 +1130,764 @@ GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
 
     return vaoHandle;
 }
-void PassWaterScene(Camera* camera, GLenum colorAttachment)
+// Draws a single instance whose base instance is the object index, which is how the shaders
+// find their ObjectParams (GL 4.3 has no gl_BaseInstance)
+void DrawSubmesh(const Program& program, const Submesh& submesh, u32 lodLevel, u32 objectIndex)
+{
+    glUniform3fv(glGetUniformLocation(program.handle, "uPositionOffset"), 1, glm::value_ptr(submesh.dequantizeOffset));
+    glUniform3fv(glGetUniformLocation(program.handle, "uPositionScale"), 1, glm::value_ptr(submesh.dequantizeScale));
+
+    const SubmeshLod& lod = submesh.lods[glm::min(lodLevel, (u32)submesh.lods.size() - 1)];
+    const u32 indexSize = GetIndexSize(submesh.indexType);
+    glDrawElementsInstancedBaseInstance(GL_TRIANGLES, lod.indexCount, submesh.indexType, (void*)(u64)(submesh.indexOffset + lod.indexOffset * indexSize), 1, objectIndex);
+}
+
+#define WATER_CLIP_BIAS 0.1f // Geometry this close to the water is drawn in both passes to avoid gaps at the edges
+
+// Whether some part of the submesh bounds is on the positive side of the plane
+// World space box around the transformed submesh bounds
+void GetSubmeshWorldBounds(const glm::mat4& world, const Submesh& submesh, glm::vec3& center, glm::vec3& extents)
+{
+    center = glm::vec3(world * glm::vec4(0.5f * (submesh.boundsMin + submesh.boundsMax), 1.0f));
+    extents = 0.5f * (submesh.boundsMax - submesh.boundsMin);
+    extents = glm::abs(glm::vec3(world[0])) * extents.x + glm::abs(glm::vec3(world[1])) * extents.y + glm::abs(glm::vec3(world[2])) * extents.z;
+}
+
+bool IsSubmeshInFrontOfPlane(const glm::mat4& world, const Submesh& submesh, const glm::vec4& plane)
 {
+    glm::vec3 center, extents;
+    GetSubmeshWorldBounds(world, submesh, center, extents);
+
+    glm::vec3 normal = glm::vec3(plane);
+    return glm::dot(normal, center) + plane.w + glm::dot(glm::abs(normal), extents) >= 0.0f;
+}
+
+// Renders the scene on the side of the water kept by clipPlane to the bound framebuffer.
+// Submeshes entirely on the other side are culled on the CPU, the rest are clipped with
+// gl_ClipDistance.
+void PassWaterScene(App* app, u32 view, const glm::vec4& clipPlane, u32& drawnSubmeshes)
+{
+    WaterBuffer& water = app->waterbuffer;
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CLIP_DISTANCE0);
 
-    ///??????????????????????????????????????xd
+    Program& program = app->programs[app->waterSceneProgramIdx];
+    glUseProgram(program.handle);
+
+    BindViewParams(app, view);
+    glUniform4fv(glGetUniformLocation(program.handle, "uClipPlane"), 1, glm::value_ptr(clipPlane));
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_PARAMS_BINDING, app->objectBuffer.handle);
+    BindMaterialTable(app->materialTable);
+    GLint materialIndexLocation = glGetUniformLocation(program.handle, "uMaterialIndex");
+
+    drawnSubmeshes = 0;
+    for (u32 entityIdx = 0; entityIdx < (u32)app->entities.size(); ++entityIdx)
+    {
+        if (entityIdx == app->waterPlane)
+            continue;
+
+        Entity& entity = app->entities[entityIdx];
+        Mesh& mesh = app->meshes[entity.modelIndex];
+        const glm::mat4& world = app->transforms.worldMatrices[entity.transformIndex];
+
+        for (u32 i : entity.submeshIndices)
+        {
+            if (!IsSubmeshInFrontOfPlane(world, mesh.submeshes[i], clipPlane))
+            {
+                water.culledSubmeshes++;
+                continue;
+            }
+
+            glBindVertexArray(FindVAO(app, mesh, i, program));
+            RequestMaterialTextures(app, entity.materialIdx[i], program);
+            glUniform1ui(materialIndexLocation, entity.materialIdx[i]);
+
+            DrawSubmesh(program, mesh.submeshes[i], entity.lodLevel, entity.objectIndex);
+            drawnSubmeshes++;
+        }
+    }
+    glBindVertexArray(0);
 
     glDisable(GL_CLIP_DISTANCE0);
 }
 
-void Render(App* app)
+// The reflection can be reused while the camera moves slowly and nothing moves in the scene
+bool ShouldRenderWaterReflection(App* app)
 {
-    switch (app->mode)
+    WaterBuffer& water = app->waterbuffer;
+
+    f32 cameraMovement = glm::max(glm::length(app->camera.cameraPos - water.previousCameraPos),
+                                  glm::length(app->camera.cameraTarget - water.previousCameraTarget));
+    bool cameraSlow = cameraMovement <= water.slowCameraSpeed * app->deltaTime;
+    water.previousCameraPos = app->camera.cameraPos;
+    water.previousCameraTarget = app->camera.cameraTarget;
+
+    water.framesSinceReflection++;
+    return !water.reflectionValid || !cameraSlow || app->transforms.worldChanged || water.framesSinceReflection >= water.reflectionInterval;
+}
+
+// Frame graph nodes and state shared by the passes of a frame
+struct FramePassData
+{
+    App*   app;
+    Camera reflectionCamera;
+    f32    waterHeight;
+
+    u32 reflection;
+    u32 refraction;
+    u32 refractionDepth;
+    u32 albedo;    // Latest versions of the G-buffer color and depth
+    u32 depth;
+    u32 sceneColor;
+    u32 sceneDepth;
+    glm::ivec2 sceneCopySize;
+    GLuint occlusionQuery; // Gates the water passes, 0 when they always run
+    glm::mat4 occlusionBox; // Unit cube to the water bounds
+    u32 displayed; // G-buffer attachment shown by the composite pass
+    u32 capture;   // Read by the capture pass, FRAME_GRAPH_NONE for the final image
+    u32 captureSource;
+};
+
+// Waits for the result if the GPU isn't done with the query yet
+void ReadWaterOcclusionQuery(WaterBuffer& water, u32 index)
+{
+    GLuint visible = 0;
+    glGetQueryObjectuiv(water.occlusionQueries[index], GL_QUERY_RESULT, &visible);
+    water.occlusionPending[index] = false;
+    water.occlusionTestedFrames++;
+    if (!visible)
     {
-    case DEFERRED:
+        // The reflection of that frame, if any, was discarded
+        water.occlusionHiddenFrames++;
+        water.reflectionValid = false;
+    }
+}
+
+void ReadAvailableWaterOcclusionQueries(WaterBuffer& water)
+{
+    for (u32 i = 0; i < WATER_OCCLUSION_QUERIES; ++i)
     {
-        /////////////Skybox///////
-        
-        glBindFramebuffer(GL_FRAMEBUFFER, app->waterbuffer.fboReflection.frameBufferHandle);
+        if (!water.occlusionPending[i])
+            continue;
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(water.occlusionQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+            ReadWaterOcclusionQuery(water, i);
+    }
+}
 
-        Camera reflectionCam = app->camera;
-        reflectionCam.cameraPos.y = -reflectionCam.cameraPos.y;
-        reflectionCam.pitch = -reflectionCam.pitch;
-        reflectionCam.view = glm::lookAt(reflectionCam.cameraPos, reflectionCam.cameraPos + reflectionCam.cameraForward, reflectionCam.cameraUp);
+void ExecuteWaterOcclusionPass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+    App* app = frame.app;
+    WaterBuffer& water = app->waterbuffer;
 
-        PassWaterScene(&reflectionCam, app->waterbuffer.fboReflection.frameBufferHandle);
-        //PassBackground(&reflectionCam, GL_COLOR_ATTACHMENT0);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    Program& program = app->programs[app->waterOcclusionProgramIdx];
+    glUseProgram(program.handle);
+    BindViewParams(app, VIEW_MAIN);
+    glUniformMatrix4fv(glGetUniformLocation(program.handle, "uBoxMatrix"), 1, GL_FALSE, &frame.occlusionBox[0][0]);
 
-        //////////////////////////////////////////////////// REFRACTION /////////////////////////////////////
-        // Render on this framebuffer render target
-        glBindFramebuffer(GL_FRAMEBUFFER, app->waterbuffer.fboRefraction.frameBufferHandle);
+    // Only the depth test matters, nothing is written
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_FALSE);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
 
-        Camera refractionCam = app->camera;
-        PassWaterScene(&reflectionCam, app->waterbuffer.fboReflection.frameBufferHandle);
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, frame.occlusionQuery);
+    glBindVertexArray(app->skyboxVAO); // Unit cube
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindVertexArray(0);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_LESS);
+    glUseProgram(0);
+
+    water.occlusionPending[water.occlusionQueryIndex] = true;
+}
+
+// The GPU waits for the occlusion result of this frame and skips the draws if the water is hidden
+void BeginWaterConditionalRender(const FramePassData& frame)
+{
+    if (frame.occlusionQuery)
+        glBeginConditionalRender(frame.occlusionQuery, GL_QUERY_WAIT);
+}
+
+void EndWaterConditionalRender(const FramePassData& frame)
+{
+    if (frame.occlusionQuery)
+        glEndConditionalRender();
+}
+
+void ExecuteReflectionPass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+    WaterBuffer& water = frame.app->waterbuffer;
+
+    glm::vec4 abovePlane = glm::vec4(0.0f, 1.0f, 0.0f, -frame.waterHeight + WATER_CLIP_BIAS);
+    BeginWaterConditionalRender(frame);
+    PassWaterScene(frame.app, VIEW_WATER_REFLECTION, abovePlane, water.reflectionSubmeshes);
+    SkyboxRender(frame.app, VIEW_WATER_REFLECTION);
+    EndWaterConditionalRender(frame);
+
+    water.framesSinceReflection = 0;
+    water.reflectionValid = true;
+}
+
+void ExecuteRefractionPass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
 
-        glBindVertexArray(0);
+    glm::vec4 belowPlane = glm::vec4(0.0f, -1.0f, 0.0f, frame.waterHeight + WATER_CLIP_BIAS);
+    BeginWaterConditionalRender(frame);
+    PassWaterScene(frame.app, VIEW_MAIN, belowPlane, frame.app->waterbuffer.refractionSubmeshes);
+    EndWaterConditionalRender(frame);
+}
 
-        glBindFramebuffer(GL_FRAMEBUFFER, app->frameBuffer.frameBufferHandle);
+void ExecuteGBufferPass(FrameGraph& graph, void* data)
+{
+    App* app = ((FramePassData*)data)->app;
 
-        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    glEnable(GL_DEPTH_TEST);
 
-        glEnable(GL_DEPTH_TEST);
-        
+    //glClearColor(0.1, 0.1, 0.1, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        GLuint drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
-        glDrawBuffers(3, drawBuffers);
+    Program& textureMeshProgram = app->programs[app->texturedMeshProgramIdx];
+    glUseProgram(textureMeshProgram.handle);
 
-        //glClearColor(0.1, 0.1, 0.1, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->lightBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    BindViewParams(app, VIEW_MAIN);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_PARAMS_BINDING, app->objectBuffer.handle);
 
-        Program& textureMeshProgram = app->programs[app->texturedMeshProgramIdx];
-        glUseProgram(textureMeshProgram.handle);
+    // The materials are fetched by index, no texture changes between draws
+    BindMaterialTable(app->materialTable);
+    BindShadowAtlas(app->shadowAtlas);
+    GLint materialIndexLocation = glGetUniformLocation(textureMeshProgram.handle, "uMaterialIndex");
 
-        glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->lightBuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    for (Entity entity : app->entities)
+    {
+        Mesh& mesh = app->meshes[entity.modelIndex];
 
-        for (Entity entity : app->entities)
+        for (u32 i : entity.submeshIndices)
         {
-            Mesh& mesh = app->meshes[entity.modelIndex];
+            GLuint vao = FindVAO(app, mesh, i, textureMeshProgram);
+            glBindVertexArray(vao);
 
-            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-            {
-                GLuint vao = FindVAO(mesh, i, textureMeshProgram);
-                glBindVertexArray(vao);
+            RequestMaterialTextures(app, entity.materialIdx[i], textureMeshProgram);
+            glUniform1ui(materialIndexLocation, entity.materialIdx[i]);
+
+            DrawSubmesh(textureMeshProgram, mesh.submeshes[i], entity.lodLevel, entity.objectIndex);
+        }
+    }
+    glBindVertexArray(0);
+}
+
+// Renders the tiles of the lights UpdateShadowAtlas found out of date, the other tiles keep
+// their depth. Only the positions are fetched, and each view culls the casters on its own.
+void ExecuteShadowPass(FrameGraph& graph, void* data)
+{
+    App* app = ((FramePassData*)data)->app;
+    ShadowAtlas& atlas = app->shadowAtlas;
 
-                u32 submeshMaterialIdx = entity.materialIdx[i];
-                Material& submeshMaterial = app->materials[submeshMaterialIdx];
+    Program& program = app->programs[app->shadowDepthProgramIdx];
+    glUseProgram(program.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_PARAMS_BINDING, app->objectBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SHADOW_VIEWS_BINDING, atlas.viewBuffer.handle);
+    GLint viewLocation = glGetUniformLocation(program.handle, "uShadowView");
 
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_SCISSOR_TEST);
+    // Slope scaled, against acne on the surfaces facing the light
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+
+    for (u32 lightIdx : atlas.pendingLights)
+    {
+        // Cached shadows are drawn once, so from the finest level. Dynamic ones follow the camera.
+        const ShadowLight& shadow = atlas.lights[lightIdx];
+        const bool cached = app->lights[lightIdx].isStatic;
 
-                glUniform1i(glGetUniformLocation(textureMeshProgram.handle, "uTexture"), 0);
-                
-                glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->uniformBuffer.handle, entity.localParamsOffset, entity.localParamSize);
+        for (u32 view = shadow.firstView; view < shadow.firstView + shadow.viewCount; ++view)
+        {
+            glm::ivec2 origin = glm::ivec2(glm::vec2(atlas.views[view].atlasRect) * (f32)SHADOW_ATLAS_SIZE);
+            glViewport(origin.x, origin.y, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+            glScissor(origin.x, origin.y, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            glUniform1ui(viewLocation, view);
+
+            glm::vec4 planes[6];
+            GetFrustumPlanes(atlas.views[view].viewProjection, planes);
+
+            for (u32 entityIdx = 0; entityIdx < (u32)app->entities.size(); ++entityIdx)
+            {
+                if (!IsShadowCaster(app, entityIdx))
+                    continue;
 
-                Submesh& submesh = mesh.submeshes[i];
-                glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+                const Entity& entity = app->entities[entityIdx];
+                Mesh& mesh = app->meshes[entity.modelIndex];
+                const glm::mat4& world = app->transforms.worldMatrices[entity.transformIndex];
+                for (u32 i : entity.submeshIndices)
+                {
+                    glm::vec3 center, extents;
+                    GetSubmeshWorldBounds(world, mesh.submeshes[i], center, extents);
+                    if (!IsBoxInFrustum(planes, center, extents))
+                    {
+                        atlas.culledSubmeshes++;
+                        continue;
+                    }
+
+                    glBindVertexArray(FindVAO(app, mesh, i, program));
+                    DrawSubmesh(program, mesh.submeshes[i], cached ? 0 : entity.lodLevel, entity.objectIndex);
+                    atlas.drawnSubmeshes++;
+                }
             }
         }
-        
-        SkyboxRender(app);
-        WaterRender(app);
+    }
+    glBindVertexArray(0);
+
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_SCISSOR_TEST);
+}
 
+void ExecuteSkyboxPass(FrameGraph& graph, void* data)
+{
+    App* app = ((FramePassData*)data)->app;
+    SkyboxRender(app, VIEW_MAIN);
+}
+
+void ExecuteSceneCopyPass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+    RenderTargetPool& pool = frame.app->renderTargets;
+    glm::ivec2 size = pool.size;
+    glm::ivec2 copySize = frame.sceneCopySize;
+
+    // The water pass draws into the G-buffer albedo and tests against its depth, so it can't
+    // sample them too
+    GLuint albedo = GetFrameGraphTexture(graph, frame.albedo);
+    GLuint depth = GetFrameGraphTexture(graph, frame.depth);
+    GLuint sceneColor = GetFrameGraphTexture(graph, frame.sceneColor);
+    GLuint sceneDepth = GetFrameGraphTexture(graph, frame.sceneDepth);
+
+    if (copySize == size)
+    {
+        glCopyImageSubData(albedo, GL_TEXTURE_2D, 0, 0, 0, 0, sceneColor, GL_TEXTURE_2D, 0, 0, 0, 0, size.x, size.y, 1);
+        glCopyImageSubData(depth, GL_TEXTURE_2D, 0, 0, 0, 0, sceneDepth, GL_TEXTURE_2D, 0, 0, 0, 0, size.x, size.y, 1);
+    }
+    else
+    {
+        // Downscaled copy, depth can only be blitted with nearest filtering
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, GetRenderTargetFramebuffer(pool, &albedo, 1, depth));
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, GetRenderTargetFramebuffer(pool, &sceneColor, 1, sceneDepth));
+        glBlitFramebuffer(0, 0, size.x, size.y, 0, 0, copySize.x, copySize.y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBlitFramebuffer(0, 0, size.x, size.y, 0, 0, copySize.x, copySize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+}
+
+void ExecuteWaterPass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+
+    WaterRenderTargets targets = {};
+    if (frame.reflection != FRAME_GRAPH_NONE)
+        targets.reflection = GetFrameGraphTexture(graph, frame.reflection);
+    if (frame.sceneColor != FRAME_GRAPH_NONE)
+    {
+        targets.sceneColor = GetFrameGraphTexture(graph, frame.sceneColor);
+        targets.sceneDepth = GetFrameGraphTexture(graph, frame.sceneDepth);
+    }
+    targets.refraction = GetFrameGraphTexture(graph, frame.refraction);
+    targets.refractionDepth = GetFrameGraphTexture(graph, frame.refractionDepth);
+
+    // Tested against the scene depth without changing it
+    glDepthMask(GL_FALSE);
+    BeginWaterConditionalRender(frame);
+    WaterRender(frame.app, targets);
+    EndWaterConditionalRender(frame);
+    glDepthMask(GL_TRUE);
+}
 
-        //////FrameBuffer
+void ExecuteCompositePass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+    App* app = frame.app;
 
-        Program& frameBufferProgram = app->programs[app->frameBufferProgramIdx];
-        glUseProgram(frameBufferProgram.handle);
+    Program& frameBufferProgram = app->programs[app->frameBufferProgramIdx];
+    glUseProgram(frameBufferProgram.handle);
 
-        //glClearColor(1, 0.1, 0.1, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    //glClearColor(1, 0.1, 0.1, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        glBindVertexArray(app->vao);
+    glBindVertexArray(app->vao);
 
-        glUniform1i(glGetUniformLocation(frameBufferProgram.handle, "uTexture"), 0);
-        
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->finalAttachment);
+    glUniform1i(glGetUniformLocation(frameBufferProgram.handle, "uTexture"), 0);
 
-        glUniform1i(glGetUniformLocation(frameBufferProgram.handle, "isDepth"), app->depth);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, GetFrameGraphTexture(graph, frame.displayed));
 
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    glUniform1i(glGetUniformLocation(frameBufferProgram.handle, "isDepth"), app->depth);
 
-        //////
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    glBindVertexArray(0);
+}
+
+void ExecuteForwardPass(FrameGraph& graph, void* data)
+{
+    App* app = ((FramePassData*)data)->app;
 
-        //glBindFr
+    glEnable(GL_DEPTH_TEST);
 
-    }
-    break;
-    case FORWARD:
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    Program& textureMeshProgram = app->programs[app->forwardBufferProgramIdx];
+    glUseProgram(textureMeshProgram.handle);
+    BindViewParams(app, VIEW_MAIN);
+
+    for (Entity entity : app->entities)
     {
-        //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        
-        glEnable(GL_DEPTH_TEST);
+        Mesh& mesh = app->meshes[entity.modelIndex];
+
+        for (u32 i : entity.submeshIndices)
+        {
+            GLuint vao = FindVAO(app, mesh, i, textureMeshProgram);
+            glBindVertexArray(vao);
+
+            u32 submeshMaterialIdx = entity.materialIdx[i];
+            Material& submeshMaterial = app->materials[submeshMaterialIdx];
+            RequestMaterialTextures(app, submeshMaterialIdx, textureMeshProgram);
+
+            u32 albedoIdx = submeshMaterial.textureIdx[MATERIAL_TEXTURE_ALBEDO];
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, albedoIdx != UINT32_MAX ? app->textures[albedoIdx].handle : 0);
+
+            glUniform1i(glGetUniformLocation(textureMeshProgram.handle, "uTexture"), 0);
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            DrawSubmesh(textureMeshProgram, mesh.submeshes[i], entity.lodLevel, entity.objectIndex);
+        }
+    }
+    glBindVertexArray(0);
+}
+
+// Returns the last version of the backbuffer
+u32 SetupDeferredPasses(App* app, FrameGraph& graph, FramePassData& frame, u32 backbuffer)
+{
+    RenderTargetPool& pool = app->renderTargets;
+    WaterBuffer& water = app->waterbuffer;
+    ResizeWaterBuffer(app);
+    water.culledSubmeshes = 0;
 
-        glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    frame.waterHeight = app->transforms.worldMatrices[app->entities[app->waterPlane].transformIndex][3].y;
+    frame.reflection = FRAME_GRAPH_NONE;
+    frame.sceneColor = FRAME_GRAPH_NONE;
+    frame.sceneDepth = FRAME_GRAPH_NONE;
 
-        Program& textureMeshProgram = app->programs[app->forwardBufferProgramIdx];
-        glUseProgram(textureMeshProgram.handle);
+    const bool screenSpaceReflection = water.reflectionMode == WATER_REFLECTION_SCREEN_SPACE;
 
-        for (Entity entity : app->entities)
+    if (screenSpaceReflection)
+    {
+        // The planar reflection isn't rendered at all, its target goes back to the pool
+        if (water.rtReflection)
         {
-            Mesh& mesh = app->meshes[entity.modelIndex];
+            ReleaseRenderTarget(pool, water.rtReflection);
+            water.rtReflection = 0;
+        }
+        water.reflectionValid = false;
+        water.reflectionSubmeshes = 0;
+    }
+    else
+    {
+        // The reflection is kept between frames, so it doesn't belong to the graph
+        if (!water.rtReflection)
+            water.rtReflection = AcquireRenderTarget(pool, GL_RGBA8, water.size);
+        frame.reflection = ImportFrameGraphTexture(graph, "Water reflection", water.rtReflection, GL_RGBA8, water.size);
+    }
 
-            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-            {
-                GLuint vao = FindVAO(mesh, i, textureMeshProgram);
-                glBindVertexArray(vao);
+    // The water passes go after the scene so they can be gated by the occlusion of the water
+    u32 albedo = CreateFrameGraphTexture(graph, "G-buffer albedo", GL_RGBA8, pool.size);
+    u32 normals = CreateFrameGraphTexture(graph, "G-buffer normals", GL_RGBA8, pool.size);
+    u32 position = CreateFrameGraphTexture(graph, "G-buffer position", GL_RGBA8, pool.size);
+    u32 depth = CreateFrameGraphTexture(graph, "G-buffer depth", GL_DEPTH_COMPONENT24, pool.size);
+
+    // The atlas keeps the cached tiles between frames, the pass only runs when some are redrawn
+    u32 shadowAtlas = ImportFrameGraphTexture(graph, "Shadow atlas", app->shadowAtlas.texture, GL_DEPTH_COMPONENT24, glm::ivec2(SHADOW_ATLAS_SIZE));
+    if (!app->shadowAtlas.pendingLights.empty())
+    {
+        u32 pass = AddFrameGraphPass(graph, "Shadows", ExecuteShadowPass, &frame);
+        shadowAtlas = WriteFrameGraphTexture(graph, pass, shadowAtlas);
+    }
+    {
+        // The color attachments follow the outputs of the shader
+        u32 pass = AddFrameGraphPass(graph, "G-buffer", ExecuteGBufferPass, &frame);
+        ReadFrameGraphTexture(graph, pass, shadowAtlas);
+        albedo = WriteFrameGraphTexture(graph, pass, albedo);
+        normals = WriteFrameGraphTexture(graph, pass, normals);
+        position = WriteFrameGraphTexture(graph, pass, position);
+        depth = WriteFrameGraphTexture(graph, pass, depth);
+    }
+    {
+        u32 pass = AddFrameGraphPass(graph, "Skybox", ExecuteSkyboxPass, &frame);
+        ReadFrameGraphTexture(graph, pass, depth, FRAME_GRAPH_ATTACHMENT);
+        albedo = WriteFrameGraphTexture(graph, pass, albedo);
+    }
 
-                u32 submeshMaterialIdx = entity.materialIdx[i];
-                Material& submeshMaterial = app->materials[submeshMaterialIdx];
+    // Only the albedo shows the water. The query is skipped when the camera is inside the
+    // bounds, whose front faces would be clipped by the near plane.
+    ReadAvailableWaterOcclusionQueries(water);
+    frame.occlusionQuery = 0;
+    if (water.occlusionCulling && app->displayedAttachment == GBUFFER_ALBEDO)
+    {
+        const Entity& entity = app->entities[app->waterPlane];
+        glm::vec3 center, extents;
+        GetSubmeshWorldBounds(app->transforms.worldMatrices[entity.transformIndex], app->meshes[entity.modelIndex].submeshes[0], center, extents);
+        extents += glm::vec3(WATER_OCCLUSION_MARGIN);
 
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
+        glm::vec3 cameraOffset = glm::abs(app->camera.cameraPos - center);
+        if (glm::any(glm::greaterThan(cameraOffset, extents + glm::vec3(app->camera.zNear))))
+        {
+            water.occlusionQueryIndex = (water.occlusionQueryIndex + 1) % WATER_OCCLUSION_QUERIES;
+            if (water.occlusionPending[water.occlusionQueryIndex])
+                ReadWaterOcclusionQuery(water, water.occlusionQueryIndex);
+            frame.occlusionQuery = water.occlusionQueries[water.occlusionQueryIndex];
+            frame.occlusionBox = glm::translate(center) * glm::scale(extents);
+
+            u32 pass = AddFrameGraphPass(graph, "Water occlusion", ExecuteWaterOcclusionPass, &frame);
+            ReadFrameGraphTexture(graph, pass, depth, FRAME_GRAPH_ATTACHMENT);
+        }
+    }
 
-                glUniform1i(glGetUniformLocation(textureMeshProgram.handle, "uTexture"), 0);
-                glUniformMatrix4fv(glGetUniformLocation(textureMeshProgram.handle, "viewMatrix"), 1, GL_FALSE, &app->camera.view[0][0]);
-                glUniformMatrix4fv(glGetUniformLocation(textureMeshProgram.handle, "projection"), 1, GL_FALSE, &app->camera.projection[0][0]);
+    // Timings are read back a few frames late, so the first ones after switching modes are
+    // attributed to the new mode. The planar reflection is only charged on the frames it's
+    // rendered, so the smoothing averages it over the reuse interval.
+    const bool renderReflection = !screenSpaceReflection && ShouldRenderWaterReflection(app);
+    f32 reflectionCostMs = GetGpuPassMs(app->gpuProfiler, "Water");
+    if (screenSpaceReflection)
+        reflectionCostMs += GetGpuPassMs(app->gpuProfiler, "Scene copy");
+    else if (renderReflection)
+        reflectionCostMs += GetGpuPassMs(app->gpuProfiler, "Reflection");
+    f32& smoothedCostMs = water.reflectionCostMs[water.reflectionMode];
+    smoothedCostMs = smoothedCostMs == 0.0f ? reflectionCostMs : glm::mix(smoothedCostMs, reflectionCostMs, GPU_PROFILER_SMOOTHING);
+
+    if (renderReflection)
+    {
+        // Camera mirrored by the water plane, the water shader flips the texture back
+        frame.reflectionCamera = app->camera;
+        frame.reflectionCamera.cameraPos.y = 2.0f * frame.waterHeight - frame.reflectionCamera.cameraPos.y;
+        frame.reflectionCamera.cameraTarget.y = 2.0f * frame.waterHeight - frame.reflectionCamera.cameraTarget.y;
+        frame.reflectionCamera.view = glm::lookAt(frame.reflectionCamera.cameraPos, frame.reflectionCamera.cameraTarget, glm::vec3(0.0f, 1.0f, 0.0f));
+
+        u32 pass = AddFrameGraphPass(graph, "Reflection", ExecuteReflectionPass, &frame);
+        u32 reflectionDepth = CreateFrameGraphTexture(graph, "Water reflection depth", GL_DEPTH_COMPONENT24, water.size);
+        frame.reflection = WriteFrameGraphTexture(graph, pass, frame.reflection);
+        WriteFrameGraphTexture(graph, pass, reflectionDepth);
+    }
 
-                Submesh& submesh = mesh.submeshes[i];
-                glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+    // The copy of the scene is the refraction when it's taken at the water resolution
+    if (!water.refractionFromSceneCopy)
+    {
+        u32 pass = AddFrameGraphPass(graph, "Refraction", ExecuteRefractionPass, &frame);
+        frame.refraction = CreateFrameGraphTexture(graph, "Water refraction", GL_RGBA8, water.size);
+        frame.refractionDepth = CreateFrameGraphTexture(graph, "Water refraction depth", GL_DEPTH_COMPONENT24, water.size);
+        frame.refraction = WriteFrameGraphTexture(graph, pass, frame.refraction);
+        frame.refractionDepth = WriteFrameGraphTexture(graph, pass, frame.refractionDepth);
+    }
+
+    if (screenSpaceReflection || water.refractionFromSceneCopy)
+    {
+        frame.albedo = albedo;
+        frame.depth = depth;
+        frame.sceneCopySize = water.refractionFromSceneCopy ? water.size : pool.size;
+        frame.sceneColor = CreateFrameGraphTexture(graph, "Scene color", GL_RGBA8, frame.sceneCopySize);
+        frame.sceneDepth = CreateFrameGraphTexture(graph, "Scene depth", GL_DEPTH_COMPONENT24, frame.sceneCopySize);
+
+        u32 pass = AddFrameGraphPass(graph, "Scene copy", ExecuteSceneCopyPass, &frame);
+        ReadFrameGraphTexture(graph, pass, albedo, FRAME_GRAPH_COPY);
+        ReadFrameGraphTexture(graph, pass, depth, FRAME_GRAPH_COPY);
+        frame.sceneColor = WriteFrameGraphTexture(graph, pass, frame.sceneColor, FRAME_GRAPH_COPY);
+        frame.sceneDepth = WriteFrameGraphTexture(graph, pass, frame.sceneDepth, FRAME_GRAPH_COPY);
+
+        if (water.refractionFromSceneCopy)
+        {
+            frame.refraction = frame.sceneColor;
+            frame.refractionDepth = frame.sceneDepth;
+            water.refractionSubmeshes = 0;
+        }
+    }
+    {
+        u32 pass = AddFrameGraphPass(graph, "Water", ExecuteWaterPass, &frame);
+        if (screenSpaceReflection)
+        {
+            if (!water.refractionFromSceneCopy)
+            {
+                ReadFrameGraphTexture(graph, pass, frame.sceneColor);
+                ReadFrameGraphTexture(graph, pass, frame.sceneDepth);
             }
         }
-        SkyboxRender(app);
-        break;
+        else
+        {
+            ReadFrameGraphTexture(graph, pass, frame.reflection);
+        }
+        ReadFrameGraphTexture(graph, pass, frame.refraction);
+        ReadFrameGraphTexture(graph, pass, frame.refractionDepth);
+        ReadFrameGraphTexture(graph, pass, depth, FRAME_GRAPH_ATTACHMENT);
+        albedo = WriteFrameGraphTexture(graph, pass, albedo);
+    }
+    {
+        // Only the passes needed for the attachment shown are executed
+        u32 displayedAttachments[] = { albedo, normals, position, depth };
+        frame.displayed = displayedAttachments[app->displayedAttachment];
+
+        // The capture pass reads them once the graph is set up
+        if (app->frameCapture.source != CAPTURE_FINAL)
+        {
+            frame.capture = displayedAttachments[app->frameCapture.source - CAPTURE_GBUFFER_ALBEDO];
+            frame.captureSource = app->frameCapture.source;
+        }
+
+        u32 pass = AddFrameGraphPass(graph, "Composite", ExecuteCompositePass, &frame);
+        ReadFrameGraphTexture(graph, pass, frame.displayed);
+        backbuffer = WriteFrameGraphTexture(graph, pass, backbuffer);
     }
+
+    return backbuffer;
+}
+
+// Starts the readback of the captured texture, the writers get it a few frames later
+void ExecuteCapturePass(FrameGraph& graph, void* data)
+{
+    FramePassData& frame = *(FramePassData*)data;
+    App* app = frame.app;
+
+    const FrameGraphTexture& texture = graph.textures[graph.nodes[frame.capture].texture];
+    GLuint handle = GetFrameGraphTexture(graph, frame.capture);
+    bool depth = IsDepthFormat(texture.format);
+
+    GLuint framebuffer = 0;
+    if (!texture.backbuffer)
+        framebuffer = depth ? GetRenderTargetFramebuffer(app->renderTargets, NULL, 0, handle) : GetRenderTargetFramebuffer(app->renderTargets, &handle, 1, 0);
+
+    ReadFrameCapture(app->frameCapture, frame.captureSource, framebuffer, texture.size, depth);
+}
+
+u32 SetupForwardPasses(App* app, FrameGraph& graph, FramePassData& frame, u32 backbuffer)
+{
+    u32 forwardPass = AddFrameGraphPass(graph, "Forward", ExecuteForwardPass, &frame);
+    backbuffer = WriteFrameGraphTexture(graph, forwardPass, backbuffer);
+
+    u32 skyboxPass = AddFrameGraphPass(graph, "Skybox", ExecuteSkyboxPass, &frame);
+    backbuffer = WriteFrameGraphTexture(graph, skyboxPass, backbuffer);
+
+    return backbuffer;
+}
+
+void Render(App* app)
+{
+    TRACE_FUNCTION();
+
+    BeginGpuProfilerFrame(app->gpuProfiler);
+    BeginGpuScope(app->gpuProfiler, "Frame");
+
+    // Readbacks of the previous frames the GPU is done with go to the writers
+    UpdateFrameCapture(app->frameCapture);
+
+    UpdateRenderTargetPool(app->renderTargets, app->displaySize, app->deltaTime);
+
+    // Passes and their textures are declared here, ExecuteFrameGraph drops the ones not needed
+    FrameGraph& graph = app->frameGraph;
+    BeginFrameGraph(graph);
+
+    FramePassData frame = {};
+    frame.app = app;
+    frame.reflectionCamera = app->camera;
+    frame.capture = FRAME_GRAPH_NONE;
+    frame.captureSource = CAPTURE_FINAL;
+
+    u32 backbuffer = ImportFrameGraphBackbuffer(graph, app->displaySize);
+    switch (app->mode)
+    {
+    case DEFERRED: backbuffer = SetupDeferredPasses(app, graph, frame, backbuffer); break;
+    case FORWARD:  backbuffer = SetupForwardPasses(app, graph, frame, backbuffer); break;
     default:;
     }
+
+    // Last, so it reads the final versions. It writes nothing, so it's never culled and it
+    // keeps the passes producing its source alive.
+    if (IsFrameCaptureWanted(app->frameCapture))
+    {
+        if (frame.capture == FRAME_GRAPH_NONE)
+            frame.capture = backbuffer;
+
+        u32 pass = AddFrameGraphPass(graph, "Capture", ExecuteCapturePass, &frame);
+        ReadFrameGraphTexture(graph, pass, frame.capture, FRAME_GRAPH_COPY);
+    }
+    MarkFrameGraphOutput(graph, backbuffer);
+
+    // The cameras of the frame are known once the passes are set up
+    ViewParams views[VIEW_COUNT];
+    views[VIEW_MAIN] = MakeViewParams(app->camera, app->mode == DEFERRED ? app->renderTargets.size : app->displaySize);
+    views[VIEW_WATER_REFLECTION] = MakeViewParams(frame.reflectionCamera, app->waterbuffer.size);
+    UploadViewParams(app, views);
+
+    ExecuteFrameGraph(graph, app->renderTargets, app->gpuProfiler);
+
+    EndGpuScope(app->gpuProfiler);
+}
+
+void Shutdown(App* app)
+{
+    TRACE_FUNCTION();
+
+    ShutdownFrameCapture(app->frameCapture);
+}
+
+ViewParams MakeViewParams(const Camera& camera, glm::ivec2 viewportSize)
+{
+    ViewParams params = {};
+    params.view = camera.view;
+    params.projection = camera.projection;
+    params.viewProjection = camera.projection * camera.view;
+    params.viewInv = glm::inverse(camera.view);
+    params.projectionInv = glm::inverse(camera.projection);
+    params.cameraPosition = glm::vec4(camera.cameraPos, 1.0f);
+    glm::vec2 size = glm::max(viewportSize, glm::ivec2(1, 1)); // Minimized, or a view not rendered
+    params.viewport = glm::vec4(size, 1.0f / size);
+    return params;
+}
+
+void UploadViewParams(App* app, const ViewParams views[VIEW_COUNT])
+{
+    // Invalidated so the driver doesn't wait for the draws of the previous frame
+    Buffer& buffer = app->viewBuffer;
+    MapBufferRange(buffer, buffer.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    buffer.head = 0;
+    for (u32 i = 0; i < VIEW_COUNT; ++i)
+    {
+        AlignHead(buffer, app->uniformBlockAlignment);
+        app->viewParamsOffsets[i] = buffer.head;
+        PushData(buffer, &views[i], sizeof(ViewParams));
+    }
+    UnmapBuffer(buffer);
+}
+
+void BindViewParams(App* app, u32 view)
+{
+    glBindBufferRange(GL_UNIFORM_BUFFER, VIEW_PARAMS_BINDING, app->viewBuffer.handle, app->viewParamsOffsets[view], sizeof(ViewParams));
 }
 
-void SkyboxRender(App* app)
+void SkyboxRender(App* app, u32 view)
 {
     glDepthFunc(GL_LEQUAL);
 
     Program& programCubemap = app->programs[app->skyboxProgramIdx];
     glUseProgram(programCubemap.handle);
+    BindViewParams(app, view);
 
-    glm::mat4 view = glm::mat4(glm::mat3(app->camera.view));
-
-    glUniformMatrix4fv(glGetUniformLocation(programCubemap.handle, "view"), 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(programCubemap.handle, "projection"), 1, GL_FALSE, &app->camera.projection[0][0]);
-    
     glBindVertexArray(app->skyboxVAO);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_CUBE_MAP, app->skyBoxID);
@@ -975,7 +1898,7 @@ void SkyboxRender(App* app)
     glDepthFunc(GL_LESS);
 }
 
-void WaterRender(App* app)
+void WaterRender(App* app, const WaterRenderTargets& targets)
 {
     Program& programWater = app->programs[app->waterProgramIdx];
     glUseProgram(programWater.handle);
@@ -983,36 +1906,42 @@ void WaterRender(App* app)
     auto enityWater = app->waterPlane;
 
     Mesh& mesh = app->meshes[app->entities[enityWater].modelIndex];
-    GLuint vao = FindVAO(mesh, 0, programWater);
+    GLuint vao = FindVAO(app, mesh, 0, programWater);
 
-    glm::mat4 model = app->entities[enityWater].worldMatrix;
-    glm::mat4 view = app->camera.view * model;
+    const Entity& entity = app->entities[enityWater];
 
     glBindVertexArray(vao);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "projectionMatrix"), 1, GL_FALSE, &app->camera.projection[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "worldViewMatrix"), 1, GL_FALSE, &view[0][0]);
-    
-    glUniform2f(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "viewportSize"), app->displaySize.x, app->displaySize.y);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "modelViewMatrix"), 1, GL_FALSE, &app->entities[enityWater].worldMatrixProjection[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "modelViewMatrix"), 1, GL_FALSE, &app->entities[enityWater].worldMatrixProjection[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "viewMatrixInv"), 1, GL_FALSE, &app->entities[enityWater].worldMatrixProjection[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "viewMatrixInv"), 1, GL_FALSE, &glm::inverse(view)[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "projectionMatrixInv"), 1, GL_FALSE, &glm::inverse(app->camera.projection)[0][0]);
+    BindViewParams(app, VIEW_MAIN);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_PARAMS_BINDING, app->objectBuffer.handle);
+
+    glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "reflectionMode"), app->waterbuffer.reflectionMode);
 
     glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "reflectionMap"), 0);
     glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "refractionMap"), 1);
     glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "reflectionDepth"), 2);
     glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "refractionDepth"), 3);
     glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "dudvMap"), 4);
+    glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "sceneColor"), 5);
+    glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "sceneDepth"), 6);
+    glUniform1i(glGetUniformLocation(app->programs[app->waterProgramIdx].handle, "skybox"), 7);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->waterbuffer.rtReflection);
+    glBindTexture(GL_TEXTURE_2D, targets.reflection);
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, app->waterbuffer.rtRefraction);
-    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, targets.refraction);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, targets.refractionDepth);
+    glActiveTexture(GL_TEXTURE4);
     glBindTexture(GL_TEXTURE_2D, app->textures[app->waterID].handle);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, targets.sceneColor);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, targets.sceneDepth);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, app->skyBoxID);
+    glActiveTexture(GL_TEXTURE0);
 
-    glDrawElements(GL_TRIANGLES, mesh.submeshes[0].indices.size(), GL_UNSIGNED_INT, 0);
+    DrawSubmesh(programWater, mesh.submeshes[0], 0, entity.objectIndex);
     glBindVertexArray(0);
 
     glUseProgram(0);
@@ -35,10 +35,21 @@ struct OpenGlInfo
     std::vector<std::string> glExtension;
 };
 
+// Material textures are registered when their model is imported, with only the size read
+// from the file, and decoded the first time a program sampling them draws the material
 struct Texture
 {
-    GLuint      handle;
+    GLuint      handle;        // 0 until resident
     std::string filepath;
+    glm::ivec2  size;          // Of the full chain, as in the file
+    bool        requested;     // Made resident by the next Update
+
+    // Material textures are streamed, the handle then holds the chain from residentLevel on
+    bool        streamed;
+    u32         levelCount;    // Of the full chain
+    u32         residentLevel;
+    u32         wantedLevel;   // Finest level the entities drawing it need on screen
+    u64         lastUsedFrame; // Last frame an entity needed it, the evictions go by it
 };
 
 struct Program
@@ -49,6 +60,15 @@ struct Program
     u64                lastWriteTimestamp; // What is this for?
     VertexShaderLayout vertexInputLayout;
     GLsizei lenght;
+    u32                materialTextureSlots; // Bits of the MaterialTextureSlots it samples
+};
+
+enum GBufferAttachment
+{
+    GBUFFER_ALBEDO,
+    GBUFFER_NORMALS,
+    GBUFFER_POSITION,
+    GBUFFER_DEPTH
 };
 
 enum Mode
@@ -114,23 +134,111 @@ public:
         }
     }
 };
+#define WATER_OCCLUSION_QUERIES 3     // Frames in flight before a query result is read back
+#define WATER_OCCLUSION_MARGIN  0.05f // Thickness added to the bounds of the flat water plane
+
+enum WaterReflectionMode
+{
+    WATER_REFLECTION_PLANAR,       // The scene rendered again from the mirrored camera
+    WATER_REFLECTION_SCREEN_SPACE, // Rays marched through the depth and color of the frame, the skybox on misses
+    WATER_REFLECTION_MODE_COUNT
+};
+
 class WaterBuffer
 {
 public:
 
     float move = 0;
 
-    GLuint rtReflection = 0;
-    GLuint rtRefraction = 0;
-    GLuint rtReflectionDepth = 0;
-    GLuint rtRefractionDepth = 0;
-
-    FrameBuffer fboReflection;
-    FrameBuffer fboRefraction;
+    GLuint rtReflection = 0; // Kept between frames, the other water targets belong to the frame graph
+
+    u32 reflectionMode = WATER_REFLECTION_PLANAR;
+
+    // Instead of rendering the scene under the water again, the refraction is a copy of the
+    // G-buffer color and depth at the water resolution, taken right before the water is drawn
+    bool refractionFromSceneCopy = false;
+
+    // The water bounds are drawn against the scene depth before the water passes, which the
+    // GPU then discards with conditional rendering when no sample passed. Results are read
+    // back a few frames later for the stats and to know the reflection wasn't rendered.
+    bool   occlusionCulling = true;
+    GLuint occlusionQueries[WATER_OCCLUSION_QUERIES] = {};
+    bool   occlusionPending[WATER_OCCLUSION_QUERIES] = {};
+    u32    occlusionQueryIndex = 0;
+    u32    occlusionTestedFrames = 0;
+    u32    occlusionHiddenFrames = 0;
+
+    // The targets are resolutionScale times the render size, from App::renderTargets
+    f32   resolutionScale = 0.5f;
+    ivec2 size = ivec2(0, 0);
+
+    // While the camera moves slower than slowCameraSpeed (world units per second) and nothing
+    // moves in the scene, the reflection is only rendered every reflectionInterval frames
+    u32       reflectionInterval = 1;
+    f32       slowCameraSpeed = 2.0f;
+    u32       framesSinceReflection = 0;
+    bool      reflectionValid = false;
+    glm::vec3 previousCameraPos = glm::vec3(0.0f);
+    glm::vec3 previousCameraTarget = glm::vec3(0.0f);
+
+    // Stats of the last frame
+    u32 reflectionSubmeshes = 0;
+    u32 refractionSubmeshes = 0;
+    u32 culledSubmeshes = 0;
+
+    // Smoothed GPU time of the reflection passes plus the water pass, per reflection mode
+    f32 reflectionCostMs[WATER_REFLECTION_MODE_COUNT] = {};
 
     //Vertex
 };
 
+#define VIEW_PARAMS_BINDING        2  // Uniform block binding shared by every program
+#define OBJECT_PARAMS_BINDING      3  // Storage block binding of the per-object constants
+#define OBJECT_INDEX_LOCATION      15 // Instanced vertex attribute holding the index of the object drawn
+#define OBJECT_BUFFER_MIN_CAPACITY 64 // Objects the storage buffer is first allocated for
+#define MAX_LIGHTS                 16 // Size of the uLight array of GlobalParams
+
+// Uniform blocks shared with the shaders, checked against every program when it's loaded
+
+// shadowView is the first ShadowView of the light in the shadow atlas, -1 if it has none
+#define GPU_LIGHT_FIELDS(FIELD)                     \
+    FIELD(u32,       type,       "type")            \
+    FIELD(glm::vec3, color,      "color")           \
+    FIELD(glm::vec3, direction,  "direction")       \
+    FIELD(glm::vec3, position,   "position")        \
+    FIELD(f32,       intensity,  "intensity")       \
+    FIELD(i32,       shadowView, "shadowView")
+GPU_STRUCT(GpuLight, GPU_STD140, GPU_LIGHT_FIELDS)
+
+#define GLOBAL_PARAMS_FIELDS(FIELD)                        \
+    FIELD(u32,                  lightCount, "uLightCount") \
+    FIELD(GpuLight[MAX_LIGHTS], lights,     "uLight")
+GPU_STRUCT(GlobalParams, GPU_STD140, GLOBAL_PARAMS_FIELDS)
+
+// Per-object constants, one element per entity of the uObjects array in the storage buffer
+#define OBJECT_PARAMS_FIELDS(FIELD) \
+    FIELD(glm::mat4, worldMatrix, "worldMatrix")
+GPU_STRUCT(ObjectParams, GPU_STD430, OBJECT_PARAMS_FIELDS)
+
+// Constants of a camera, computed once per camera and frame, then bound by the passes drawing
+// from that camera
+#define VIEW_PARAMS_FIELDS(FIELD)                             \
+    FIELD(glm::mat4, view,           "uView")                 \
+    FIELD(glm::mat4, projection,     "uProjection")           \
+    FIELD(glm::mat4, viewProjection, "uViewProjection")       \
+    FIELD(glm::mat4, viewInv,        "uViewInv")              \
+    FIELD(glm::mat4, projectionInv,  "uProjectionInv")        \
+    FIELD(glm::vec4, cameraPosition, "uCameraPosition") /* w unused */ \
+    FIELD(glm::vec4, viewport,       "uViewport")       /* Size in pixels, then its inverse */
+GPU_STRUCT(ViewParams, GPU_STD140, VIEW_PARAMS_FIELDS)
+
+enum ViewIndex
+{
+    VIEW_MAIN,             // Also used for the water refraction, seen from the same camera
+    VIEW_WATER_REFLECTION,
+    VIEW_COUNT
+};
+
 struct App
 {
     // Loop
@@ -149,15 +257,30 @@ struct App
     std::vector<Texture>  textures; //Textures loaded
     std::vector<Program>  programs; //programms loaded
     std::vector<Material> materials;
+    MaterialTable materialTable;
+    TextureStreaming textureStreaming;
+    ShadowAtlas shadowAtlas;
+    FrameCapture frameCapture;
     std::vector<Mesh> meshes;
     std::vector<Entity> entities;
+    TransformSystem transforms;
+    u32 entityConstantsCount; // Entities with their per-object constants laid out in objectBuffer
     int selectedEntity;
     std::vector<Light> lights;
 
     u32 globalParamsOffset;
     u32 globalParamsSize;
 
-    FrameBuffer frameBuffer;
+    // Mesh LODs
+    bool lodEnabled;
+    f32  lodErrorThreshold; // Max projected simplification error, in pixels
+    u32  lodTrianglesRendered;
+    u32  lodTrianglesSaved;
+
+    RenderTargetPool renderTargets;
+    FrameGraph frameGraph;
+
+    GpuProfiler gpuProfiler;
 
     int depth;
 
@@ -166,17 +289,23 @@ struct App
     u32 frameBufferProgramIdx; 
     u32 forwardBufferProgramIdx; 
     u32 skyboxProgramIdx;
+    u32 shadowDepthProgramIdx;
     
     //GLuint bufferHandle;
 
-    Buffer uniformBuffer;
+    Buffer objectBuffer;      // ObjectParams of every entity, grown as entities are added
+    Buffer objectIndexBuffer; // 0, 1, 2... read through the base instance of the draws
     Buffer lightBuffer;
+    Buffer viewBuffer;
+    u32    viewParamsOffsets[VIEW_COUNT];
     GLint maxUniformBufferSize = 0;
     GLint uniformBlockAlignment;
     
     //Water
     WaterBuffer waterbuffer;
     u32 waterProgramIdx;
+    u32 waterSceneProgramIdx;
+    u32 waterOcclusionProgramIdx;
     u32 waterID;
 
 
@@ -189,7 +318,7 @@ struct App
     GLint cubmapWVP;
 
 
-    GLuint finalAttachment;
+    u32 displayedAttachment; // GBufferAttachment shown by the composite pass
     u32 modelPatrick;
     u32 modelPatrick1;
     u32 modelPatrick2;
@@ -225,8 +354,58 @@ void Update(App* app);
 
 void Render(App* app);
 
+void Shutdown(App* app);
+
+Image LoadImage(const char* filename);
+
+void FreeImage(Image image);
+
+/**
+ * Texture with the image and its full mip chain.
+ */
+GLuint CreateTexture2DFromImage(Image image);
+
+/**
+ * Registers the texture and makes it resident right away.
+ */
 u32 LoadTexture2D(App* app, const char* filepath);
 
-void SkyboxRender(App* app);
-void WaterRender(App* app);
+/**
+ * Index of the texture, only reading its size from the file. Textures are shared by path,
+ * UINT32_MAX if the file can't be read.
+ */
+u32 RegisterTexture2D(App* app, const char* filepath);
+
+/**
+ * Decodes and uploads the texture if it isn't resident yet.
+ */
+void MakeTextureResident(App* app, u32 textureIdx);
+
+/**
+ * Call before drawing with the material. The textures of the slots the program samples that
+ * aren't resident are loaded by the next Update, until then the material color is used.
+ */
+void RequestMaterialTextures(App* app, u32 materialIdx, const Program& program);
+
+ViewParams MakeViewParams(const Camera& camera, glm::ivec2 viewportSize);
+
+/**
+ * Writes the constants of every view, invalidating the buffer of the previous frame.
+ */
+void UploadViewParams(App* app, const ViewParams views[VIEW_COUNT]);
+
+void BindViewParams(App* app, u32 view);
+
+void SkyboxRender(App* app, u32 view);
+// Textures sampled by the water, 0 for the ones the reflection mode doesn't use
+struct WaterRenderTargets
+{
+    GLuint reflection;
+    GLuint refraction;
+    GLuint refractionDepth;
+    GLuint sceneColor; // Copies of the frame before the water, for screen-space reflections
+    GLuint sceneDepth;
+};
+
+void WaterRender(App* app, const WaterRenderTargets& targets);
 
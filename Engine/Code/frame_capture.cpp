@@ -0,0 +1,255 @@
+#include "Global.h"
+#include <stb_image_write.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+struct CaptureJob
+{
+    u8*        pixels; // Owned by the job, freed once written
+    glm::ivec2 size;
+    bool       depth;
+    u32        format;
+    char       filepath[128];
+};
+
+static const char* CaptureSourceNames[CAPTURE_SOURCE_COUNT] = { "final", "albedo", "normals", "position", "depth" };
+
+static std::thread             GlobalCaptureWriters[CAPTURE_WRITER_THREADS];
+static std::mutex              GlobalCaptureMutex;
+static std::condition_variable GlobalCaptureCondition;
+static std::deque<CaptureJob>  GlobalCaptureJobs;
+static bool                    GlobalCaptureRunning = false;
+static std::atomic<u32>        GlobalCaptureQueued(0); // Handed to the writers and not written yet
+static std::atomic<u32>        GlobalCaptureWritten(0);
+
+// RGBA8 and float depth both take 4 bytes per pixel
+static u32 GetCaptureBytes(glm::ivec2 size)
+{
+    return (u32)size.x * size.y * 4;
+}
+
+static void WriteCaptureJob(CaptureJob& job)
+{
+    TRACE_FUNCTION();
+
+    bool written = false;
+    if (job.format == CAPTURE_FORMAT_RAW)
+    {
+        FILE* file = fopen(job.filepath, "wb");
+        if (file)
+        {
+            written = fwrite(job.pixels, 1, GetCaptureBytes(job.size), file) == GetCaptureBytes(job.size);
+            fclose(file);
+        }
+    }
+    else if (job.depth)
+    {
+        // Grey levels, only the raw files keep the precision. Each byte is written over a float
+        // already read, so the conversion can be done in place.
+        const f32* depth = (const f32*)job.pixels;
+        for (u32 i = 0; i < (u32)(job.size.x * job.size.y); ++i)
+            job.pixels[i] = (u8)(glm::clamp(depth[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+        written = stbi_write_png(job.filepath, job.size.x, job.size.y, 1, job.pixels, job.size.x) != 0;
+    }
+    else
+    {
+        written = stbi_write_png(job.filepath, job.size.x, job.size.y, 4, job.pixels, job.size.x * 4) != 0;
+    }
+
+    if (written)
+        GlobalCaptureWritten++;
+    else
+        ELOG("Could not write capture %s", job.filepath);
+}
+
+static void CaptureWriterMain()
+{
+    for (;;)
+    {
+        CaptureJob job;
+        {
+            std::unique_lock<std::mutex> lock(GlobalCaptureMutex);
+            GlobalCaptureCondition.wait(lock, [] { return !GlobalCaptureJobs.empty() || !GlobalCaptureRunning; });
+
+            // The queue is drained before stopping
+            if (GlobalCaptureJobs.empty())
+                return;
+
+            job = GlobalCaptureJobs.front();
+            GlobalCaptureJobs.pop_front();
+        }
+
+        WriteCaptureJob(job);
+        free(job.pixels);
+        GlobalCaptureQueued--;
+    }
+}
+
+// Copies the pixels out of the slot and queues them for the writers once the GPU is done
+// with the readback. Waits at most timeout nanoseconds.
+static void CollectCaptureSlot(FrameCapture& capture, CaptureSlot& slot, GLuint64 timeout)
+{
+    if (!slot.fence)
+        return;
+
+    GLenum status = glClientWaitSync(slot.fence, timeout ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, timeout);
+    if (status == GL_TIMEOUT_EXPIRED)
+        return;
+
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+    if (status == GL_WAIT_FAILED)
+    {
+        capture.dropped++;
+        return;
+    }
+
+    CaptureJob job = {};
+    job.size = slot.size;
+    job.depth = slot.depth;
+    job.format = slot.format;
+    if (slot.format == CAPTURE_FORMAT_RAW)
+        snprintf(job.filepath, sizeof(job.filepath), "capture_%05u_%s_%dx%d.raw", slot.index, CaptureSourceNames[slot.source], slot.size.x, slot.size.y);
+    else
+        snprintf(job.filepath, sizeof(job.filepath), "capture_%05u_%s.png", slot.index, CaptureSourceNames[slot.source]);
+
+    const u32 bytes = GetCaptureBytes(slot.size);
+    job.pixels = (u8*)malloc(bytes);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+    if (pixels)
+        memcpy(job.pixels, pixels, bytes);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (!pixels)
+    {
+        free(job.pixels);
+        capture.dropped++;
+        return;
+    }
+
+    GlobalCaptureQueued++;
+    {
+        std::lock_guard<std::mutex> lock(GlobalCaptureMutex);
+        GlobalCaptureJobs.push_back(job);
+    }
+    GlobalCaptureCondition.notify_one();
+}
+
+void InitFrameCapture(FrameCapture& capture)
+{
+    capture.continuous = false;
+    capture.requested = false;
+    capture.source = CAPTURE_FINAL;
+    capture.format = CAPTURE_FORMAT_PNG;
+    capture.nextSlot = 0;
+    capture.captureCount = 0;
+    capture.dropped = 0;
+
+    for (CaptureSlot& slot : capture.slots)
+        glGenBuffers(1, &slot.pbo);
+
+    // GL reads the rows bottom up. Set once, before the writers can use them.
+    stbi_flip_vertically_on_write(1);
+    stbi_write_png_compression_level = CAPTURE_PNG_LEVEL;
+
+    GlobalCaptureRunning = true;
+    for (u32 i = 0; i < CAPTURE_WRITER_THREADS; ++i)
+        GlobalCaptureWriters[i] = std::thread(CaptureWriterMain);
+}
+
+void ShutdownFrameCapture(FrameCapture& capture)
+{
+    TRACE_FUNCTION();
+
+    for (CaptureSlot& slot : capture.slots)
+    {
+        CollectCaptureSlot(capture, slot, 1000000000); // 1 second, the frames are long done by now
+        if (slot.fence)
+            glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
+        slot = {};
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(GlobalCaptureMutex);
+        GlobalCaptureRunning = false;
+    }
+    GlobalCaptureCondition.notify_all();
+
+    for (u32 i = 0; i < CAPTURE_WRITER_THREADS; ++i)
+    {
+        if (GlobalCaptureWriters[i].joinable())
+            GlobalCaptureWriters[i].join();
+    }
+}
+
+void UpdateFrameCapture(FrameCapture& capture)
+{
+    TRACE_FUNCTION();
+
+    // Oldest first, so the frames reach the writers in order
+    for (u32 i = 0; i < CAPTURE_RING_SIZE; ++i)
+        CollectCaptureSlot(capture, capture.slots[(capture.nextSlot + i) % CAPTURE_RING_SIZE], 0);
+}
+
+bool IsFrameCaptureWanted(const FrameCapture& capture)
+{
+    return capture.continuous || capture.requested;
+}
+
+bool ReadFrameCapture(FrameCapture& capture, u32 source, GLuint framebuffer, glm::ivec2 size, bool depth)
+{
+    TRACE_FUNCTION();
+
+    capture.requested = false;
+
+    // Dropped rather than waited for, a capture must never stall the frame
+    CaptureSlot& slot = capture.slots[capture.nextSlot];
+    if (slot.fence || GlobalCaptureQueued.load() >= CAPTURE_MAX_QUEUED)
+    {
+        capture.dropped++;
+        return false;
+    }
+
+    const u32 bytes = GetCaptureBytes(size);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    if (slot.pboSize < bytes)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+        slot.pboSize = bytes;
+    }
+
+    // Into the buffer, so glReadPixels returns without waiting for the GPU
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    if (!depth)
+        glReadBuffer(framebuffer ? GL_COLOR_ATTACHMENT0 : GL_BACK);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, size.x, size.y, depth ? GL_DEPTH_COMPONENT : GL_RGBA, depth ? GL_FLOAT : GL_UNSIGNED_BYTE, (void*)0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.size = size;
+    slot.depth = depth;
+    slot.index = capture.captureCount++;
+    slot.source = source;
+    slot.format = capture.format;
+
+    capture.nextSlot = (capture.nextSlot + 1) % CAPTURE_RING_SIZE;
+    return true;
+}
+
+u32 GetFrameCaptureQueued()
+{
+    return GlobalCaptureQueued.load();
+}
+
+u32 GetFrameCaptureWritten()
+{
+    return GlobalCaptureWritten.load();
+}
@@ -0,0 +1,90 @@
+//
+// frame_capture.h: Saves frames, or one of the G-buffer targets, without stalling the GPU. The
+// pixels are read into a ring of pixel buffers, whose fences are polled over the next frames.
+// The buffers that are ready are copied out and handed to writer threads that encode them as
+// PNG or raw files, so every frame can be captured for videos or reference images.
+//
+
+#pragma once
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <glad/glad.h>
+
+#define CAPTURE_RING_SIZE      4  // Readbacks in flight, the GPU has this many frames to finish them
+#define CAPTURE_MAX_QUEUED     8  // Frames waiting to be written, captures are dropped past this
+#define CAPTURE_WRITER_THREADS 2  // PNG encoding is slower than a frame at large sizes
+#define CAPTURE_PNG_LEVEL      1  // Compression, favours the writing speed
+
+enum CaptureSource
+{
+    CAPTURE_FINAL,           // What's on screen, without the GUI
+    CAPTURE_GBUFFER_ALBEDO,  // In the order of GBufferAttachment, deferred mode only
+    CAPTURE_GBUFFER_NORMALS,
+    CAPTURE_GBUFFER_POSITION,
+    CAPTURE_GBUFFER_DEPTH,
+    CAPTURE_SOURCE_COUNT
+};
+
+enum CaptureFormat
+{
+    CAPTURE_FORMAT_PNG,
+    CAPTURE_FORMAT_RAW, // Rows bottom up, RGBA8 or one float per pixel for depth
+    CAPTURE_FORMAT_COUNT
+};
+
+struct CaptureSlot
+{
+    GLuint     pbo;
+    u32        pboSize;
+    GLsync     fence;  // 0 when the slot is free
+    glm::ivec2 size;
+    bool       depth;  // One float per pixel, RGBA8 otherwise
+    u32        index;  // Of the capture, in the file name
+    u32        source;
+    u32        format;
+};
+
+struct FrameCapture
+{
+    bool continuous; // Every frame until it's turned off
+    bool requested;  // The next frame only
+    i32  source;     // CaptureSource
+    i32  format;     // CaptureFormat
+
+    CaptureSlot slots[CAPTURE_RING_SIZE];
+    u32         nextSlot;
+    u32         captureCount;
+
+    // Totals since the start, for the GUI
+    u32 dropped; // No free slot, or the writers were too far behind
+};
+
+void InitFrameCapture(FrameCapture& capture);
+
+/**
+ * Writes what's still in flight and stops the writer threads.
+ */
+void ShutdownFrameCapture(FrameCapture& capture);
+
+/**
+ * Call once per frame. Hands the readbacks the GPU finished to the writers, never waits.
+ */
+void UpdateFrameCapture(FrameCapture& capture);
+
+/**
+ * Whether the frame being rendered is to be captured.
+ */
+bool IsFrameCaptureWanted(const FrameCapture& capture);
+
+/**
+ * Starts reading the color attachment, or the depth if depth is set, of the framebuffer into
+ * a free slot. 0 reads the back buffer, source only names the file. Returns false if the
+ * capture had to be dropped.
+ */
+bool ReadFrameCapture(FrameCapture& capture, u32 source, GLuint framebuffer, glm::ivec2 size, bool depth);
+
+u32 GetFrameCaptureQueued();
+u32 GetFrameCaptureWritten();
+
+#endif // FRAME_CAPTURE_H
@@ -0,0 +1,286 @@
+#include "Global.h"
+
+static u32 AddFrameGraphNode(FrameGraph& graph, u32 texture, u32 producer)
+{
+    FrameGraphNode node = {};
+    node.texture = texture;
+    node.producer = producer;
+    graph.nodes.push_back(node);
+    return graph.nodes.size() - 1;
+}
+
+static void AddFrameGraphUse(FrameGraph& graph, u32 pass, u32 node, FrameGraphAccess access, bool write)
+{
+    FrameGraphPass& graphPass = graph.passes[pass];
+    ASSERT(graphPass.useCount < FRAME_GRAPH_MAX_PASS_USES, "Too many textures used by a frame graph pass");
+
+    FrameGraphUse& use = graphPass.uses[graphPass.useCount++];
+    use.node = node;
+    use.access = (u8)access;
+    use.write = write;
+}
+
+void BeginFrameGraph(FrameGraph& graph)
+{
+    graph.textures.clear();
+    graph.nodes.clear();
+    graph.passes.clear();
+}
+
+u32 CreateFrameGraphTexture(FrameGraph& graph, const char* name, GLenum format, glm::ivec2 size, u32 samples)
+{
+    FrameGraphTexture texture = {};
+    texture.name = name;
+    texture.format = format;
+    texture.size = size;
+    texture.samples = samples;
+    graph.textures.push_back(texture);
+
+    return AddFrameGraphNode(graph, graph.textures.size() - 1, FRAME_GRAPH_NONE);
+}
+
+u32 ImportFrameGraphTexture(FrameGraph& graph, const char* name, GLuint handle, GLenum format, glm::ivec2 size)
+{
+    u32 node = CreateFrameGraphTexture(graph, name, format, size);
+    FrameGraphTexture& texture = graph.textures.back();
+    texture.handle = handle;
+    texture.imported = true;
+    return node;
+}
+
+u32 ImportFrameGraphBackbuffer(FrameGraph& graph, glm::ivec2 size)
+{
+    u32 node = ImportFrameGraphTexture(graph, "Backbuffer", 0, GL_RGBA8, size);
+    graph.textures.back().backbuffer = true;
+    return node;
+}
+
+u32 AddFrameGraphPass(FrameGraph& graph, const char* name, FrameGraphPassFunction* execute, void* data)
+{
+    FrameGraphPass pass = {};
+    pass.name = name;
+    pass.execute = execute;
+    pass.data = data;
+    graph.passes.push_back(pass);
+    return graph.passes.size() - 1;
+}
+
+u32 ReadFrameGraphTexture(FrameGraph& graph, u32 pass, u32 node, FrameGraphAccess access)
+{
+    AddFrameGraphUse(graph, pass, node, access, false);
+    return node;
+}
+
+u32 WriteFrameGraphTexture(FrameGraph& graph, u32 pass, u32 node, FrameGraphAccess access)
+{
+    const FrameGraphNode& previous = graph.nodes[node];
+    if (previous.producer != FRAME_GRAPH_NONE || graph.textures[previous.texture].imported)
+        AddFrameGraphUse(graph, pass, node, access, false);
+
+    u32 newNode = AddFrameGraphNode(graph, previous.texture, pass);
+    AddFrameGraphUse(graph, pass, newNode, access, true);
+    return newNode;
+}
+
+void MarkFrameGraphOutput(FrameGraph& graph, u32 node)
+{
+    graph.nodes[node].output = true;
+}
+
+GLuint GetFrameGraphTexture(const FrameGraph& graph, u32 node)
+{
+    return graph.textures[graph.nodes[node].texture].handle;
+}
+
+static void CullFrameGraphPasses(FrameGraph& graph)
+{
+    for (FrameGraphNode& node : graph.nodes)
+        node.refCount = node.output ? 1 : 0;
+
+    for (FrameGraphPass& pass : graph.passes)
+    {
+        pass.refCount = 0;
+        for (u32 i = 0; i < pass.useCount; ++i)
+        {
+            if (pass.uses[i].write)
+                pass.refCount++;
+            else
+                graph.nodes[pass.uses[i].node].refCount++;
+        }
+    }
+
+    // Nodes nobody reads release their producer, and passes producing nothing read release
+    // their own inputs
+    std::vector<u32> unreferenced;
+    for (u32 i = 0; i < (u32)graph.nodes.size(); ++i)
+    {
+        if (graph.nodes[i].refCount == 0)
+            unreferenced.push_back(i);
+    }
+
+    while (!unreferenced.empty())
+    {
+        const FrameGraphNode& node = graph.nodes[unreferenced.back()];
+        unreferenced.pop_back();
+        if (node.producer == FRAME_GRAPH_NONE)
+            continue;
+
+        FrameGraphPass& producer = graph.passes[node.producer];
+        if (--producer.refCount > 0)
+            continue;
+
+        for (u32 i = 0; i < producer.useCount; ++i)
+        {
+            const FrameGraphUse& use = producer.uses[i];
+            if (!use.write && --graph.nodes[use.node].refCount == 0)
+                unreferenced.push_back(use.node);
+        }
+    }
+
+    // Passes writing nothing are there for their side effects
+    for (FrameGraphPass& pass : graph.passes)
+    {
+        bool writes = false;
+        for (u32 i = 0; i < pass.useCount; ++i)
+            writes |= pass.uses[i].write;
+        pass.culled = writes && pass.refCount == 0;
+    }
+}
+
+static void BindFrameGraphPassFramebuffer(FrameGraph& graph, const FrameGraphPass& pass, RenderTargetPool& pool)
+{
+    GLuint colors[RENDER_TARGET_MAX_ATTACHMENTS];
+    u32 colorCount = 0;
+    const FrameGraphTexture* depth = NULL;
+    const FrameGraphTexture* first = NULL;
+    bool backbuffer = false;
+
+    // Color attachments in the order they were declared, each texture once
+    for (u32 i = 0; i < pass.useCount; ++i)
+    {
+        if (pass.uses[i].access != FRAME_GRAPH_ATTACHMENT)
+            continue;
+
+        const FrameGraphTexture& texture = graph.textures[graph.nodes[pass.uses[i].node].texture];
+        if (!first)
+            first = &texture;
+
+        if (texture.backbuffer)
+        {
+            backbuffer = true;
+        }
+        else if (IsDepthFormat(texture.format))
+        {
+            depth = &texture;
+        }
+        else
+        {
+            bool attached = false;
+            for (u32 j = 0; j < colorCount; ++j)
+                attached |= colors[j] == texture.handle;
+
+            if (!attached)
+            {
+                ASSERT(colorCount < RENDER_TARGET_MAX_ATTACHMENTS, "Too many color attachments in a frame graph pass");
+                colors[colorCount++] = texture.handle;
+            }
+        }
+    }
+
+    if (!first)
+        return;
+
+    if (backbuffer)
+    {
+        ASSERT(colorCount == 0 && !depth, "The backbuffer can't be combined with other attachments");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    else
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, GetRenderTargetFramebuffer(pool, colors, colorCount, depth ? depth->handle : 0));
+    }
+    glViewport(0, 0, first->size.x, first->size.y);
+}
+
+void ExecuteFrameGraph(FrameGraph& graph, RenderTargetPool& pool, GpuProfiler& profiler)
+{
+    TRACE_FUNCTION();
+
+    CullFrameGraphPasses(graph);
+
+    for (FrameGraphTexture& texture : graph.textures)
+    {
+        texture.firstPass = FRAME_GRAPH_NONE;
+        texture.lastPass = FRAME_GRAPH_NONE;
+    }
+
+    for (u32 passIdx = 0; passIdx < (u32)graph.passes.size(); ++passIdx)
+    {
+        const FrameGraphPass& pass = graph.passes[passIdx];
+        if (pass.culled)
+            continue;
+
+        for (u32 i = 0; i < pass.useCount; ++i)
+        {
+            FrameGraphTexture& texture = graph.textures[graph.nodes[pass.uses[i].node].texture];
+            if (texture.firstPass == FRAME_GRAPH_NONE)
+                texture.firstPass = passIdx;
+            texture.lastPass = passIdx;
+        }
+    }
+
+    for (u32 passIdx = 0; passIdx < (u32)graph.passes.size(); ++passIdx)
+    {
+        FrameGraphPass& pass = graph.passes[passIdx];
+        if (pass.culled)
+            continue;
+
+        for (FrameGraphTexture& texture : graph.textures)
+        {
+            if (!texture.imported && texture.firstPass == passIdx)
+                texture.handle = AcquireRenderTarget(pool, texture.format, texture.size, texture.samples);
+        }
+
+        // Framebuffer writes are visible to the next draws, only image stores need a barrier
+        GLbitfield barriers = 0;
+        for (u32 i = 0; i < pass.useCount; ++i)
+        {
+            FrameGraphTexture& texture = graph.textures[graph.nodes[pass.uses[i].node].texture];
+            if (!pass.uses[i].write && texture.storageWritten)
+            {
+                switch (pass.uses[i].access)
+                {
+                case FRAME_GRAPH_SAMPLED:    barriers |= GL_TEXTURE_FETCH_BARRIER_BIT; break;
+                case FRAME_GRAPH_ATTACHMENT: barriers |= GL_FRAMEBUFFER_BARRIER_BIT; break;
+                case FRAME_GRAPH_COPY:       barriers |= GL_TEXTURE_UPDATE_BARRIER_BIT; break;
+                default:                     barriers |= GL_SHADER_IMAGE_ACCESS_BARRIER_BIT; break;
+                }
+                texture.storageWritten = false;
+            }
+        }
+        if (barriers)
+            glMemoryBarrier(barriers);
+
+        BindFrameGraphPassFramebuffer(graph, pass, pool);
+
+        {
+            TraceScope traceScope(pass.name);
+            GpuScope gpuScope(profiler, pass.name);
+            pass.execute(graph, pass.data);
+        }
+
+        for (u32 i = 0; i < pass.useCount; ++i)
+        {
+            if (pass.uses[i].write && pass.uses[i].access == FRAME_GRAPH_STORAGE)
+                graph.textures[graph.nodes[pass.uses[i].node].texture].storageWritten = true;
+        }
+
+        for (FrameGraphTexture& texture : graph.textures)
+        {
+            if (!texture.imported && texture.lastPass == passIdx)
+                ReleaseRenderTarget(pool, texture.handle);
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
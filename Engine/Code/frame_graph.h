@@ -0,0 +1,118 @@
+//
+// frame_graph.h: Passes of a frame declared with the textures they read and write. Every write
+// creates a new version of the texture, so the graph knows which pass produced what each pass
+// reads. When executed, the passes whose results nobody reads are culled, transient textures
+// are acquired from the render target pool right before their first pass and released after
+// their last one, and the framebuffer of each pass is made from its attachments.
+//
+
+#pragma once
+#ifndef FRAME_GRAPH_H
+#define FRAME_GRAPH_H
+
+#include <glad/glad.h>
+
+#define FRAME_GRAPH_MAX_PASS_USES 16
+#define FRAME_GRAPH_NONE          UINT32_MAX
+
+enum FrameGraphAccess
+{
+    FRAME_GRAPH_SAMPLED,    // Read in a shader
+    FRAME_GRAPH_ATTACHMENT, // Bound to the framebuffer of the pass (reading it only means depth testing)
+    FRAME_GRAPH_STORAGE,    // Image load/store, needs a barrier before being read
+    FRAME_GRAPH_COPY        // Source or destination of glCopyImageSubData
+};
+
+struct FrameGraph;
+
+typedef void FrameGraphPassFunction(FrameGraph& graph, void* data);
+
+struct FrameGraphTexture
+{
+    const char* name;
+    GLenum      format;
+    glm::ivec2  size;
+    u32         samples;
+    GLuint      handle;         // Imported, or acquired from the pool while executing
+    bool        imported;
+    bool        backbuffer;     // The default framebuffer
+    bool        storageWritten; // Written with image stores since the last barrier
+    u32         firstPass;      // Lifetime among the passes not culled
+    u32         lastPass;
+};
+
+// A version of a texture
+struct FrameGraphNode
+{
+    u32  texture;
+    u32  producer;
+    u32  refCount;
+    bool output;
+};
+
+struct FrameGraphUse
+{
+    u32  node;
+    u8   access; // FrameGraphAccess
+    bool write;
+};
+
+struct FrameGraphPass
+{
+    const char*             name;
+    FrameGraphPassFunction* execute;
+    void*                   data;
+    FrameGraphUse           uses[FRAME_GRAPH_MAX_PASS_USES];
+    u32                     useCount;
+    u32                     refCount;
+    bool                    culled;
+};
+
+struct FrameGraph
+{
+    std::vector<FrameGraphTexture> textures;
+    std::vector<FrameGraphNode>    nodes;
+    std::vector<FrameGraphPass>    passes; // In execution order
+};
+
+void BeginFrameGraph(FrameGraph& graph);
+
+/**
+ * Transient texture, only alive between the first and the last pass using it. Returns the
+ * node of its first version.
+ */
+u32 CreateFrameGraphTexture(FrameGraph& graph, const char* name, GLenum format, glm::ivec2 size, u32 samples = 1);
+
+/**
+ * Texture owned by someone else, kept after the frame.
+ */
+u32 ImportFrameGraphTexture(FrameGraph& graph, const char* name, GLuint handle, GLenum format, glm::ivec2 size);
+
+u32 ImportFrameGraphBackbuffer(FrameGraph& graph, glm::ivec2 size);
+
+/**
+ * name and data must live until the graph is executed.
+ */
+u32 AddFrameGraphPass(FrameGraph& graph, const char* name, FrameGraphPassFunction* execute, void* data);
+
+u32 ReadFrameGraphTexture(FrameGraph& graph, u32 pass, u32 node, FrameGraphAccess access = FRAME_GRAPH_SAMPLED);
+
+/**
+ * Returns the node of the new version, which later passes must read instead of node. Passes
+ * draw over the previous contents, so they also depend on the previous version.
+ */
+u32 WriteFrameGraphTexture(FrameGraph& graph, u32 pass, u32 node, FrameGraphAccess access = FRAME_GRAPH_ATTACHMENT);
+
+/**
+ * The passes needed to produce the outputs are the only ones executed.
+ */
+void MarkFrameGraphOutput(FrameGraph& graph, u32 node);
+
+void ExecuteFrameGraph(FrameGraph& graph, RenderTargetPool& pool, GpuProfiler& profiler);
+
+/**
+ * Only valid while the passes using the node are executed.
+ */
+GLuint GetFrameGraphTexture(const FrameGraph& graph, u32 node);
+
+#endif // FRAME_GRAPH_H
@@ -0,0 +1,77 @@
+#include "Global.h"
+
+#ifdef GL_STATS_ENABLED
+
+GlStats GlobalGlStats = {};
+GlStats GlobalGlStatsLastFrame = {};
+
+void BeginGlStatsFrame()
+{
+    GlobalGlStatsLastFrame = GlobalGlStats;
+    GlobalGlStats = {};
+}
+
+const GlStats& GetGlStats()
+{
+    return GlobalGlStatsLastFrame;
+}
+
+void CountGlDraw(GLenum mode, GLsizei count, GLsizei instanceCount)
+{
+    u64 triangles = 0;
+    switch (mode)
+    {
+        case GL_TRIANGLES:      triangles = count / 3; break;
+        case GL_TRIANGLE_STRIP:
+        case GL_TRIANGLE_FAN:   triangles = count > 2 ? count - 2 : 0; break;
+        default: break;
+    }
+
+    GlobalGlStats.drawCalls++;
+    GlobalGlStats.triangles += triangles * instanceCount;
+}
+
+static u32 GetPixelSize(GLenum format, GLenum type)
+{
+    u32 components = 4;
+    switch (format)
+    {
+        case GL_RED: case GL_DEPTH_COMPONENT: case GL_STENCIL_INDEX: components = 1; break;
+        case GL_RG: case GL_DEPTH_STENCIL:                            components = 2; break;
+        case GL_RGB: case GL_BGR:                                     components = 3; break;
+        default: break;
+    }
+
+    switch (type)
+    {
+        case GL_UNSIGNED_BYTE: case GL_BYTE:                       return components;
+        case GL_UNSIGNED_SHORT: case GL_SHORT: case GL_HALF_FLOAT: return components * 2;
+        case GL_UNSIGNED_INT_24_8:                                 return 4; // Packed
+        default:                                                   return components * 4;
+    }
+}
+
+void CountGlTextureUpload(GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels)
+{
+    // Without pixels only the storage is allocated
+    if (pixels)
+        GlobalGlStats.uploadedBytes += (u64)width * height * GetPixelSize(format, type);
+}
+
+void CountGlBufferMap(GLenum target, GLsizeiptr length, GLbitfield access)
+{
+    // Explicitly flushed ranges are counted when flushed
+    if (!(access & GL_MAP_WRITE_BIT) || (access & GL_MAP_FLUSH_EXPLICIT_BIT))
+        return;
+
+    // glMapBuffer maps the whole buffer
+    if (length < 0)
+    {
+        GLint64 bufferSize = 0;
+        glGetBufferParameteri64v(target, GL_BUFFER_SIZE, &bufferSize);
+        length = (GLsizeiptr)bufferSize;
+    }
+    GlobalGlStats.uploadedBytes += length;
+}
+
+#endif // GL_STATS_ENABLED
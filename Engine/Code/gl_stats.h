@@ -0,0 +1,304 @@
+//
+// gl_stats.h: Per frame counters of the GL work issued by the engine (draw calls, triangles,
+// binds, uniform updates and uploaded bytes). The GL entry points below are redefined to thin
+// wrappers that count and forward to glad. In release builds (NDEBUG) none of this exists and
+// the calls go straight to glad.
+//
+
+#pragma once
+#ifndef GL_STATS_H
+#define GL_STATS_H
+
+#include <glad/glad.h>
+
+#ifndef NDEBUG
+#define GL_STATS_ENABLED
+#endif
+
+struct GlStats
+{
+    u32 drawCalls;
+    u64 triangles;
+    u32 programBinds;
+    u32 vertexArrayBinds;
+    u32 textureBinds;
+    u32 bufferBinds;
+    u32 framebufferBinds;
+    u32 uniformUpdates;
+    u64 uploadedBytes;
+};
+
+#ifdef GL_STATS_ENABLED
+
+extern GlStats GlobalGlStats;
+
+/**
+ * Keeps the counters of the frame that just finished and starts counting a new one.
+ */
+void BeginGlStatsFrame();
+
+/**
+ * Counters of the last finished frame.
+ */
+const GlStats& GetGlStats();
+
+void CountGlDraw(GLenum mode, GLsizei count, GLsizei instanceCount);
+
+void CountGlTextureUpload(GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels);
+
+void CountGlBufferMap(GLenum target, GLsizeiptr length, GLbitfield access);
+
+// Draws
+
+inline void GlStatsDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+    CountGlDraw(mode, count, 1);
+    glad_glDrawArrays(mode, first, count);
+}
+
+inline void GlStatsDrawElements(GLenum mode, GLsizei count, GLenum type, const void* indices)
+{
+    CountGlDraw(mode, count, 1);
+    glad_glDrawElements(mode, count, type, indices);
+}
+
+inline void GlStatsDrawElementsBaseVertex(GLenum mode, GLsizei count, GLenum type, const void* indices, GLint baseVertex)
+{
+    CountGlDraw(mode, count, 1);
+    glad_glDrawElementsBaseVertex(mode, count, type, indices, baseVertex);
+}
+
+inline void GlStatsDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instanceCount)
+{
+    CountGlDraw(mode, count, instanceCount);
+    glad_glDrawArraysInstanced(mode, first, count, instanceCount);
+}
+
+inline void GlStatsDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instanceCount)
+{
+    CountGlDraw(mode, count, instanceCount);
+    glad_glDrawElementsInstanced(mode, count, type, indices, instanceCount);
+}
+
+inline void GlStatsDrawElementsInstancedBaseInstance(GLenum mode, GLsizei count, GLenum type, const void* indices,
+                                                     GLsizei instanceCount, GLuint baseInstance)
+{
+    CountGlDraw(mode, count, instanceCount);
+    glad_glDrawElementsInstancedBaseInstance(mode, count, type, indices, instanceCount, baseInstance);
+}
+
+inline void GlStatsDrawElementsInstancedBaseVertexBaseInstance(GLenum mode, GLsizei count, GLenum type, const void* indices,
+                                                               GLsizei instanceCount, GLint baseVertex, GLuint baseInstance)
+{
+    CountGlDraw(mode, count, instanceCount);
+    glad_glDrawElementsInstancedBaseVertexBaseInstance(mode, count, type, indices, instanceCount, baseVertex, baseInstance);
+}
+
+// Binds
+
+inline void GlStatsUseProgram(GLuint program)
+{
+    GlobalGlStats.programBinds++;
+    glad_glUseProgram(program);
+}
+
+inline void GlStatsBindVertexArray(GLuint vertexArray)
+{
+    GlobalGlStats.vertexArrayBinds++;
+    glad_glBindVertexArray(vertexArray);
+}
+
+inline void GlStatsBindTexture(GLenum target, GLuint texture)
+{
+    GlobalGlStats.textureBinds++;
+    glad_glBindTexture(target, texture);
+}
+
+inline void GlStatsBindBuffer(GLenum target, GLuint buffer)
+{
+    GlobalGlStats.bufferBinds++;
+    glad_glBindBuffer(target, buffer);
+}
+
+inline void GlStatsBindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    GlobalGlStats.bufferBinds++;
+    glad_glBindBufferBase(target, index, buffer);
+}
+
+inline void GlStatsBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    GlobalGlStats.bufferBinds++;
+    glad_glBindBufferRange(target, index, buffer, offset, size);
+}
+
+inline void GlStatsBindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    GlobalGlStats.framebufferBinds++;
+    glad_glBindFramebuffer(target, framebuffer);
+}
+
+// Uniforms
+
+inline void GlStatsUniform1i(GLint location, GLint v0)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform1i(location, v0);
+}
+
+inline void GlStatsUniform1f(GLint location, GLfloat v0)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform1f(location, v0);
+}
+
+inline void GlStatsUniform2f(GLint location, GLfloat v0, GLfloat v1)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform2f(location, v0, v1);
+}
+
+inline void GlStatsUniform3f(GLint location, GLfloat v0, GLfloat v1, GLfloat v2)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform3f(location, v0, v1, v2);
+}
+
+inline void GlStatsUniform3fv(GLint location, GLsizei count, const GLfloat* value)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform3fv(location, count, value);
+}
+
+inline void GlStatsUniform4fv(GLint location, GLsizei count, const GLfloat* value)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniform4fv(location, count, value);
+}
+
+inline void GlStatsUniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniformMatrix3fv(location, count, transpose, value);
+}
+
+inline void GlStatsUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value)
+{
+    GlobalGlStats.uniformUpdates++;
+    glad_glUniformMatrix4fv(location, count, transpose, value);
+}
+
+// Uploads
+
+inline void GlStatsBufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+    if (data)
+        GlobalGlStats.uploadedBytes += size;
+    glad_glBufferData(target, size, data, usage);
+}
+
+inline void GlStatsBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void* data)
+{
+    GlobalGlStats.uploadedBytes += size;
+    glad_glBufferSubData(target, offset, size, data);
+}
+
+inline void* GlStatsMapBuffer(GLenum target, GLenum access)
+{
+    CountGlBufferMap(target, -1, access == GL_READ_ONLY ? GL_MAP_READ_BIT : GL_MAP_WRITE_BIT);
+    return glad_glMapBuffer(target, access);
+}
+
+inline void* GlStatsMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+    CountGlBufferMap(target, length, access);
+    return glad_glMapBufferRange(target, offset, length, access);
+}
+
+inline void GlStatsFlushMappedBufferRange(GLenum target, GLintptr offset, GLsizeiptr length)
+{
+    GlobalGlStats.uploadedBytes += length;
+    glad_glFlushMappedBufferRange(target, offset, length);
+}
+
+inline void GlStatsTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border,
+                              GLenum format, GLenum type, const void* pixels)
+{
+    CountGlTextureUpload(width, height, format, type, pixels);
+    glad_glTexImage2D(target, level, internalFormat, width, height, border, format, type, pixels);
+}
+
+inline void GlStatsTexSubImage2D(GLenum target, GLint level, GLint xOffset, GLint yOffset, GLsizei width, GLsizei height,
+                                 GLenum format, GLenum type, const void* pixels)
+{
+    CountGlTextureUpload(width, height, format, type, pixels);
+    glad_glTexSubImage2D(target, level, xOffset, yOffset, width, height, format, type, pixels);
+}
+
+#undef glDrawArrays
+#undef glDrawElements
+#undef glDrawElementsBaseVertex
+#undef glDrawArraysInstanced
+#undef glDrawElementsInstanced
+#undef glDrawElementsInstancedBaseInstance
+#undef glDrawElementsInstancedBaseVertexBaseInstance
+#undef glUseProgram
+#undef glBindVertexArray
+#undef glBindTexture
+#undef glBindBuffer
+#undef glBindBufferBase
+#undef glBindBufferRange
+#undef glBindFramebuffer
+#undef glUniform1i
+#undef glUniform1f
+#undef glUniform2f
+#undef glUniform3f
+#undef glUniform3fv
+#undef glUniform4fv
+#undef glUniformMatrix3fv
+#undef glUniformMatrix4fv
+#undef glBufferData
+#undef glBufferSubData
+#undef glMapBuffer
+#undef glMapBufferRange
+#undef glFlushMappedBufferRange
+#undef glTexImage2D
+#undef glTexSubImage2D
+
+#define glDrawArrays                                  GlStatsDrawArrays
+#define glDrawElements                                GlStatsDrawElements
+#define glDrawElementsBaseVertex                      GlStatsDrawElementsBaseVertex
+#define glDrawArraysInstanced                         GlStatsDrawArraysInstanced
+#define glDrawElementsInstanced                       GlStatsDrawElementsInstanced
+#define glDrawElementsInstancedBaseInstance           GlStatsDrawElementsInstancedBaseInstance
+#define glDrawElementsInstancedBaseVertexBaseInstance GlStatsDrawElementsInstancedBaseVertexBaseInstance
+#define glUseProgram                                  GlStatsUseProgram
+#define glBindVertexArray                             GlStatsBindVertexArray
+#define glBindTexture                                 GlStatsBindTexture
+#define glBindBuffer                                  GlStatsBindBuffer
+#define glBindBufferBase                              GlStatsBindBufferBase
+#define glBindBufferRange                             GlStatsBindBufferRange
+#define glBindFramebuffer                             GlStatsBindFramebuffer
+#define glUniform1i                                   GlStatsUniform1i
+#define glUniform1f                                   GlStatsUniform1f
+#define glUniform2f                                   GlStatsUniform2f
+#define glUniform3f                                   GlStatsUniform3f
+#define glUniform3fv                                  GlStatsUniform3fv
+#define glUniform4fv                                  GlStatsUniform4fv
+#define glUniformMatrix3fv                            GlStatsUniformMatrix3fv
+#define glUniformMatrix4fv                            GlStatsUniformMatrix4fv
+#define glBufferData                                  GlStatsBufferData
+#define glBufferSubData                               GlStatsBufferSubData
+#define glMapBuffer                                   GlStatsMapBuffer
+#define glMapBufferRange                              GlStatsMapBufferRange
+#define glFlushMappedBufferRange                      GlStatsFlushMappedBufferRange
+#define glTexImage2D                                  GlStatsTexImage2D
+#define glTexSubImage2D                               GlStatsTexSubImage2D
+
+#else
+
+inline void BeginGlStatsFrame() {}
+
+#endif // GL_STATS_ENABLED
+
+#endif // GL_STATS_H
@@ -0,0 +1,136 @@
+#include "Global.h"
+
+// Offset of a member as named by glGetActiveUniformName: "uLight[2].color", "uView"...
+static bool FindGpuFieldOffset(const GpuField* fields, u32 fieldCount, GpuLayout layout, const char* name, u32& offset)
+{
+    for (u32 i = 0; i < fieldCount; ++i)
+    {
+        const GpuField& field = fields[i];
+        u32 length = (u32)strlen(field.name);
+        const char* rest = name + length;
+        if (strncmp(name, field.name, length) != 0 || (*rest != '\0' && *rest != '[' && *rest != '.'))
+            continue;
+
+        u32 fieldOffset = GpuFieldOffset(fields, i, layout);
+        if (*rest == '[')
+        {
+            char* end = NULL;
+            fieldOffset += (u32)strtoul(rest + 1, &end, 10) * field.arrayStride;
+            rest = *end == ']' ? end + 1 : end;
+        }
+
+        if (*rest == '.')
+        {
+            u32 memberOffset = 0;
+            if (!FindGpuFieldOffset(field.fields, field.fieldCount, layout, rest + 1, memberOffset))
+                return false;
+            fieldOffset += memberOffset;
+        }
+        else if (*rest != '\0')
+        {
+            return false;
+        }
+
+        offset = fieldOffset;
+        return true;
+    }
+    return false;
+}
+
+bool ValidateGpuBlock(GLuint program, const char* blockName, const GpuField* fields, u32 fieldCount, GpuLayout layout, u32 size)
+{
+    GLuint blockIndex = glGetUniformBlockIndex(program, blockName);
+    if (blockIndex == GL_INVALID_INDEX)
+        return true;
+
+    bool valid = true;
+
+    GLint dataSize = 0;
+    glGetActiveUniformBlockiv(program, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+    if ((u32)dataSize > size)
+    {
+        ELOG("Uniform block %s takes %d bytes in GLSL but %u in C++", blockName, dataSize, size);
+        valid = false;
+    }
+
+    GLint uniformCount = 0;
+    glGetActiveUniformBlockiv(program, blockIndex, GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &uniformCount);
+    if (uniformCount == 0)
+        return valid;
+
+    std::vector<GLint> indices(uniformCount);
+    std::vector<GLint> offsets(uniformCount);
+    glGetActiveUniformBlockiv(program, blockIndex, GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES, indices.data());
+    glGetActiveUniformsiv(program, uniformCount, (const GLuint*)indices.data(), GL_UNIFORM_OFFSET, offsets.data());
+
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        char name[256];
+        glGetActiveUniformName(program, indices[i], sizeof(name), NULL, name);
+
+        u32 expectedOffset = 0;
+        if (!FindGpuFieldOffset(fields, fieldCount, layout, name, expectedOffset))
+        {
+            ELOG("Uniform %s of block %s has no C++ counterpart", name, blockName);
+            valid = false;
+        }
+        else if ((u32)offsets[i] != expectedOffset)
+        {
+            ELOG("Uniform %s of block %s is at offset %d in GLSL but %u in C++", name, blockName, offsets[i], expectedOffset);
+            valid = false;
+        }
+    }
+
+    return valid;
+}
+
+bool ValidateGpuStorageArray(GLuint program, const char* blockName, const GpuField* fields, u32 fieldCount, GpuLayout layout, u32 stride)
+{
+    GLuint blockIndex = glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK, blockName);
+    if (blockIndex == GL_INVALID_INDEX)
+        return true;
+
+    bool valid = true;
+
+    GLenum property = GL_NUM_ACTIVE_VARIABLES;
+    GLint variableCount = 0;
+    glGetProgramResourceiv(program, GL_SHADER_STORAGE_BLOCK, blockIndex, 1, &property, 1, NULL, &variableCount);
+    if (variableCount == 0)
+        return valid;
+
+    std::vector<GLint> variables(variableCount);
+    property = GL_ACTIVE_VARIABLES;
+    glGetProgramResourceiv(program, GL_SHADER_STORAGE_BLOCK, blockIndex, 1, &property, variableCount, NULL, variables.data());
+
+    for (GLint i = 0; i < variableCount; ++i)
+    {
+        char name[256];
+        glGetProgramResourceName(program, GL_BUFFER_VARIABLE, variables[i], sizeof(name), NULL, name);
+
+        const GLenum properties[] = { GL_OFFSET, GL_TOP_LEVEL_ARRAY_STRIDE };
+        GLint values[ARRAY_COUNT(properties)] = {};
+        glGetProgramResourceiv(program, GL_BUFFER_VARIABLE, variables[i], ARRAY_COUNT(properties), properties, ARRAY_COUNT(values), NULL, values);
+
+        // Members of the first element are named "uArray[0].member"
+        const char* member = strstr(name, "].");
+        u32 expectedOffset = 0;
+        if (!member || !FindGpuFieldOffset(fields, fieldCount, layout, member + 2, expectedOffset))
+        {
+            ELOG("Buffer variable %s of block %s has no C++ counterpart", name, blockName);
+            valid = false;
+        }
+        else if ((u32)values[0] != expectedOffset)
+        {
+            ELOG("Buffer variable %s of block %s is at offset %d in GLSL but %u in C++", name, blockName, values[0], expectedOffset);
+            valid = false;
+        }
+
+        if ((u32)values[1] != stride)
+        {
+            ELOG("Elements of block %s are %d bytes apart in GLSL but %u in C++", blockName, values[1], stride);
+            valid = false;
+        }
+    }
+
+    return valid;
+}
@@ -0,0 +1,185 @@
+//
+// gpu_layout.h: C++ structs laid out like std140/std430 blocks. A block is described once as a
+// list of fields, from which the struct is declared with the alignment of every member, so it
+// can be written to a buffer with a single memcpy. The offsets the layout rules give are
+// checked against the compiler at compile time, and against the linked programs at run time.
+// The field list is a macro, with every line but the last continued with a backslash:
+//
+//     #define MY_BLOCK_FIELDS(FIELD)
+//         FIELD(glm::vec3, position, "uPosition")
+//         FIELD(f32,       radius,   "uRadius")
+//     GPU_STRUCT(MyBlock, GPU_STD140, MY_BLOCK_FIELDS)
+//
+
+#pragma once
+#ifndef GPU_LAYOUT_H
+#define GPU_LAYOUT_H
+
+#include <glad/glad.h>
+#include <stddef.h>
+
+enum GpuLayout
+{
+    GPU_STD140, // Uniform blocks
+    GPU_STD430  // Storage blocks, arrays and structs aren't rounded up to a vec4
+};
+
+struct GpuField
+{
+    const char*     name;        // As declared in GLSL
+    u32             size;
+    u32             std140Align;
+    u32             std430Align;
+    u32             arrayStride; // 0 if not an array
+    const GpuField* fields;      // Members of a struct, or of the elements of an array of structs
+    u32             fieldCount;
+};
+
+constexpr u32 GpuAlignUp(u32 value, u32 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+constexpr u32 GpuFieldAlign(const GpuField& field, GpuLayout layout)
+{
+    return layout == GPU_STD140 ? field.std140Align : field.std430Align;
+}
+
+constexpr u32 GpuFieldOffset(const GpuField* fields, u32 index, GpuLayout layout)
+{
+    u32 offset = 0;
+    for (u32 i = 0; i < index; ++i)
+        offset = GpuAlignUp(offset, GpuFieldAlign(fields[i], layout)) + fields[i].size;
+    return GpuAlignUp(offset, GpuFieldAlign(fields[index], layout));
+}
+
+constexpr u32 GpuStructBaseAlign(const GpuField* fields, u32 count, GpuLayout layout)
+{
+    u32 align = 4;
+    for (u32 i = 0; i < count; ++i)
+        align = GpuFieldAlign(fields[i], layout) > align ? GpuFieldAlign(fields[i], layout) : align;
+    return align;
+}
+
+// std140 rounds the alignment of structs up to a vec4
+constexpr u32 GpuStructAlign(const GpuField* fields, u32 count, GpuLayout layout)
+{
+    return layout == GPU_STD140 ? GpuAlignUp(GpuStructBaseAlign(fields, count, layout), 16) : GpuStructBaseAlign(fields, count, layout);
+}
+
+constexpr u32 GpuStructSize(const GpuField* fields, u32 count, GpuLayout layout)
+{
+    return GpuAlignUp(GpuFieldOffset(fields, count - 1, layout) + fields[count - 1].size, GpuStructAlign(fields, count, layout));
+}
+
+// Size and base alignments of the types a field can have. Structs declared with GPU_STRUCT
+// describe themselves.
+template<typename T>
+struct GpuType
+{
+    static constexpr u32 size = sizeof(T);
+    static constexpr u32 std140Align = T::gpuStd140Align;
+    static constexpr u32 std430Align = T::gpuStd430Align;
+    static constexpr u32 arrayStride = 0;
+    static constexpr const GpuField* fields = T::gpuFields;
+    static constexpr u32 fieldCount = T::gpuFieldCount;
+};
+
+#define GPU_BASIC_TYPE(type, typeSize, typeAlign)                  \
+    template<> struct GpuType<type>                                \
+    {                                                              \
+        static constexpr u32 size = typeSize;                      \
+        static constexpr u32 std140Align = typeAlign;              \
+        static constexpr u32 std430Align = typeAlign;              \
+        static constexpr u32 arrayStride = 0;                      \
+        static constexpr const GpuField* fields = nullptr;         \
+        static constexpr u32 fieldCount = 0;                       \
+    };
+
+GPU_BASIC_TYPE(u32,        4,  4)
+GPU_BASIC_TYPE(i32,        4,  4)
+GPU_BASIC_TYPE(f32,        4,  4)
+GPU_BASIC_TYPE(glm::vec2,  8,  8)
+GPU_BASIC_TYPE(glm::ivec2, 8,  8)
+GPU_BASIC_TYPE(glm::vec3,  12, 16)
+GPU_BASIC_TYPE(glm::vec4,  16, 16)
+GPU_BASIC_TYPE(glm::ivec4, 16, 16)
+GPU_BASIC_TYPE(glm::uvec4, 16, 16)
+GPU_BASIC_TYPE(glm::mat4,  64, 16)
+
+// The elements of a C++ array are sizeof(T) apart, so only element types whose stride is the
+// same in GLSL can be used (in std140, vec4, mat4 and structs, in std430 anything but vec3)
+template<typename T, size_t N>
+struct GpuType<T[N]>
+{
+    static constexpr u32 size = N * sizeof(T);
+    static constexpr u32 std140Align = GpuAlignUp(GpuType<T>::std140Align, 16);
+    static constexpr u32 std430Align = GpuType<T>::std430Align;
+    static constexpr u32 arrayStride = sizeof(T);
+    static constexpr const GpuField* fields = GpuType<T>::fields;
+    static constexpr u32 fieldCount = GpuType<T>::fieldCount;
+};
+
+// Lets array types be written as T[N] in the field lists
+template<typename T>
+using GpuMember = T;
+
+#define GPU_FIELD_INFO(type, name, glslName) \
+    { glslName, GpuType<type>::size, GpuType<type>::std140Align, GpuType<type>::std430Align, GpuType<type>::arrayStride, GpuType<type>::fields, GpuType<type>::fieldCount },
+#define GPU_FIELD_INDEX(type, name, glslName) name##FieldIndex,
+#define GPU_FIELD_MEMBER(type, name, glslName) alignas(gpuLayout == GPU_STD140 ? GpuType<type>::std140Align : GpuType<type>::std430Align) GpuMember<type> name;
+#define GPU_FIELD_CHECK(type, name, glslName)                                                             \
+    static_assert(offsetof(GpuSelf, name) == GpuFieldOffset(gpuFields, name##FieldIndex, gpuLayout),      \
+                  "C++ and GLSL offsets of " #name " differ");                                            \
+    static_assert(GpuType<type>::arrayStride == 0 ||                                                      \
+                  GpuType<type>::arrayStride == GpuAlignUp(GpuType<type>::arrayStride,                        \
+                      gpuLayout == GPU_STD140 ? GpuType<type>::std140Align : GpuType<type>::std430Align),     \
+                  "C++ and GLSL array strides of " #name " differ");
+
+#define GPU_STRUCT(structName, layout, FIELDS)                                                                       \
+    static constexpr GpuField structName##GpuFields[] = { FIELDS(GPU_FIELD_INFO) };                                    \
+    struct alignas(GpuStructAlign(structName##GpuFields, ARRAY_COUNT(structName##GpuFields), layout)) structName       \
+    {                                                                                                                \
+        typedef structName GpuSelf;                                                                                  \
+        static constexpr GpuLayout gpuLayout = layout;                                                               \
+        static constexpr const GpuField* gpuFields = structName##GpuFields;                                          \
+        static constexpr u32 gpuFieldCount = ARRAY_COUNT(structName##GpuFields);                                     \
+        static constexpr u32 gpuStd140Align = GpuStructAlign(structName##GpuFields, gpuFieldCount, GPU_STD140);      \
+        static constexpr u32 gpuStd430Align = GpuStructAlign(structName##GpuFields, gpuFieldCount, GPU_STD430);      \
+        enum GpuFieldIndex { FIELDS(GPU_FIELD_INDEX) };                                                              \
+                                                                                                                     \
+        FIELDS(GPU_FIELD_MEMBER)                                                                                     \
+                                                                                                                     \
+        static void CheckGpuLayout()                                                                                 \
+        {                                                                                                            \
+            FIELDS(GPU_FIELD_CHECK)                                                                                  \
+            static_assert(sizeof(GpuSelf) == GpuStructSize(gpuFields, gpuFieldCount, gpuLayout),                     \
+                          "C++ and GLSL sizes of " #structName " differ");                                           \
+        }                                                                                                            \
+    };
+
+/**
+ * Checks the offset of every active member of the uniform block blockName (if the program
+ * has it) against the fields of the struct. Mismatches are logged, returns false if any.
+ */
+bool ValidateGpuBlock(GLuint program, const char* blockName, const GpuField* fields, u32 fieldCount, GpuLayout layout, u32 size);
+
+template<typename T>
+bool ValidateGpuBlock(GLuint program, const char* blockName)
+{
+    return ValidateGpuBlock(program, blockName, T::gpuFields, T::gpuFieldCount, T::gpuLayout, sizeof(T));
+}
+
+/**
+ * Same for a storage block holding a single runtime sized array of structs: the members of an
+ * element and the array stride are checked against T.
+ */
+bool ValidateGpuStorageArray(GLuint program, const char* blockName, const GpuField* fields, u32 fieldCount, GpuLayout layout, u32 stride);
+
+template<typename T>
+bool ValidateGpuStorageArray(GLuint program, const char* blockName)
+{
+    return ValidateGpuStorageArray(program, blockName, T::gpuFields, T::gpuFieldCount, T::gpuLayout, sizeof(T));
+}
+
+#endif // GPU_LAYOUT_H
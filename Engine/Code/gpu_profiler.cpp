@@ -0,0 +1,117 @@
+#include "Global.h"
+
+void InitGpuProfiler(GpuProfiler& profiler)
+{
+    for (u32 i = 0; i < GPU_PROFILER_FRAMES; ++i)
+    {
+        GpuProfilerFrame& frame = profiler.frames[i];
+        glGenQueries(ARRAY_COUNT(frame.queries), frame.queries);
+        frame.scopeCount = 0;
+        frame.openScopeCount = 0;
+        frame.pending = false;
+    }
+    profiler.frameIndex = 0;
+    profiler.timings.clear();
+}
+
+static GpuPassTiming& FindPassTiming(GpuProfiler& profiler, const char* name, u32 depth)
+{
+    for (GpuPassTiming& timing : profiler.timings)
+    {
+        if (timing.depth == depth && strcmp(timing.name, name) == 0)
+            return timing;
+    }
+
+    GpuPassTiming timing = {};
+    timing.name = name;
+    timing.depth = depth;
+    profiler.timings.push_back(timing);
+    return profiler.timings.back();
+}
+
+static bool ReadGpuProfilerFrame(GpuProfiler& profiler, GpuProfilerFrame& frame)
+{
+    if (frame.scopeCount > 0)
+    {
+        // The last query written is the last one to be ready
+        GLuint available = 0;
+        glGetQueryObjectuiv(frame.lastQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return false;
+    }
+
+    for (u32 i = 0; i < frame.scopeCount; ++i)
+    {
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(frame.queries[i * 2 + 0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+
+        GpuPassTiming& timing = FindPassTiming(profiler, frame.scopes[i].name, frame.scopes[i].depth);
+        timing.lastMs = (f32)((end - begin) / 1000000.0);
+        timing.averageMs = timing.averageMs == 0.0f ? timing.lastMs : glm::mix(timing.averageMs, timing.lastMs, GPU_PROFILER_SMOOTHING);
+    }
+
+    frame.pending = false;
+    return true;
+}
+
+void BeginGpuProfilerFrame(GpuProfiler& profiler)
+{
+    profiler.frameIndex = (profiler.frameIndex + 1) % GPU_PROFILER_FRAMES;
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex];
+
+    // The queries of this frame are reused, so this is the last chance to read them. If the
+    // GPU is that far behind, the frame is dropped rather than waited for.
+    if (frame.pending)
+        ReadGpuProfilerFrame(profiler, frame);
+
+    frame.scopeCount = 0;
+    frame.openScopeCount = 0;
+    frame.pending = true;
+
+    // The previous frames may be ready already
+    for (u32 i = 1; i < GPU_PROFILER_FRAMES; ++i)
+    {
+        GpuProfilerFrame& previousFrame = profiler.frames[(profiler.frameIndex + i) % GPU_PROFILER_FRAMES];
+        if (previousFrame.pending && !ReadGpuProfilerFrame(profiler, previousFrame))
+            break;
+    }
+}
+
+void BeginGpuScope(GpuProfiler& profiler, const char* name)
+{
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex];
+    ASSERT(frame.scopeCount < GPU_PROFILER_MAX_SCOPES, "Too many GPU profiler scopes in a frame");
+
+    u32 scope = frame.scopeCount++;
+    frame.scopes[scope].name = name;
+    frame.scopes[scope].depth = frame.openScopeCount;
+    frame.openScopes[frame.openScopeCount++] = scope;
+
+    frame.lastQuery = frame.queries[scope * 2 + 0];
+    glQueryCounter(frame.lastQuery, GL_TIMESTAMP);
+}
+
+void EndGpuScope(GpuProfiler& profiler)
+{
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex];
+    ASSERT(frame.openScopeCount > 0, "EndGpuScope without BeginGpuScope");
+
+    u32 scope = frame.openScopes[--frame.openScopeCount];
+    frame.lastQuery = frame.queries[scope * 2 + 1];
+    glQueryCounter(frame.lastQuery, GL_TIMESTAMP);
+
+    glPopDebugGroup();
+}
+
+f32 GetGpuPassMs(const GpuProfiler& profiler, const char* name)
+{
+    for (const GpuPassTiming& timing : profiler.timings)
+    {
+        if (strcmp(timing.name, name) == 0)
+            return timing.lastMs;
+    }
+    return 0.0f;
+}
@@ -0,0 +1,81 @@
+//
+// gpu_profiler.h: GPU timings of the render passes. Every scope writes two GL_TIMESTAMP queries
+// and the results are read a few frames later, once available, so the CPU never waits for them.
+// Scopes also push debug groups so external GL profilers show the same pass names.
+//
+
+#pragma once
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <glad/glad.h>
+
+#define GPU_PROFILER_FRAMES     3  // Frames in flight before the queries are read back
+#define GPU_PROFILER_MAX_SCOPES 32 // Per frame
+#define GPU_PROFILER_SMOOTHING  0.05f
+
+struct GpuProfilerScope
+{
+    const char* name;
+    u32         depth;
+};
+
+struct GpuProfilerFrame
+{
+    GLuint           queries[GPU_PROFILER_MAX_SCOPES * 2]; // Begin and end timestamps of every scope
+    GpuProfilerScope scopes[GPU_PROFILER_MAX_SCOPES];
+    u32              scopeCount;
+    u32              openScopes[GPU_PROFILER_MAX_SCOPES];  // Stack of the scopes not ended yet
+    u32              openScopeCount;
+    GLuint           lastQuery;
+    bool             pending;                              // Waiting for the results
+};
+
+struct GpuPassTiming
+{
+    const char* name;
+    u32         depth;
+    f32         lastMs;
+    f32         averageMs;
+};
+
+struct GpuProfiler
+{
+    GpuProfilerFrame frames[GPU_PROFILER_FRAMES];
+    u32              frameIndex;
+    std::vector<GpuPassTiming> timings; // In the order they were first seen
+};
+
+void InitGpuProfiler(GpuProfiler& profiler);
+
+/**
+ * Reads the results of the oldest frame if the GPU is done with it, then starts recording
+ * the scopes of a new frame.
+ */
+void BeginGpuProfilerFrame(GpuProfiler& profiler);
+
+/**
+ * name must outlive the profiler (string literals).
+ */
+void BeginGpuScope(GpuProfiler& profiler, const char* name);
+
+void EndGpuScope(GpuProfiler& profiler);
+
+/**
+ * Last time read back for the scopes with this name, 0 if none was seen yet. Scopes not
+ * recorded in the latest frames keep their previous time.
+ */
+f32 GetGpuPassMs(const GpuProfiler& profiler, const char* name);
+
+struct GpuScope
+{
+    GpuProfiler& profiler;
+    GpuScope(GpuProfiler& profiler, const char* name) : profiler(profiler) { BeginGpuScope(profiler, name); }
+    ~GpuScope() { EndGpuScope(profiler); }
+};
+
+#define GPU_SCOPE_CONCAT2(a, b) a##b
+#define GPU_SCOPE_CONCAT(a, b) GPU_SCOPE_CONCAT2(a, b)
+#define GPU_SCOPE(profiler, name) GpuScope GPU_SCOPE_CONCAT(gpuScope, __LINE__)(profiler, name)
+
+#endif // GPU_PROFILER_H
@@ -0,0 +1,238 @@
+#include "Global.h"
+
+// Finds a layer for the texture in an array of its format and full chain size, opening a new
+// array when none has room left. Streaming never moves a texture to another array, it only
+// changes the levels its layer holds.
+static void AssignTextureLayer(MaterialTable& table, const std::vector<Texture>& textures, u32 textureIdx, u32 maxLayers)
+{
+    if (textureIdx >= textures.size() || !textures[textureIdx].handle || table.textureSlots[textureIdx] != MATERIAL_TEXTURE_NONE)
+        return;
+
+    const Texture& texture = textures[textureIdx];
+    GLint format = 0;
+    glBindTexture(GL_TEXTURE_2D, texture.handle);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    u32 arrayIdx = 0;
+    for (; arrayIdx < (u32)table.arrays.size(); ++arrayIdx)
+    {
+        const TextureArray& array = table.arrays[arrayIdx];
+        if (array.format == (GLenum)format && array.size == texture.size && array.layerCount < maxLayers)
+            break;
+    }
+
+    if (arrayIdx == table.arrays.size())
+    {
+        if (table.arrays.size() == MATERIAL_MAX_TEXTURE_ARRAYS)
+        {
+            ELOG("Texture %s doesn't fit in the material texture arrays", texture.filepath.c_str());
+            return;
+        }
+
+        TextureArray array = {};
+        array.format = format;
+        array.size = texture.size;
+        array.levels = texture.levelCount;
+        table.arrays.push_back(array);
+    }
+
+    TextureArray& array = table.arrays[arrayIdx];
+    table.textureSlots[textureIdx] = (arrayIdx << 24) | array.layerCount;
+    array.layerCount++;
+}
+
+static u32 GetTextureSlot(const MaterialTable& table, u32 textureIdx)
+{
+    return textureIdx < table.textureSlots.size() ? table.textureSlots[textureIdx] : MATERIAL_TEXTURE_NONE;
+}
+
+// Copies the resident levels of the texture into its layer, and records in its slot the first
+// of them relative to the base level of the array
+static void CopyTextureToLayer(MaterialTable& table, const std::vector<Texture>& textures, u32 textureIdx)
+{
+    const Texture& texture = textures[textureIdx];
+    u32& slot = table.textureSlots[textureIdx];
+    const TextureArray& array = table.arrays[slot >> 24];
+    const u32 layer = slot & 0xFFFF;
+
+    for (u32 level = texture.residentLevel; level < array.levels; ++level)
+    {
+        glm::ivec2 size = glm::max(array.size >> (i32)level, glm::ivec2(1, 1));
+        glCopyImageSubData(texture.handle, GL_TEXTURE_2D, level - texture.residentLevel, 0, 0, 0,
+                           array.handle, GL_TEXTURE_2D_ARRAY, level - array.baseLevel, 0, 0, layer,
+                           size.x, size.y, 1);
+    }
+
+    slot = (slot & 0xFF00FFFF) | ((texture.residentLevel - array.baseLevel) << 16);
+}
+
+// Finest level resident in any of the layers, the array doesn't store the ones above it
+static u32 GetArrayBaseLevel(const MaterialTable& table, const std::vector<Texture>& textures, u32 arrayIdx)
+{
+    u32 baseLevel = table.arrays[arrayIdx].levels - 1;
+    for (u32 textureIdx = 0; textureIdx < (u32)textures.size(); ++textureIdx)
+    {
+        u32 slot = table.textureSlots[textureIdx];
+        if (slot != MATERIAL_TEXTURE_NONE && slot >> 24 == arrayIdx)
+            baseLevel = glm::min(baseLevel, textures[textureIdx].residentLevel);
+    }
+    return baseLevel;
+}
+
+// New storage for the array from its current base level, with every layer copied in again
+static void AllocateTextureArray(MaterialTable& table, const std::vector<Texture>& textures, u32 arrayIdx)
+{
+    TRACE_FUNCTION();
+
+    TextureArray& array = table.arrays[arrayIdx];
+    glDeleteTextures(1, &array.handle);
+    table.bytes -= array.bytes;
+
+    array.baseLevel = GetArrayBaseLevel(table, textures, arrayIdx);
+    glm::ivec2 baseSize = glm::max(array.size >> (i32)array.baseLevel, glm::ivec2(1, 1));
+    array.bytes = GetTextureBytes(array.size, array.baseLevel, array.levels) * array.layerCount;
+    table.bytes += array.bytes;
+
+    glGenTextures(1, &array.handle);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.handle);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels - array.baseLevel, array.format, baseSize.x, baseSize.y, array.layerCount);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // The loaded textures already have their mips, so the copies stay on the GPU
+    for (u32 textureIdx = 0; textureIdx < (u32)textures.size(); ++textureIdx)
+    {
+        u32 slot = table.textureSlots[textureIdx];
+        if (slot != MATERIAL_TEXTURE_NONE && slot >> 24 == arrayIdx)
+            CopyTextureToLayer(table, textures, textureIdx);
+    }
+}
+
+static void UploadMaterials(MaterialTable& table, const std::vector<Material>& materials)
+{
+    std::vector<GpuMaterial> gpuMaterials(materials.size());
+    for (u32 i = 0; i < (u32)materials.size(); ++i)
+    {
+        const Material& material = materials[i];
+        GpuMaterial& gpuMaterial = gpuMaterials[i];
+        gpuMaterial.albedo = material.albedo;
+        gpuMaterial.smoothness = material.smoothness;
+        gpuMaterial.emissive = material.emissive;
+        gpuMaterial.albedoTexture = GetTextureSlot(table, material.textureIdx[MATERIAL_TEXTURE_ALBEDO]);
+        gpuMaterial.emissiveTexture = GetTextureSlot(table, material.textureIdx[MATERIAL_TEXTURE_EMISSIVE]);
+        gpuMaterial.specularTexture = GetTextureSlot(table, material.textureIdx[MATERIAL_TEXTURE_SPECULAR]);
+        gpuMaterial.normalsTexture = GetTextureSlot(table, material.textureIdx[MATERIAL_TEXTURE_NORMALS]);
+        gpuMaterial.bumpTexture = GetTextureSlot(table, material.textureIdx[MATERIAL_TEXTURE_BUMP]);
+    }
+
+    // Same size unless materials were added, then it's only an update
+    if (table.buffer.size == gpuMaterials.size() * sizeof(GpuMaterial))
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, table.buffer.handle);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, table.buffer.size, gpuMaterials.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    else
+    {
+        ResizeBuffer(table.buffer, gpuMaterials.size() * sizeof(GpuMaterial), GL_STATIC_DRAW, gpuMaterials.data());
+    }
+    table.materialCount = materials.size();
+}
+
+void InitMaterialTable(MaterialTable& table)
+{
+    table.buffer = CreateBuffer(0, GL_SHADER_STORAGE_BUFFER, GL_STATIC_DRAW);
+}
+
+void BuildMaterialTable(MaterialTable& table, const std::vector<Material>& materials, const std::vector<Texture>& textures)
+{
+    TRACE_FUNCTION();
+
+    for (const TextureArray& array : table.arrays)
+        glDeleteTextures(1, &array.handle);
+    table.arrays.clear();
+    table.textureSlots.assign(textures.size(), MATERIAL_TEXTURE_NONE);
+    table.bytes = 0;
+
+    GLint maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    maxLayers = glm::min(maxLayers, 0xFFFF);
+
+    // Layers are handed out first so every array is allocated once with its final size
+    for (const Material& material : materials)
+    {
+        for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+            AssignTextureLayer(table, textures, material.textureIdx[slot], maxLayers);
+    }
+
+    table.residentTextures = 0;
+    table.deferredTextures = 0;
+    table.deferredBytes = 0;
+    for (const Texture& texture : textures)
+    {
+        if (texture.handle)
+        {
+            table.residentTextures++;
+        }
+        else
+        {
+            table.deferredTextures++;
+            table.deferredBytes += GetTextureBytes(texture.size, 0, texture.levelCount);
+        }
+    }
+
+    for (u32 arrayIdx = 0; arrayIdx < (u32)table.arrays.size(); ++arrayIdx)
+        AllocateTextureArray(table, textures, arrayIdx);
+
+    UploadMaterials(table, materials);
+
+    ILOG("Material table: %u materials, %u texture arrays", table.materialCount, (u32)table.arrays.size());
+}
+
+void UpdateMaterialTableTexture(MaterialTable& table, const std::vector<Material>& materials, const std::vector<Texture>& textures, u32 textureIdx)
+{
+    TRACE_FUNCTION();
+
+    // Not in the table yet, the next build adds it
+    u32 slot = GetTextureSlot(table, textureIdx);
+    if (slot == MATERIAL_TEXTURE_NONE)
+        return;
+
+    u32 arrayIdx = slot >> 24;
+    if (GetArrayBaseLevel(table, textures, arrayIdx) != table.arrays[arrayIdx].baseLevel)
+        AllocateTextureArray(table, textures, arrayIdx);
+    else
+        CopyTextureToLayer(table, textures, textureIdx);
+
+    UploadMaterials(table, materials);
+}
+
+u32 GetMaterialTextureSlots(GLuint program)
+{
+    // The slot members follow each other in GpuMaterial, in the order of the slots
+    u32 slots = 0;
+    for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+    {
+        char name[128];
+        snprintf(name, sizeof(name), "uMaterials[0].%s", GpuMaterial::gpuFields[GpuMaterial::albedoTextureFieldIndex + slot].name);
+        if (glGetProgramResourceIndex(program, GL_BUFFER_VARIABLE, name) != GL_INVALID_INDEX)
+            slots |= 1 << slot;
+    }
+    return slots;
+}
+
+void BindMaterialTable(const MaterialTable& table)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_TABLE_BINDING, table.buffer.handle);
+
+    for (u32 i = 0; i < (u32)table.arrays.size(); ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + MATERIAL_TEXTURE_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, table.arrays[i].handle);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
@@ -0,0 +1,89 @@
+//
+// material_table.h: The materials of every loaded model in one storage buffer, with the textures
+// they use copied into the layers of texture arrays, one array per format and size. A shader
+// finds the textures of any material from its index, so draws with different materials don't
+// rebind textures in between.
+//
+
+#pragma once
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <glad/glad.h>
+
+#define MATERIAL_TABLE_BINDING      4  // Storage block binding of the materials
+#define MATERIAL_TEXTURE_UNIT       8  // First unit of the arrays, the ones below are left to the passes
+#define MATERIAL_MAX_TEXTURE_ARRAYS 8  // Size of the uMaterialTextures array in the shaders
+#define MATERIAL_TEXTURE_NONE       0xFFFFFFFFu
+
+// Texture slots hold the array in the high 8 bits, then the first resident level of the layer
+// relative to the base level of the array, and the layer in the low 16 bits
+#define GPU_MATERIAL_FIELDS(FIELD)                             \
+    FIELD(glm::vec3, albedo,          "albedo")                \
+    FIELD(f32,       smoothness,      "smoothness")            \
+    FIELD(glm::vec3, emissive,        "emissive")              \
+    FIELD(u32,       albedoTexture,   "albedoTexture")         \
+    FIELD(u32,       emissiveTexture, "emissiveTexture")       \
+    FIELD(u32,       specularTexture, "specularTexture")       \
+    FIELD(u32,       normalsTexture,  "normalsTexture")        \
+    FIELD(u32,       bumpTexture,     "bumpTexture")
+GPU_STRUCT(GpuMaterial, GPU_STD430, GPU_MATERIAL_FIELDS)
+
+struct TextureArray
+{
+    GLuint     handle;
+    GLenum     format;    // Sized internal format of the textures copied in
+    glm::ivec2 size;      // Of the full chain of the textures, level 0 of the files
+    u32        levels;    // Of the full chain
+    u32        baseLevel; // Finest level resident in any layer, the first level stored
+    u32        layerCount;
+    u64        bytes;
+};
+
+struct MaterialTable
+{
+    Buffer                    buffer;        // GpuMaterial of every material
+    std::vector<TextureArray> arrays;
+    std::vector<u32>          textureSlots;  // Slot of every texture, MATERIAL_TEXTURE_NONE if no material uses it
+    u32                       materialCount; // Materials in the table, it's rebuilt when more are loaded
+    u64                       bytes;         // Memory taken by the arrays
+    u32                       residentTextures;
+    u32                       deferredTextures; // Registered but never sampled, so never loaded
+    u64                       deferredBytes;    // What they would take with their mips
+};
+
+struct Material;
+struct Texture;
+
+/**
+ * Creates the storage buffer, empty until the first build.
+ */
+void InitMaterialTable(MaterialTable& table);
+
+/**
+ * Copies the textures of the materials into the arrays, mips included, and uploads the
+ * materials. Everything built before is replaced, so call it only when materials or resident
+ * textures are added.
+ */
+void BuildMaterialTable(MaterialTable& table, const std::vector<Material>& materials, const std::vector<Texture>& textures);
+
+/**
+ * Copies the levels the texture has resident now into its layer, and uploads the materials
+ * with the level they start at. Only the array of the texture is allocated again, and only
+ * when its finest resident level changed.
+ */
+void UpdateMaterialTableTexture(MaterialTable& table, const std::vector<Material>& materials, const std::vector<Texture>& textures, u32 textureIdx);
+
+/**
+ * Slot bits of the textures the program reads from the materials, found from the active
+ * members of its MaterialBuffer block. Shaders must read the members they use one by one,
+ * copying a whole Material lets the driver report every slot as used.
+ */
+u32 GetMaterialTextureSlots(GLuint program);
+
+/**
+ * Binds the materials and the arrays to the bindings and units the shaders declare.
+ */
+void BindMaterialTable(const MaterialTable& table);
+
+#endif // MATERIAL_TABLE_H
@@ -0,0 +1,582 @@
+#include "Global.h"
+#include <algorithm>
+
+struct Quadric
+{
+    // Symmetric 4x4 matrix (A b; b c) plus the accumulated weight
+    f64 a00, a11, a22, a01, a02, a12;
+    f64 b0, b1, b2;
+    f64 c;
+    f64 w;
+};
+
+struct Collapse
+{
+    f32 cost;
+    u32 src;
+    u32 dst;
+};
+
+static glm::vec3 GetPosition(const f32* positions, u32 stride, u32 index)
+{
+    const f32* p = (const f32*)((const u8*)positions + (u64)index * stride);
+    return glm::vec3(p[0], p[1], p[2]);
+}
+
+static void QuadricAdd(Quadric& q, const Quadric& r)
+{
+    q.a00 += r.a00; q.a11 += r.a11; q.a22 += r.a22;
+    q.a01 += r.a01; q.a02 += r.a02; q.a12 += r.a12;
+    q.b0  += r.b0;  q.b1  += r.b1;  q.b2  += r.b2;
+    q.c   += r.c;
+    q.w   += r.w;
+}
+
+static Quadric QuadricFromTriangle(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2)
+{
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    f32 area = glm::length(n);
+    if (area > 0.0f) n /= area;
+
+    f64 d = -glm::dot(n, p0);
+    f64 w = area * 0.5;
+
+    Quadric q = {};
+    q.a00 = w * n.x * n.x; q.a11 = w * n.y * n.y; q.a22 = w * n.z * n.z;
+    q.a01 = w * n.x * n.y; q.a02 = w * n.x * n.z; q.a12 = w * n.y * n.z;
+    q.b0  = w * n.x * d;   q.b1  = w * n.y * d;   q.b2  = w * n.z * d;
+    q.c   = w * d * d;
+    q.w   = w;
+    return q;
+}
+
+// Returns the weighted squared distance from p to the planes accumulated in q
+static f64 QuadricError(const Quadric& q, const glm::vec3& p)
+{
+    f64 ax = q.a00 * p.x + q.a01 * p.y + q.a02 * p.z;
+    f64 ay = q.a01 * p.x + q.a11 * p.y + q.a12 * p.z;
+    f64 az = q.a02 * p.x + q.a12 * p.y + q.a22 * p.z;
+
+    // p^T A p + 2 b.p + c
+    f64 r = ax * p.x + ay * p.y + az * p.z + 2.0 * (q.b0 * p.x + q.b1 * p.y + q.b2 * p.z) + q.c;
+
+    f64 e = q.w > 0.0 ? r / q.w : 0.0;
+    return e < 0.0 ? 0.0 : e;
+}
+
+// Maps every vertex to the first vertex that shares its exact position
+static void BuildPositionRemap(std::vector<u32>& remap, const f32* positions, u32 vertexCount, u32 stride)
+{
+    std::vector<u32> order(vertexCount);
+    for (u32 i = 0; i < vertexCount; ++i) order[i] = i;
+
+    auto less = [&](u32 a, u32 b) {
+        glm::vec3 pa = GetPosition(positions, stride, a);
+        glm::vec3 pb = GetPosition(positions, stride, b);
+        if (pa.x != pb.x) return pa.x < pb.x;
+        if (pa.y != pb.y) return pa.y < pb.y;
+        if (pa.z != pb.z) return pa.z < pb.z;
+        return a < b;
+    };
+    std::sort(order.begin(), order.end(), less);
+
+    remap.resize(vertexCount);
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        if (i > 0 && GetPosition(positions, stride, order[i]) == GetPosition(positions, stride, order[i - 1]))
+            remap[order[i]] = remap[order[i - 1]];
+        else
+            remap[order[i]] = order[i];
+    }
+}
+
+u32 SimplifyMesh(u32* destination, const u32* indices, u32 indexCount,
+                 const f32* vertexPositions, u32 vertexCount, u32 vertexStride,
+                 u32 targetIndexCount, f32 targetError, f32* resultError)
+{
+    ASSERT(indexCount % 3 == 0, "Only triangle lists can be simplified");
+
+    if (destination != indices)
+        memcpy(destination, indices, indexCount * sizeof(u32));
+
+    if (resultError) *resultError = 0.0f;
+    if (indexCount <= targetIndexCount || vertexCount == 0)
+        return indexCount;
+
+    // Mesh extent, used to make the error relative
+    glm::vec3 minPos = GetPosition(vertexPositions, vertexStride, 0);
+    glm::vec3 maxPos = minPos;
+    for (u32 i = 1; i < vertexCount; ++i)
+    {
+        glm::vec3 p = GetPosition(vertexPositions, vertexStride, i);
+        minPos = glm::min(minPos, p);
+        maxPos = glm::max(maxPos, p);
+    }
+    glm::vec3 size = maxPos - minPos;
+    f32 extent = glm::max(size.x, glm::max(size.y, size.z));
+    if (extent <= 0.0f) return indexCount;
+
+    const f64 maxCost = (f64)(targetError * extent) * (f64)(targetError * extent);
+
+    // Seam vertices (several vertices at the same position) are locked
+    std::vector<u32> positionRemap;
+    BuildPositionRemap(positionRemap, vertexPositions, vertexCount, vertexStride);
+
+    std::vector<u8> locked(vertexCount, 0);
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        if (positionRemap[i] != i)
+        {
+            locked[i] = 1;
+            locked[positionRemap[i]] = 1;
+        }
+    }
+
+    // Border vertices (edges without an opposite edge) are locked too
+    {
+        std::vector<u64> edges;
+        edges.reserve(indexCount);
+        for (u32 i = 0; i < indexCount; i += 3)
+        {
+            for (u32 e = 0; e < 3; ++e)
+            {
+                u64 a = positionRemap[indices[i + e]];
+                u64 b = positionRemap[indices[i + (e + 1) % 3]];
+                edges.push_back((a << 32) | b);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+
+        for (u64 edge : edges)
+        {
+            u64 a = edge >> 32;
+            u64 b = edge & 0xffffffffull;
+            if (!std::binary_search(edges.begin(), edges.end(), (b << 32) | a))
+            {
+                locked[a] = 1;
+                locked[b] = 1;
+            }
+        }
+
+        for (u32 i = 0; i < vertexCount; ++i)
+            if (locked[positionRemap[i]]) locked[i] = 1;
+    }
+
+    // Per vertex quadrics
+    std::vector<Quadric> quadrics(vertexCount, Quadric{});
+    for (u32 i = 0; i < indexCount; i += 3)
+    {
+        u32 i0 = indices[i + 0], i1 = indices[i + 1], i2 = indices[i + 2];
+        Quadric q = QuadricFromTriangle(GetPosition(vertexPositions, vertexStride, i0),
+                                        GetPosition(vertexPositions, vertexStride, i1),
+                                        GetPosition(vertexPositions, vertexStride, i2));
+        QuadricAdd(quadrics[i0], q);
+        QuadricAdd(quadrics[i1], q);
+        QuadricAdd(quadrics[i2], q);
+    }
+
+    std::vector<u32> remap(vertexCount);
+    std::vector<u8> touched(vertexCount);
+    std::vector<u32> adjacencyOffsets(vertexCount + 1);
+    std::vector<u32> adjacency;
+    std::vector<Collapse> collapses;
+
+    f64 worstCost = 0.0;
+
+    while (indexCount > targetIndexCount)
+    {
+        // Vertex -> triangle adjacency for the current index list
+        std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+        for (u32 i = 0; i < indexCount; ++i) adjacencyOffsets[destination[i] + 1]++;
+        for (u32 i = 0; i < vertexCount; ++i) adjacencyOffsets[i + 1] += adjacencyOffsets[i];
+        adjacency.resize(indexCount);
+        {
+            std::vector<u32> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+            for (u32 i = 0; i < indexCount; ++i) adjacency[fill[destination[i]]++] = i / 3;
+        }
+
+        // Candidate collapses sorted by cost
+        collapses.clear();
+        for (u32 i = 0; i < indexCount; i += 3)
+        {
+            for (u32 e = 0; e < 3; ++e)
+            {
+                u32 a = destination[i + e];
+                u32 b = destination[i + (e + 1) % 3];
+                for (u32 dir = 0; dir < 2; ++dir)
+                {
+                    u32 src = dir ? b : a;
+                    u32 dst = dir ? a : b;
+                    if (locked[src]) continue;
+
+                    Quadric q = quadrics[src];
+                    QuadricAdd(q, quadrics[dst]);
+                    f64 cost = QuadricError(q, GetPosition(vertexPositions, vertexStride, dst));
+                    collapses.push_back(Collapse{ (f32)cost, src, dst });
+                }
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+        for (u32 i = 0; i < vertexCount; ++i) remap[i] = i;
+        std::fill(touched.begin(), touched.end(), 0);
+
+        u32 removedIndices = 0;
+        u32 collapseCount = 0;
+
+        for (const Collapse& c : collapses)
+        {
+            if (indexCount - removedIndices <= targetIndexCount) break;
+            if (c.cost > maxCost) break;
+            if (touched[c.src] || touched[c.dst]) continue;
+
+            // Reject collapses that would flip any of the remaining triangles
+            glm::vec3 target = GetPosition(vertexPositions, vertexStride, c.dst);
+            bool flips = false;
+            u32 sharedTriangles = 0;
+            for (u32 k = adjacencyOffsets[c.src]; k < adjacencyOffsets[c.src + 1] && !flips; ++k)
+            {
+                const u32* tri = &destination[adjacency[k] * 3];
+                if (tri[0] == c.dst || tri[1] == c.dst || tri[2] == c.dst)
+                {
+                    sharedTriangles++;
+                    continue;
+                }
+
+                glm::vec3 p[3], q[3];
+                for (u32 v = 0; v < 3; ++v)
+                {
+                    p[v] = GetPosition(vertexPositions, vertexStride, tri[v]);
+                    q[v] = tri[v] == c.src ? target : p[v];
+                }
+                glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+                flips = glm::dot(n0, n1) <= 1e-2f * glm::length(n0) * glm::length(n1);
+            }
+            if (flips) continue;
+
+            remap[c.src] = c.dst;
+            QuadricAdd(quadrics[c.dst], quadrics[c.src]);
+
+            // Keep the neighbourhood stable for the rest of this pass
+            for (u32 k = adjacencyOffsets[c.src]; k < adjacencyOffsets[c.src + 1]; ++k)
+            {
+                const u32* tri = &destination[adjacency[k] * 3];
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+
+            removedIndices += sharedTriangles * 3;
+            collapseCount++;
+            worstCost = glm::max(worstCost, (f64)c.cost);
+        }
+
+        if (collapseCount == 0) break;
+
+        // Apply the collapses and drop degenerate triangles
+        u32 writeIndex = 0;
+        for (u32 i = 0; i < indexCount; i += 3)
+        {
+            u32 i0 = remap[destination[i + 0]];
+            u32 i1 = remap[destination[i + 1]];
+            u32 i2 = remap[destination[i + 2]];
+            if (i0 == i1 || i1 == i2 || i2 == i0) continue;
+
+            destination[writeIndex++] = i0;
+            destination[writeIndex++] = i1;
+            destination[writeIndex++] = i2;
+        }
+        indexCount = writeIndex;
+    }
+
+    if (resultError) *resultError = (f32)(sqrt(worstCost) / extent);
+    return indexCount;
+}
+
+VertexCacheStatistics AnalyzeVertexCache(const u32* indices, u32 indexCount, u32 vertexCount, u32 cacheSize)
+{
+    VertexCacheStatistics stats = {};
+
+    // A vertex is in the FIFO if it was pushed less than cacheSize misses ago
+    std::vector<u32> timestamps(vertexCount, 0);
+    u32 time = cacheSize + 1;
+
+    for (u32 i = 0; i < indexCount; ++i)
+    {
+        u32 index = indices[i];
+        if (time - timestamps[index] > cacheSize)
+        {
+            timestamps[index] = time++;
+            stats.verticesTransformed++;
+        }
+    }
+
+    stats.acmr = indexCount ? (f32)stats.verticesTransformed / (indexCount / 3) : 0.0f;
+    stats.atvr = vertexCount ? (f32)stats.verticesTransformed / vertexCount : 0.0f;
+    return stats;
+}
+
+#define FORSYTH_CACHE_SIZE     32
+#define FORSYTH_CACHE_DECAY    1.5f
+#define FORSYTH_LAST_TRI_SCORE 0.75f
+#define FORSYTH_VALENCE_SCALE  2.0f
+#define FORSYTH_VALENCE_POWER  0.5f
+
+static f32 ForsythVertexScore(i32 cachePosition, u32 remainingValence)
+{
+    if (remainingValence == 0)
+        return -1.0f;
+
+    f32 score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+        {
+            // The vertices of the last triangle get a fixed score so that they don't win
+            // over the ones a bit further in the cache (that would favour strips)
+            score = FORSYTH_LAST_TRI_SCORE;
+        }
+        else
+        {
+            f32 scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+            score = powf(1.0f - (cachePosition - 3) * scaler, FORSYTH_CACHE_DECAY);
+        }
+    }
+
+    // Boost the vertices with few triangles left so they are finished soon
+    score += FORSYTH_VALENCE_SCALE * powf((f32)remainingValence, -FORSYTH_VALENCE_POWER);
+    return score;
+}
+
+void OptimizeVertexCache(u32* destination, const u32* indices, u32 indexCount, u32 vertexCount)
+{
+    ASSERT(indexCount % 3 == 0, "Only triangle lists can be optimized");
+
+    const u32 triangleCount = indexCount / 3;
+    if (triangleCount == 0) return;
+
+    // Keep a copy, destination may alias indices
+    std::vector<u32> source(indices, indices + indexCount);
+
+    // Vertex -> triangle adjacency
+    std::vector<u32> valence(vertexCount, 0);
+    for (u32 i = 0; i < indexCount; ++i) valence[source[i]]++;
+
+    std::vector<u32> adjacencyOffsets(vertexCount + 1, 0);
+    for (u32 i = 0; i < vertexCount; ++i) adjacencyOffsets[i + 1] = adjacencyOffsets[i] + valence[i];
+
+    std::vector<u32> adjacency(indexCount);
+    {
+        std::vector<u32> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for (u32 i = 0; i < indexCount; ++i) adjacency[fill[source[i]]++] = i / 3;
+    }
+
+    std::vector<i32> cachePosition(vertexCount, -1);
+    std::vector<f32> vertexScore(vertexCount);
+    for (u32 i = 0; i < vertexCount; ++i) vertexScore[i] = ForsythVertexScore(-1, valence[i]);
+
+    std::vector<f32> triangleScore(triangleCount);
+    std::vector<u8> emitted(triangleCount, 0);
+    for (u32 t = 0; t < triangleCount; ++t)
+        triangleScore[t] = vertexScore[source[t * 3 + 0]] + vertexScore[source[t * 3 + 1]] + vertexScore[source[t * 3 + 2]];
+
+    u32 cache[FORSYTH_CACHE_SIZE + 3];
+    u32 cacheCount = 0;
+
+    u32 nextLinearTriangle = 0;
+    u32 outputIndex = 0;
+
+    i32 bestTriangle = 0;
+    for (u32 t = 1; t < triangleCount; ++t)
+        if (triangleScore[t] > triangleScore[bestTriangle]) bestTriangle = t;
+
+    while (bestTriangle >= 0)
+    {
+        const u32* tri = &source[bestTriangle * 3];
+        emitted[bestTriangle] = 1;
+        destination[outputIndex++] = tri[0];
+        destination[outputIndex++] = tri[1];
+        destination[outputIndex++] = tri[2];
+
+        // Remove the triangle from the adjacency of its vertices
+        for (u32 v = 0; v < 3; ++v)
+        {
+            u32 vertex = tri[v];
+            u32 begin = adjacencyOffsets[vertex];
+            u32 end = begin + valence[vertex];
+            for (u32 k = begin; k < end; ++k)
+            {
+                if (adjacency[k] == (u32)bestTriangle)
+                {
+                    adjacency[k] = adjacency[end - 1];
+                    break;
+                }
+            }
+            valence[vertex]--;
+        }
+
+        // Push the triangle vertices to the front of the LRU cache
+        u32 newCache[FORSYTH_CACHE_SIZE + 3];
+        u32 newCacheCount = 0;
+        for (u32 v = 0; v < 3; ++v) newCache[newCacheCount++] = tri[v];
+        for (u32 c = 0; c < cacheCount; ++c)
+        {
+            u32 vertex = cache[c];
+            if (vertex != tri[0] && vertex != tri[1] && vertex != tri[2])
+                newCache[newCacheCount++] = vertex;
+        }
+
+        // Update the scores of the vertices in the cache (including the ones pushed out)
+        // and of their remaining triangles, looking for the next best one
+        bestTriangle = -1;
+        f32 bestScore = -1.0f;
+        for (u32 c = 0; c < newCacheCount; ++c)
+        {
+            u32 vertex = newCache[c];
+            cachePosition[vertex] = c < FORSYTH_CACHE_SIZE ? (i32)c : -1;
+            f32 score = ForsythVertexScore(cachePosition[vertex], valence[vertex]);
+            f32 delta = score - vertexScore[vertex];
+            vertexScore[vertex] = score;
+
+            u32 begin = adjacencyOffsets[vertex];
+            u32 end = begin + valence[vertex];
+            for (u32 k = begin; k < end; ++k)
+            {
+                u32 t = adjacency[k];
+                triangleScore[t] += delta;
+                if (triangleScore[t] > bestScore)
+                {
+                    bestScore = triangleScore[t];
+                    bestTriangle = t;
+                }
+            }
+        }
+
+        cacheCount = glm::min(newCacheCount, (u32)FORSYTH_CACHE_SIZE);
+        memcpy(cache, newCache, cacheCount * sizeof(u32));
+
+        // Nothing adjacent to the cache, restart from the first triangle not emitted yet
+        if (bestTriangle < 0)
+        {
+            while (nextLinearTriangle < triangleCount && emitted[nextLinearTriangle]) nextLinearTriangle++;
+            if (nextLinearTriangle < triangleCount) bestTriangle = nextLinearTriangle;
+        }
+    }
+
+    ASSERT(outputIndex == indexCount, "Every triangle must be emitted once");
+}
+
+#define OVERDRAW_CACHE_SIZE       16
+#define OVERDRAW_MIN_CLUSTER_SIZE 32 // In triangles
+
+struct TriangleCluster
+{
+    u32 firstTriangle;
+    u32 triangleCount;
+    f32 sortKey;
+};
+
+void OptimizeOverdraw(u32* destination, const u32* indices, u32 indexCount,
+                      const f32* vertexPositions, u32 vertexCount, u32 vertexStride)
+{
+    ASSERT(destination != indices, "In-place overdraw optimization is not supported");
+
+    const u32 triangleCount = indexCount / 3;
+    if (triangleCount == 0) return;
+
+    // Split the list where the simulated cache starts from scratch (all three vertices miss),
+    // so that reordering the clusters barely affects the vertex cache efficiency
+    std::vector<TriangleCluster> clusters;
+    {
+        std::vector<u32> timestamps(vertexCount, 0);
+        u32 time = OVERDRAW_CACHE_SIZE + 1;
+
+        TriangleCluster cluster = {};
+        for (u32 t = 0; t < triangleCount; ++t)
+        {
+            u32 misses = 0;
+            for (u32 v = 0; v < 3; ++v)
+            {
+                u32 index = indices[t * 3 + v];
+                if (time - timestamps[index] > OVERDRAW_CACHE_SIZE)
+                {
+                    timestamps[index] = time++;
+                    misses++;
+                }
+            }
+
+            if (misses == 3 && cluster.triangleCount >= OVERDRAW_MIN_CLUSTER_SIZE)
+            {
+                clusters.push_back(cluster);
+                cluster.firstTriangle = t;
+                cluster.triangleCount = 0;
+            }
+            cluster.triangleCount++;
+        }
+        clusters.push_back(cluster);
+    }
+
+    // Mesh centroid
+    glm::vec3 meshCentroid = glm::vec3(0.0f);
+    f32 meshArea = 0.0f;
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        glm::vec3 p0 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 0]);
+        glm::vec3 p1 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 1]);
+        glm::vec3 p2 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 2]);
+        f32 area = glm::length(glm::cross(p1 - p0, p2 - p0));
+        meshCentroid += (p0 + p1 + p2) * (area / 3.0f);
+        meshArea += area;
+    }
+    if (meshArea > 0.0f) meshCentroid /= meshArea;
+
+    // Clusters facing away from the mesh centre are likely to occlude the rest
+    for (TriangleCluster& cluster : clusters)
+    {
+        glm::vec3 centroid = glm::vec3(0.0f);
+        glm::vec3 normal = glm::vec3(0.0f);
+        f32 area = 0.0f;
+        for (u32 t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.triangleCount; ++t)
+        {
+            glm::vec3 p0 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 0]);
+            glm::vec3 p1 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 1]);
+            glm::vec3 p2 = GetPosition(vertexPositions, vertexStride, indices[t * 3 + 2]);
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            f32 a = glm::length(n);
+            centroid += (p0 + p1 + p2) * (a / 3.0f);
+            normal += n;
+            area += a;
+        }
+        if (area > 0.0f) centroid /= area;
+        f32 normalLength = glm::length(normal);
+        if (normalLength > 0.0f) normal /= normalLength;
+
+        cluster.sortKey = glm::dot(centroid - meshCentroid, normal);
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(),
+                     [](const TriangleCluster& a, const TriangleCluster& b) { return a.sortKey > b.sortKey; });
+
+    u32 outputIndex = 0;
+    for (const TriangleCluster& cluster : clusters)
+    {
+        memcpy(destination + outputIndex, indices + cluster.firstTriangle * 3, cluster.triangleCount * 3 * sizeof(u32));
+        outputIndex += cluster.triangleCount * 3;
+    }
+}
+
+void OptimizeVertexFetchRemap(u32* remap, const u32* indices, u32 indexCount, u32 vertexCount)
+{
+    for (u32 i = 0; i < vertexCount; ++i) remap[i] = UINT32_MAX;
+
+    u32 nextVertex = 0;
+    for (u32 i = 0; i < indexCount; ++i)
+    {
+        u32 index = indices[i];
+        if (remap[index] == UINT32_MAX)
+            remap[index] = nextVertex++;
+    }
+
+    for (u32 i = 0; i < vertexCount; ++i)
+        if (remap[i] == UINT32_MAX)
+            remap[i] = nextVertex++;
+}
@@ -0,0 +1,61 @@
+//
+// mesh_processing.h: Import-time processing of triangle lists (simplification, etc.).
+// These functions only work on raw index/position arrays so they can be used by any
+// loader without depending on the engine types.
+//
+
+#pragma once
+#ifndef MESH_PROCESSING_H
+#define MESH_PROCESSING_H
+
+/**
+ * Simplifies a triangle list using quadric error metric half-edge collapses. Vertices
+ * are never moved or created, so the resulting indices can be used with the very same
+ * vertex buffer. Border vertices and vertices on attribute seams (same position, different
+ * attributes) are kept locked to avoid cracks.
+ *
+ * destination must have room for indexCount indices (it can be the same array as indices).
+ * vertexPositions points to the first vertex position and vertexStride is in bytes.
+ * targetError is relative to the mesh extent (0.01 means 1% of the mesh size).
+ * Returns the number of indices written to destination; resultError (if not NULL) receives
+ * the relative error of the simplified mesh.
+ */
+u32 SimplifyMesh(u32* destination, const u32* indices, u32 indexCount,
+                 const f32* vertexPositions, u32 vertexCount, u32 vertexStride,
+                 u32 targetIndexCount, f32 targetError, f32* resultError);
+
+struct VertexCacheStatistics
+{
+    u32 verticesTransformed;
+    f32 acmr; // Average cache miss ratio: transformed vertices per triangle (0.5 is the ideal)
+    f32 atvr; // Average transformed vertex ratio: transformed vertices per vertex (1.0 is the ideal)
+};
+
+/**
+ * Simulates a FIFO post-transform vertex cache of cacheSize entries to measure how
+ * many times each vertex would be transformed when drawing the triangle list.
+ */
+VertexCacheStatistics AnalyzeVertexCache(const u32* indices, u32 indexCount, u32 vertexCount, u32 cacheSize);
+
+/**
+ * Reorders the triangles to improve post-transform vertex cache hits (Tom Forsyth's
+ * linear-speed vertex cache optimization). destination can be the same array as indices.
+ */
+void OptimizeVertexCache(u32* destination, const u32* indices, u32 indexCount, u32 vertexCount);
+
+/**
+ * Reorders the clusters of a cache optimized triangle list so that the outer facing ones are
+ * drawn first, which reduces overdraw. Clusters are split at cache flushes so the vertex cache
+ * efficiency is mostly preserved. destination can't be the same array as indices.
+ */
+void OptimizeOverdraw(u32* destination, const u32* indices, u32 indexCount,
+                      const f32* vertexPositions, u32 vertexCount, u32 vertexStride);
+
+/**
+ * Builds a vertex remap table that puts the vertices in the order in which they are first
+ * referenced by the indices, improving the vertex fetch locality. remap must have room for
+ * vertexCount entries; unreferenced vertices are moved to the end.
+ */
+void OptimizeVertexFetchRemap(u32* remap, const u32* indices, u32 indexCount, u32 vertexCount);
+
+#endif // MESH_PROCESSING_H
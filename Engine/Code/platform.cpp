@@ -13,23 +13,68 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
 
 #include "Global.h"
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 
 #define WINDOW_TITLE  "HiveMind Engine"//"Advanced Graphics Programming"
 #define WINDOW_WIDTH  800
 #define WINDOW_HEIGHT 600
 
-#define GLOBAL_FRAME_ARENA_SIZE MB(16)
-u8* GlobalFrameArenaMemory = NULL;
-u32 GlobalFrameArenaHead = 0;
+#define TRACE_FILE "trace.json"
+
+#define FRAME_ARENA_RESERVE   GB(1ull)
+#define SCRATCH_ARENA_RESERVE GB(4ull)
+#define ARENA_COMMIT_SIZE     KB(64)
+
+Arena*              GlobalArenaList = NULL;
+std::mutex          GlobalArenaListMutex;
+std::atomic<u64>    GlobalFrameIndex(0);
+std::atomic<u32>    GlobalThreadCount(0);
+
+#define JOB_DEQUE_SIZE   4096 // Power of 2
+#define JOB_POOL_SIZE    4096 // Jobs in flight per thread
+#define JOB_SPIN_COUNT   64   // Failed attempts to find a job before sleeping
+
+// Chase-Lev work-stealing deque. Only its thread pushes and pops at the bottom, the
+// other threads steal from the top.
+struct JobDeque
+{
+    std::atomic<i64>  top;
+    std::atomic<i64>  bottom;
+    std::atomic<Job*> jobs[JOB_DEQUE_SIZE];
+};
+
+struct JobThread
+{
+    JobDeque    deque;
+    Job         pool[JOB_POOL_SIZE]; // Ring buffer, jobs are expected to finish before it wraps
+    u32         poolHead;
+    u32         randomState;         // To pick the victims to steal from
+    std::thread thread;
+};
+
+JobThread*              GlobalJobThreads = NULL;
+u32                     GlobalJobThreadCount = 0;
+std::atomic<bool>       GlobalJobSystemRunning(false);
+std::atomic<i32>        GlobalPendingJobs(0);
+std::mutex              GlobalJobMutex;
+std::condition_variable GlobalJobCondition;
+thread_local u32        GlobalJobThreadIndex = UINT32_MAX;
 
 void OnGlfwError(int errorCode, const char *errorMessage)
 {
@@ -114,8 +159,16 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    // --trace records the CPU markers from the start and writes them when closing
+    bool traceStartup = false;
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], "--trace") == 0)
+            traceStartup = true;
+
+    SetTraceEnabled(traceStartup);
+
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
     app.displaySize = ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
@@ -197,14 +250,20 @@ int main()
 
     f64 lastFrameTime = glfwGetTime();
 
-    GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
+    InitJobSystem();
 
     Init(&app);
 
     while (app.isRunning)
     {
+        TRACE_SCOPE("Frame");
+        BeginGlStatsFrame();
+
         // Tell GLFW to call platform callbacks
-        glfwPollEvents();
+        {
+            TRACE_SCOPE("PollEvents");
+            glfwPollEvents();
+        }
 
         // ImGui
         ImGui_ImplOpenGL3_NewFrame();
@@ -225,6 +284,10 @@ int main()
         // Update
         Update(&app);
 
+        // Save the CPU trace
+        if (app.input.keys[K_T] == BUTTON_PRESS)
+            WriteChromeTrace(TRACE_FILE);
+
         // Transition input key/button states
         if (!ImGui::GetIO().WantCaptureKeyboard)
             for (u32 i = 0; i < KEY_COUNT; ++i)
@@ -242,27 +305,38 @@ int main()
         Render(&app);
 
         // ImGui Render
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-        if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
-            GLFWwindow* backup_current_context = glfwGetCurrentContext();
-            ImGui::UpdatePlatformWindows();
-            ImGui::RenderPlatformWindowsDefault();
-            glfwMakeContextCurrent(backup_current_context);
+        {
+            TRACE_SCOPE("ImGuiRender");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
+                GLFWwindow* backup_current_context = glfwGetCurrentContext();
+                ImGui::UpdatePlatformWindows();
+                ImGui::RenderPlatformWindowsDefault();
+                glfwMakeContextCurrent(backup_current_context);
+            }
         }
 
         // Present image on screen
-        glfwSwapBuffers(window);
+        {
+            TRACE_SCOPE("SwapBuffers");
+            glfwSwapBuffers(window);
+        }
 
         // Frame time
         f64 currentFrameTime = glfwGetTime();
         app.deltaTime = (f32)(currentFrameTime - lastFrameTime);
         lastFrameTime = currentFrameTime;
 
-        // Reset frame allocator
-        GlobalFrameArenaHead = 0;
+        // Reset frame allocators
+        NextFrameArenas();
     }
 
-    free(GlobalFrameArenaMemory);
+    if (traceStartup)
+        WriteChromeTrace(TRACE_FILE);
+
+    Shutdown(&app);
+
+    ShutdownJobSystem();
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -281,39 +355,476 @@ u32 Strlen(const char* string)
     return len;
 }
 
-void* PushSize(u32 byteCount)
+u64 GetPageSize()
 {
-    ASSERT(GlobalFrameArenaHead + byteCount <= GLOBAL_FRAME_ARENA_SIZE,
-           "Trying to allocate more temp memory than available");
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (u64)sysconf(_SC_PAGESIZE);
+#endif
+}
 
-    u8* curPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
-    GlobalFrameArenaHead += byteCount;
-    return curPtr;
+u64 AlignUp(u64 value, u64 alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
 }
 
-void* PushBytes(const void* bytes, u32 byteCount)
+void ArenaInit(Arena* arena, const char* name, u64 reserveSize, u32 flags)
+{
+    *arena = {};
+    strncpy(arena->name, name, sizeof(arena->name) - 1);
+    arena->flags = flags;
+
+#ifdef _WIN32
+    if (flags & ARENA_LARGE_PAGES)
+    {
+        // Large pages can't be committed lazily, the whole range is committed at once
+        u64 largePageSize = GetLargePageMinimum();
+        if (largePageSize > 0)
+        {
+            u64 size = AlignUp(reserveSize, largePageSize);
+            arena->base = (u8*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (arena->base)
+            {
+                arena->reserved = size;
+                arena->committed = size;
+            }
+        }
+
+        if (!arena->base)
+        {
+            ELOG("Arena %s: large pages not available (SeLockMemoryPrivilege?), using regular pages", arena->name);
+            arena->flags &= ~ARENA_LARGE_PAGES;
+        }
+    }
+
+    if (!arena->base)
+    {
+        arena->reserved = AlignUp(reserveSize, GetPageSize());
+        arena->base = (u8*)VirtualAlloc(NULL, arena->reserved, MEM_RESERVE, PAGE_NOACCESS);
+    }
+#else
+    arena->reserved = AlignUp(reserveSize, GetPageSize());
+    arena->base = (u8*)mmap(NULL, arena->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->base == (u8*)MAP_FAILED)
+        arena->base = NULL;
+
+#ifdef MADV_HUGEPAGE
+    // Transparent huge pages, the kernel uses them where it can as pages get committed
+    if (arena->base && (flags & ARENA_LARGE_PAGES))
+        madvise(arena->base, arena->reserved, MADV_HUGEPAGE);
+#endif
+#endif
+
+    ASSERT(arena->base, "Could not reserve the arena address space");
+
+    std::lock_guard<std::mutex> lock(GlobalArenaListMutex);
+    arena->next = GlobalArenaList;
+    GlobalArenaList = arena;
+}
+
+void ArenaRelease(Arena* arena)
 {
-    ASSERT(GlobalFrameArenaHead + byteCount <= GLOBAL_FRAME_ARENA_SIZE,
-            "Trying to allocate more temp memory than available");
+    {
+        std::lock_guard<std::mutex> lock(GlobalArenaListMutex);
+        Arena** link = &GlobalArenaList;
+        while (*link && *link != arena)
+            link = &(*link)->next;
+        if (*link)
+            *link = arena->next;
+    }
+
+#ifdef _WIN32
+    VirtualFree(arena->base, 0, MEM_RELEASE);
+#else
+    munmap(arena->base, arena->reserved);
+#endif
+
+    *arena = {};
+}
 
-    u8* srcPtr = (u8*)bytes;
-    u8* curPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
-    u8* dstPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
-    GlobalFrameArenaHead += byteCount;
-    while (byteCount--) *dstPtr++ = *srcPtr++;
-    return curPtr;
+void ArenaReset(Arena* arena)
+{
+    // Committed pages are kept, the next frames will most likely need them again
+    arena->head = 0;
+}
+
+void* ArenaPush(Arena* arena, u64 byteCount, u64 alignment)
+{
+    u64 start = AlignUp(arena->head, alignment);
+
+    // No caller can carry on without the memory, so these stop the program in release too
+    if (start > arena->reserved || byteCount > arena->reserved - start)
+    {
+        ELOG("Arena %s: allocating %llu bytes past the %llu reserved", arena->name, (unsigned long long)byteCount, (unsigned long long)arena->reserved);
+        abort();
+    }
+    u64 end = start + byteCount;
+
+    if (end > arena->committed)
+    {
+        u64 commitEnd = AlignUp(end, ARENA_COMMIT_SIZE);
+        if (commitEnd > arena->reserved)
+            commitEnd = arena->reserved;
+
+#ifdef _WIN32
+        bool success = VirtualAlloc(arena->base + arena->committed, commitEnd - arena->committed, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+        bool success = mprotect(arena->base + arena->committed, commitEnd - arena->committed, PROT_READ | PROT_WRITE) == 0;
+#endif
+        if (!success)
+        {
+            ELOG("Arena %s: could not commit %llu bytes", arena->name, (unsigned long long)(commitEnd - arena->committed));
+            abort();
+        }
+        arena->committed = commitEnd;
+    }
+
+    arena->head = end;
+    if (arena->head > arena->highWaterMark)
+        arena->highWaterMark = arena->head;
+
+    return arena->base + start;
+}
+
+void* ArenaPushZero(Arena* arena, u64 byteCount, u64 alignment)
+{
+    void* ptr = ArenaPush(arena, byteCount, alignment);
+    memset(ptr, 0, byteCount);
+    return ptr;
+}
+
+void* ArenaPushBytes(Arena* arena, const void* bytes, u64 byteCount, u64 alignment)
+{
+    void* ptr = ArenaPush(arena, byteCount, alignment);
+    memcpy(ptr, bytes, byteCount);
+    return ptr;
+}
+
+TempArena BeginTempArena(Arena* arena)
+{
+    TempArena temp = {};
+    temp.arena = arena;
+    temp.head = arena->head;
+    return temp;
+}
+
+void EndTempArena(TempArena temp)
+{
+    ASSERT(temp.arena->head >= temp.head, "Temp arenas must be ended in reverse order");
+    temp.arena->head = temp.head;
+}
+
+// The arenas of a thread are created the first time it asks for them and released when it finishes
+struct ThreadArenas
+{
+    Arena frame;
+    Arena scratch;
+    u64   frameIndex;
+
+    ThreadArenas()
+    {
+        char name[32];
+        u32 threadIndex = GlobalThreadCount++;
+        sprintf(name, "Frame (thread %u)", threadIndex);
+        ArenaInit(&frame, name, FRAME_ARENA_RESERVE);
+        sprintf(name, "Scratch (thread %u)", threadIndex);
+        ArenaInit(&scratch, name, SCRATCH_ARENA_RESERVE);
+        frameIndex = GlobalFrameIndex.load(std::memory_order_relaxed);
+    }
+
+    ~ThreadArenas()
+    {
+        ArenaRelease(&scratch);
+        ArenaRelease(&frame);
+    }
+};
+
+thread_local ThreadArenas GlobalThreadArenas;
+
+Arena* GetFrameArena()
+{
+    ThreadArenas& arenas = GlobalThreadArenas;
+    u64 frameIndex = GlobalFrameIndex.load(std::memory_order_relaxed);
+    if (arenas.frameIndex != frameIndex)
+    {
+        ArenaReset(&arenas.frame);
+        arenas.frameIndex = frameIndex;
+    }
+    return &arenas.frame;
+}
+
+Arena* GetScratchArena()
+{
+    return &GlobalThreadArenas.scratch;
+}
+
+void NextFrameArenas()
+{
+    GlobalFrameIndex++;
+}
+
+u32 GetArenaStats(ArenaStats* stats, u32 maxCount)
+{
+    std::lock_guard<std::mutex> lock(GlobalArenaListMutex);
+
+    u32 count = 0;
+    for (Arena* arena = GlobalArenaList; arena; arena = arena->next, ++count)
+    {
+        if (count < maxCount)
+        {
+            memcpy(stats[count].name, arena->name, sizeof(stats[count].name));
+            stats[count].used = arena->head;
+            stats[count].committed = arena->committed;
+            stats[count].reserved = arena->reserved;
+            stats[count].highWaterMark = arena->highWaterMark;
+        }
+    }
+    return count;
+}
+
+void* PushSize(u32 byteCount)
+{
+    return ArenaPush(GetFrameArena(), byteCount, 1);
+}
+
+void* PushBytes(const void* bytes, u32 byteCount)
+{
+    return ArenaPushBytes(GetFrameArena(), bytes, byteCount);
 }
 
 u8* PushChar(u8 c)
 {
-    ASSERT(GlobalFrameArenaHead + 1 <= GLOBAL_FRAME_ARENA_SIZE,
-            "Trying to allocate more temp memory than available");
-    u8* ptr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
-    GlobalFrameArenaHead++;
+    u8* ptr = (u8*)ArenaPush(GetFrameArena(), 1, 1);
     *ptr = c;
     return ptr;
 }
 
+void PushJob(JobDeque& deque, Job* job)
+{
+    i64 bottom = deque.bottom.load(std::memory_order_relaxed);
+    i64 top = deque.top.load(std::memory_order_acquire);
+    ASSERT(bottom - top < JOB_DEQUE_SIZE, "Job deque overflow");
+
+    deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+    deque.bottom.store(bottom + 1, std::memory_order_release);
+}
+
+Job* PopJob(JobDeque& deque)
+{
+    i64 bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+    deque.bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 top = deque.top.load(std::memory_order_relaxed);
+
+    if (top > bottom)
+    {
+        // Empty
+        deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    Job* job = deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (top == bottom)
+    {
+        // Last job, race against the thieves for it
+        if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            job = NULL;
+        deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return job;
+}
+
+Job* StealJob(JobDeque& deque)
+{
+    i64 top = deque.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 bottom = deque.bottom.load(std::memory_order_acquire);
+
+    if (top >= bottom)
+        return NULL;
+
+    Job* job = deque.jobs[top & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return NULL;
+    return job;
+}
+
+Job* FindJob(u32 threadIndex)
+{
+    JobThread& jobThread = GlobalJobThreads[threadIndex];
+
+    Job* job = PopJob(jobThread.deque);
+    if (!job && GlobalJobThreadCount > 1)
+    {
+        // xorshift
+        u32 x = jobThread.randomState;
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        jobThread.randomState = x;
+
+        u32 first = x % GlobalJobThreadCount;
+        for (u32 i = 0; i < GlobalJobThreadCount && !job; ++i)
+        {
+            u32 victim = (first + i) % GlobalJobThreadCount;
+            if (victim != threadIndex)
+                job = StealJob(GlobalJobThreads[victim].deque);
+        }
+    }
+
+    if (job)
+        GlobalPendingJobs.fetch_sub(1, std::memory_order_relaxed);
+    return job;
+}
+
+void ExecuteJob(Job* job)
+{
+    TRACE_SCOPE("Job");
+    job->function(job->data, job->begin, job->end);
+    if (job->counter)
+        job->counter->value.fetch_sub(1, std::memory_order_release);
+}
+
+void JobWorkerMain(u32 threadIndex)
+{
+    GlobalJobThreadIndex = threadIndex;
+
+    u32 failedAttempts = 0;
+    while (GlobalJobSystemRunning.load(std::memory_order_relaxed))
+    {
+        Job* job = FindJob(threadIndex);
+        if (job)
+        {
+            ExecuteJob(job);
+            failedAttempts = 0;
+        }
+        else if (++failedAttempts < JOB_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            // The timeout covers the wake ups lost between the check and the wait
+            std::unique_lock<std::mutex> lock(GlobalJobMutex);
+            GlobalJobCondition.wait_for(lock, std::chrono::milliseconds(1), [] {
+                return GlobalPendingJobs.load(std::memory_order_relaxed) > 0 || !GlobalJobSystemRunning.load(std::memory_order_relaxed); });
+            failedAttempts = 0;
+        }
+    }
+}
+
+void InitJobSystem(u32 workerCount)
+{
+    if (workerCount == 0)
+    {
+        u32 coreCount = std::thread::hardware_concurrency();
+        workerCount = coreCount > 1 ? coreCount - 1 : 1;
+    }
+
+    GlobalJobThreadCount = glm::min(workerCount + 1, (u32)MAX_JOB_THREADS);
+    GlobalJobThreads = new JobThread[GlobalJobThreadCount];
+    for (u32 i = 0; i < GlobalJobThreadCount; ++i)
+    {
+        GlobalJobThreads[i].deque.top = 0;
+        GlobalJobThreads[i].deque.bottom = 0;
+        GlobalJobThreads[i].poolHead = 0;
+        GlobalJobThreads[i].randomState = 0x9E3779B9u * (i + 1);
+    }
+
+    GlobalJobThreadIndex = 0;
+    GlobalJobSystemRunning = true;
+    for (u32 i = 1; i < GlobalJobThreadCount; ++i)
+        GlobalJobThreads[i].thread = std::thread(JobWorkerMain, i);
+
+    ILOG("Job system: %u threads", GlobalJobThreadCount);
+}
+
+void ShutdownJobSystem()
+{
+    GlobalJobSystemRunning = false;
+    GlobalJobCondition.notify_all();
+
+    for (u32 i = 1; i < GlobalJobThreadCount; ++i)
+        GlobalJobThreads[i].thread.join();
+
+    delete[] GlobalJobThreads;
+    GlobalJobThreads = NULL;
+    GlobalJobThreadCount = 0;
+}
+
+u32 GetJobThreadCount()
+{
+    return GlobalJobThreadCount;
+}
+
+u32 GetJobThreadIndex()
+{
+    return GlobalJobThreadIndex;
+}
+
+void RunJobs(const Job* jobs, u32 count, JobCounter* counter)
+{
+    ASSERT(GlobalJobThreadIndex < GlobalJobThreadCount, "Jobs can only be run from threads of the job system");
+    JobThread& jobThread = GlobalJobThreads[GlobalJobThreadIndex];
+
+    if (counter)
+        counter->value.fetch_add(count, std::memory_order_relaxed);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        Job* job = &jobThread.pool[jobThread.poolHead++ % JOB_POOL_SIZE];
+        *job = jobs[i];
+        job->counter = counter;
+        PushJob(jobThread.deque, job);
+    }
+
+    GlobalPendingJobs.fetch_add(count, std::memory_order_relaxed);
+    if (count > 1)
+        GlobalJobCondition.notify_all();
+    else
+        GlobalJobCondition.notify_one();
+}
+
+void WaitForCounter(JobCounter* counter)
+{
+    while (counter->value.load(std::memory_order_acquire) > 0)
+    {
+        Job* job = FindJob(GlobalJobThreadIndex);
+        if (job)
+            ExecuteJob(job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void ParallelFor(u32 count, u32 batchSize, JobFunction* function, void* data)
+{
+    if (count == 0)
+        return;
+
+    // Not worth the trip through the deques
+    if (count <= batchSize || GlobalJobThreadCount <= 1)
+    {
+        function(data, 0, count);
+        return;
+    }
+
+    JobCounter counter = {};
+    u32 batchCount = (count + batchSize - 1) / batchSize;
+    Job* jobs = ArenaPushArray(GetFrameArena(), Job, batchCount);
+    for (u32 i = 0; i < batchCount; ++i)
+    {
+        jobs[i].function = function;
+        jobs[i].data = data;
+        jobs[i].begin = i * batchSize;
+        jobs[i].end = glm::min(count, (i + 1) * batchSize);
+    }
+
+    RunJobs(jobs, batchCount, &counter);
+    WaitForCounter(&counter);
+}
+
 String MakeString(const char *cstr)
 {
     String str = {};
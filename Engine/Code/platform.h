@@ -14,6 +14,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
 #include <string>
+#include <atomic>
 
 #pragma warning(disable : 4267) // conversion from X to Y, possible loss of data
 
@@ -107,3 +108,150 @@ LogString(logBuffer);             \
 #define PI  3.14159265359f
 #define TAU 6.28318530718f
 
+
+/**
+ * Linear allocator over a range of reserved virtual memory. Only the address space is
+ * reserved up front, pages are committed as the head grows, so arenas can be given big
+ * reservations without wasting memory.
+ */
+struct Arena
+{
+    char   name[32];
+    u8*    base;
+    u64    reserved;      // Bytes of address space
+    u64    committed;     // Bytes backed by memory
+    u64    head;
+    u64    highWaterMark; // Max head ever reached
+    u32    flags;
+    Arena* next;          // All the live arenas are linked for the memory stats
+};
+
+enum ArenaFlags
+{
+    ARENA_DEFAULT     = 0,
+    ARENA_LARGE_PAGES = 1 << 0, // Falls back to regular pages if the system doesn't allow them
+};
+
+/**
+ * Saved head of an arena. Everything pushed after BeginTempArena is freed by EndTempArena.
+ */
+struct TempArena
+{
+    Arena* arena;
+    u64    head;
+};
+
+struct ArenaStats
+{
+    char name[32];
+    u64  used;
+    u64  committed;
+    u64  reserved;
+    u64  highWaterMark;
+};
+
+void ArenaInit(Arena* arena, const char* name, u64 reserveSize, u32 flags = ARENA_DEFAULT);
+
+void ArenaRelease(Arena* arena);
+
+void ArenaReset(Arena* arena);
+
+/**
+ * Never returns NULL. Running past the reservation or failing to commit the pages logs the
+ * error and aborts, in release builds too.
+ */
+void* ArenaPush(Arena* arena, u64 byteCount, u64 alignment = 8);
+
+void* ArenaPushZero(Arena* arena, u64 byteCount, u64 alignment = 8);
+
+void* ArenaPushBytes(Arena* arena, const void* bytes, u64 byteCount, u64 alignment = 1);
+
+#define ArenaPushArray(arena, type, count) ((type*)ArenaPush((arena), sizeof(type)*(count), alignof(type)))
+
+TempArena BeginTempArena(Arena* arena);
+
+void EndTempArena(TempArena temp);
+
+/**
+ * Every thread has its own frame arena, reset once per frame the first time it is used
+ * after NextFrameArenas(). Memory pushed there is valid until the end of the frame.
+ */
+Arena* GetFrameArena();
+
+/**
+ * Every thread also has a scratch arena for transient allocations that don't live for the
+ * whole frame (e.g. loaders). Use it between BeginTempArena and EndTempArena.
+ */
+Arena* GetScratchArena();
+
+void NextFrameArenas();
+
+/**
+ * Fills stats with the live arenas (up to maxCount) and returns how many there are.
+ */
+u32 GetArenaStats(ArenaStats* stats, u32 maxCount);
+
+/**
+ * Allocations in the frame arena of the calling thread.
+ */
+void* PushSize(u32 byteCount);
+
+void* PushBytes(const void* bytes, u32 byteCount);
+
+u8* PushChar(u8 c);
+
+#define MAX_JOB_THREADS 64
+
+/**
+ * Jobs run a function over the range [begin, end) of whatever data points to. Every job
+ * submitted with a counter increments it, and decrements it once finished.
+ */
+typedef void JobFunction(void* data, u32 begin, u32 end);
+
+struct JobCounter
+{
+    std::atomic<i32> value;
+};
+
+struct Job
+{
+    JobFunction* function;
+    void*        data;
+    u32          begin;
+    u32          end;
+    JobCounter*  counter;
+};
+
+/**
+ * Starts the worker threads (one per core besides the main thread when workerCount is 0).
+ * Every worker has its own work-stealing deque.
+ */
+void InitJobSystem(u32 workerCount = 0);
+
+void ShutdownJobSystem();
+
+/**
+ * Number of threads running jobs, including the main thread.
+ */
+u32 GetJobThreadCount();
+
+/**
+ * Index of the calling thread in the job system (0 is the main thread).
+ */
+u32 GetJobThreadIndex();
+
+/**
+ * Pushes the jobs to the deque of the calling thread, which must belong to the job system.
+ */
+void RunJobs(const Job* jobs, u32 count, JobCounter* counter);
+
+/**
+ * Waits until the counter gets to 0, running pending jobs in the meantime. Jobs can wait
+ * for the counters of the jobs they depend on.
+ */
+void WaitForCounter(JobCounter* counter);
+
+/**
+ * Splits [0, count) in batches of batchSize, runs them as jobs and waits for all of them.
+ */
+void ParallelFor(u32 count, u32 batchSize, JobFunction* function, void* data);
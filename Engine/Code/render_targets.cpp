@@ -0,0 +1,186 @@
+#include "Global.h"
+
+bool IsDepthFormat(GLenum format)
+{
+    return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F ||
+           format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+
+u64 GetRenderTargetBytes(const RenderTarget& target)
+{
+    u32 pixelSize = 4;
+    switch (target.format)
+    {
+        case GL_R8:                                                pixelSize = 1; break;
+        case GL_RG8: case GL_R16F: case GL_DEPTH_COMPONENT16:      pixelSize = 2; break;
+        case GL_RGBA16F: case GL_RG32F: case GL_DEPTH32F_STENCIL8: pixelSize = 8; break;
+        case GL_RGBA32F:                                           pixelSize = 16; break;
+        default: break;
+    }
+    return (u64)target.size.x * target.size.y * target.samples * pixelSize;
+}
+
+static RenderTarget CreateRenderTarget(GLenum format, glm::ivec2 size, u32 samples)
+{
+    RenderTarget target = {};
+    target.format = format;
+    target.size = size;
+    target.samples = samples;
+
+    glGenTextures(1, &target.handle);
+    if (samples > 1)
+    {
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, target.handle);
+        glTexStorage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, format, size.x, size.y, GL_TRUE);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+    }
+    else
+    {
+        const GLint filter = IsDepthFormat(format) ? GL_NEAREST : GL_LINEAR;
+        glBindTexture(GL_TEXTURE_2D, target.handle);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, size.x, size.y);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    return target;
+}
+
+static void DeleteRenderTarget(RenderTargetPool& pool, u32 index)
+{
+    GLuint handle = pool.targets[index].handle;
+
+    for (u32 i = 0; i < (u32)pool.framebuffers.size();)
+    {
+        const RenderTargetFramebuffer& framebuffer = pool.framebuffers[i];
+        bool attached = framebuffer.depth == handle;
+        for (u32 j = 0; j < framebuffer.colorCount; ++j)
+            attached |= framebuffer.colors[j] == handle;
+
+        if (attached)
+        {
+            glDeleteFramebuffers(1, &framebuffer.handle);
+            pool.framebuffers[i] = pool.framebuffers.back();
+            pool.framebuffers.pop_back();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    glDeleteTextures(1, &handle);
+    pool.targets[index] = pool.targets.back();
+    pool.targets.pop_back();
+}
+
+void UpdateRenderTargetPool(RenderTargetPool& pool, glm::ivec2 displaySize, f32 deltaTime)
+{
+    pool.frameIndex++;
+
+    // Minimized windows have no size, keep the last one
+    if (displaySize.x > 0 && displaySize.y > 0)
+    {
+        // Dragging the window border changes the size every frame, so wait until it settles
+        if (displaySize != pool.pendingSize)
+        {
+            pool.pendingSize = displaySize;
+            pool.resizeTimer = 0.0f;
+        }
+        else
+        {
+            pool.resizeTimer += deltaTime;
+        }
+
+        if (displaySize != pool.size && (pool.size == glm::ivec2(0, 0) || pool.resizeTimer >= RENDER_TARGET_RESIZE_DELAY))
+            pool.size = displaySize;
+    }
+
+    for (u32 i = 0; i < (u32)pool.targets.size();)
+    {
+        const RenderTarget& target = pool.targets[i];
+        if (!target.acquired && pool.frameIndex - target.lastUsedFrame > RENDER_TARGET_UNUSED_FRAMES)
+            DeleteRenderTarget(pool, i);
+        else
+            ++i;
+    }
+}
+
+GLuint AcquireRenderTarget(RenderTargetPool& pool, GLenum format, glm::ivec2 size, u32 samples)
+{
+    for (RenderTarget& target : pool.targets)
+    {
+        if (!target.acquired && target.format == format && target.size == size && target.samples == samples)
+        {
+            target.acquired = true;
+            target.lastUsedFrame = pool.frameIndex;
+            return target.handle;
+        }
+    }
+
+    RenderTarget target = CreateRenderTarget(format, size, samples);
+    target.acquired = true;
+    target.lastUsedFrame = pool.frameIndex;
+    pool.targets.push_back(target);
+    return target.handle;
+}
+
+void ReleaseRenderTarget(RenderTargetPool& pool, GLuint handle)
+{
+    for (RenderTarget& target : pool.targets)
+    {
+        if (target.handle == handle)
+        {
+            ASSERT(target.acquired, "Render target released twice");
+            target.acquired = false;
+            target.lastUsedFrame = pool.frameIndex;
+            return;
+        }
+    }
+    ASSERT(false, "Releasing a texture that doesn't belong to the pool");
+}
+
+GLuint GetRenderTargetFramebuffer(RenderTargetPool& pool, const GLuint* colors, u32 colorCount, GLuint depth)
+{
+    ASSERT(colorCount <= RENDER_TARGET_MAX_ATTACHMENTS, "Too many framebuffer attachments");
+
+    for (const RenderTargetFramebuffer& framebuffer : pool.framebuffers)
+    {
+        if (framebuffer.colorCount == colorCount && framebuffer.depth == depth &&
+            memcmp(framebuffer.colors, colors, colorCount * sizeof(GLuint)) == 0)
+            return framebuffer.handle;
+    }
+
+    RenderTargetFramebuffer framebuffer = {};
+    framebuffer.colorCount = colorCount;
+    framebuffer.depth = depth;
+    memcpy(framebuffer.colors, colors, colorCount * sizeof(GLuint));
+
+    GLenum drawBuffers[RENDER_TARGET_MAX_ATTACHMENTS];
+    glGenFramebuffers(1, &framebuffer.handle);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.handle);
+    for (u32 i = 0; i < colorCount; ++i)
+    {
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, colors[i], 0);
+        drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    if (depth)
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth, 0);
+
+    if (colorCount > 0)
+        glDrawBuffers(colorCount, drawBuffers);
+    else
+        glDrawBuffer(GL_NONE);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        ELOG("Render target framebuffer incomplete (status 0x%x)", status);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    pool.framebuffers.push_back(framebuffer);
+    return framebuffer.handle;
+}
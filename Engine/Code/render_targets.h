@@ -0,0 +1,75 @@
+//
+// render_targets.h: Pool of the textures rendered to, keyed by (format, size, samples). Passes
+// acquire their targets every frame and release them once the last pass reading them is done,
+// so a later pass asking for the same key reuses the same memory. The render size follows the
+// display size once it stops changing, and targets unused for a few frames are deleted.
+//
+
+#pragma once
+#ifndef RENDER_TARGETS_H
+#define RENDER_TARGETS_H
+
+#include <glad/glad.h>
+
+#define RENDER_TARGET_RESIZE_DELAY   0.2f // Seconds the display size must be stable before resizing
+#define RENDER_TARGET_UNUSED_FRAMES  3    // Frames a released target is kept before being deleted
+#define RENDER_TARGET_MAX_ATTACHMENTS 4
+
+struct RenderTarget
+{
+    GLuint     handle;
+    GLenum     format; // Sized internal format
+    glm::ivec2 size;
+    u32        samples;
+    bool       acquired;
+    u64        lastUsedFrame;
+};
+
+// Framebuffers are cached by their attachments, and deleted with them
+struct RenderTargetFramebuffer
+{
+    GLuint handle;
+    GLuint colors[RENDER_TARGET_MAX_ATTACHMENTS];
+    u32    colorCount;
+    GLuint depth;
+};
+
+struct RenderTargetPool
+{
+    std::vector<RenderTarget>            targets;
+    std::vector<RenderTargetFramebuffer> framebuffers;
+
+    glm::ivec2 size;        // Render size, the display size once stable
+    glm::ivec2 pendingSize; // Last display size seen
+    f32        resizeTimer;
+    u64        frameIndex;
+};
+
+/**
+ * Call once per frame, before acquiring the targets. Deletes the targets released for a few
+ * frames (the ones of the previous render size, for instance).
+ */
+void UpdateRenderTargetPool(RenderTargetPool& pool, glm::ivec2 displaySize, f32 deltaTime);
+
+/**
+ * Returns a texture not acquired by anyone else. Color targets are sampled with linear
+ * filtering and depth targets with nearest.
+ */
+GLuint AcquireRenderTarget(RenderTargetPool& pool, GLenum format, glm::ivec2 size, u32 samples = 1);
+
+/**
+ * The texture can be handed to the next pass acquiring the same key, so its contents must not
+ * be read after this.
+ */
+void ReleaseRenderTarget(RenderTargetPool& pool, GLuint handle);
+
+/**
+ * Framebuffer with these attachments (depth can be 0), created the first time it's asked for.
+ */
+GLuint GetRenderTargetFramebuffer(RenderTargetPool& pool, const GLuint* colors, u32 colorCount, GLuint depth);
+
+u64 GetRenderTargetBytes(const RenderTarget& target);
+
+bool IsDepthFormat(GLenum format);
+
+#endif // RENDER_TARGETS_H
@@ -0,0 +1,236 @@
+#include "Global.h"
+
+static void GetEntityBoundingSphere(const App* app, const Entity& entity, glm::vec3& center, f32& radius)
+{
+    const Mesh& mesh = app->meshes[entity.modelIndex];
+    const glm::mat4& world = app->transforms.worldMatrices[entity.transformIndex];
+    f32 scale = glm::max(glm::length(glm::vec3(world[0])), glm::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+    center = glm::vec3(world * glm::vec4(mesh.boundsCenter, 1.0f));
+    radius = mesh.boundsRadius * scale;
+}
+
+// Directional lights reach the whole scene, point lights stop at SHADOW_POINT_RANGE
+static bool IsInLightReach(const Light& light, const glm::vec3& center, f32 radius)
+{
+    if (light.type != LightType::POINT_LIGHT)
+        return true;
+    return glm::length(center - light.position) - radius < SHADOW_POINT_RANGE;
+}
+
+static glm::vec4 GetTileRect(u32 view)
+{
+    const u32 tilesPerRow = SHADOW_ATLAS_SIZE / SHADOW_TILE_SIZE;
+    const f32 tileScale = (f32)SHADOW_TILE_SIZE / SHADOW_ATLAS_SIZE;
+    return glm::vec4((view % tilesPerRow) * tileScale, (view / tilesPerRow) * tileScale, tileScale, tileScale);
+}
+
+// Views of the light for its tiles, the directional ones are fit around the scene bounds
+static void SetLightViews(ShadowAtlas& atlas, const ShadowLight& shadow, const Light& light, const glm::vec3& sceneCenter, f32 sceneRadius)
+{
+    if (light.type == LightType::POINT_LIGHT)
+    {
+        static const glm::vec3 faceDirections[SHADOW_CUBE_FACES] = { {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1} };
+        static const glm::vec3 faceUps[SHADOW_CUBE_FACES] = { {0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0} };
+
+        glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_POINT_NEAR, SHADOW_POINT_RANGE);
+        for (u32 face = 0; face < SHADOW_CUBE_FACES; ++face)
+        {
+            glm::mat4 view = glm::lookAt(light.position, light.position + faceDirections[face], faceUps[face]);
+            atlas.views[shadow.firstView + face].viewProjection = projection * view;
+        }
+    }
+    else
+    {
+        // The direction points towards the light
+        glm::vec3 direction = glm::normalize(light.direction);
+        glm::vec3 up = glm::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::mat4 view = glm::lookAt(sceneCenter + direction * sceneRadius, sceneCenter, up);
+        glm::mat4 projection = glm::ortho(-sceneRadius, sceneRadius, -sceneRadius, sceneRadius, 0.0f, 2.0f * sceneRadius);
+        atlas.views[shadow.firstView].viewProjection = projection * view;
+    }
+
+    for (u32 view = shadow.firstView; view < shadow.firstView + shadow.viewCount; ++view)
+        atlas.views[view].atlasRect = GetTileRect(view);
+}
+
+void InitShadowAtlas(ShadowAtlas& atlas)
+{
+    atlas.enabled = true;
+
+    glGenTextures(1, &atlas.texture);
+    glBindTexture(GL_TEXTURE_2D, atlas.texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // Filtered comparisons, so the lookups get 2x2 PCF for free
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    atlas.viewBuffer = CreateBuffer(SHADOW_MAX_VIEWS * sizeof(ShadowView), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+}
+
+void UpdateShadowAtlas(App* app)
+{
+    TRACE_FUNCTION();
+
+    ShadowAtlas& atlas = app->shadowAtlas;
+    atlas.frameIndex++;
+    atlas.pendingLights.clear();
+    atlas.renderedViews = 0;
+    atlas.cachedViews = 0;
+    atlas.drawnSubmeshes = 0;
+    atlas.culledSubmeshes = 0;
+
+    // Tiles are handed out in the order of the lights while they last. A light whose tiles,
+    // type or placement changed is rendered again.
+    atlas.lights.resize(app->lights.size());
+    atlas.usedViews = 0;
+    for (u32 i = 0; i < (u32)app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        ShadowLight& shadow = atlas.lights[i];
+
+        u32 viewCount = light.type == LightType::POINT_LIGHT ? SHADOW_CUBE_FACES : 1;
+        u32 firstView = SHADOW_NONE;
+        if (atlas.enabled && light.castsShadows && i < MAX_LIGHTS && atlas.usedViews + viewCount <= SHADOW_MAX_VIEWS)
+        {
+            firstView = atlas.usedViews;
+            atlas.usedViews += viewCount;
+        }
+
+        if (firstView != shadow.firstView)
+            shadow.rendered = false;
+        if (!shadow.rendered || light.type != shadow.type || light.direction != shadow.direction || light.position != shadow.position)
+            shadow.valid = false;
+
+        shadow.firstView = firstView;
+        shadow.viewCount = viewCount;
+    }
+
+    // Entities that moved invalidate the lights they are in the reach of, or were when the
+    // light was rendered. The scene bounds are what the directional lights cover.
+    glm::vec3 sceneMin = glm::vec3(FLT_MAX);
+    glm::vec3 sceneMax = glm::vec3(-FLT_MAX);
+    for (u32 entityIdx = 0; entityIdx < (u32)app->entities.size(); ++entityIdx)
+    {
+        const Entity& entity = app->entities[entityIdx];
+        glm::vec3 center;
+        f32 radius;
+        GetEntityBoundingSphere(app, entity, center, radius);
+        sceneMin = glm::min(sceneMin, center - glm::vec3(radius));
+        sceneMax = glm::max(sceneMax, center + glm::vec3(radius));
+
+        if (!IsShadowCaster(app, entityIdx) || !IsTransformChanged(app->transforms, entity.transformIndex))
+            continue;
+
+        for (u32 i = 0; i < (u32)atlas.lights.size(); ++i)
+        {
+            ShadowLight& shadow = atlas.lights[i];
+            bool wasCaster = entityIdx < shadow.casters.size() && shadow.casters[entityIdx];
+            if (shadow.valid && (wasCaster || IsInLightReach(app->lights[i], center, radius)))
+                shadow.valid = false;
+        }
+    }
+
+    // Nothing draws the tiles outside of the deferred passes
+    if (!atlas.enabled || app->mode != DEFERRED || app->entities.empty())
+        return;
+
+    glm::vec3 sceneCenter = 0.5f * (sceneMin + sceneMax);
+    f32 sceneRadius = glm::max(0.5f * glm::length(sceneMax - sceneMin), 1.0f);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, atlas.viewBuffer.handle);
+    for (u32 i = 0; i < (u32)atlas.lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        ShadowLight& shadow = atlas.lights[i];
+        if (shadow.firstView == SHADOW_NONE)
+            continue;
+
+        // Dynamic lights are spread over the interval so they don't all render the same frame
+        bool due = !shadow.valid || (!light.isStatic && (atlas.frameIndex + i) % SHADOW_DYNAMIC_INTERVAL == 0);
+        if (!due)
+        {
+            atlas.cachedViews += shadow.viewCount;
+            continue;
+        }
+
+        SetLightViews(atlas, shadow, light, sceneCenter, sceneRadius);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, shadow.firstView * sizeof(ShadowView), shadow.viewCount * sizeof(ShadowView), &atlas.views[shadow.firstView]);
+
+        shadow.casters.resize(app->entities.size());
+        for (u32 entityIdx = 0; entityIdx < (u32)app->entities.size(); ++entityIdx)
+        {
+            glm::vec3 center;
+            f32 radius;
+            GetEntityBoundingSphere(app, app->entities[entityIdx], center, radius);
+            shadow.casters[entityIdx] = IsShadowCaster(app, entityIdx) && IsInLightReach(light, center, radius);
+        }
+
+        shadow.valid = true;
+        shadow.rendered = true;
+        shadow.type = light.type;
+        shadow.direction = light.direction;
+        shadow.position = light.position;
+
+        atlas.pendingLights.push_back(i);
+        atlas.renderedViews += shadow.viewCount;
+        if (light.isStatic)
+            atlas.staticRenders++;
+        else
+            atlas.dynamicRenders++;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+i32 GetLightShadowView(const ShadowAtlas& atlas, u32 lightIdx)
+{
+    if (!atlas.enabled || lightIdx >= atlas.lights.size())
+        return -1;
+
+    const ShadowLight& shadow = atlas.lights[lightIdx];
+    return shadow.firstView != SHADOW_NONE && shadow.rendered ? (i32)shadow.firstView : -1;
+}
+
+bool IsShadowCaster(const App* app, u32 entityIdx)
+{
+    return entityIdx != app->waterPlane;
+}
+
+void BindShadowAtlas(const ShadowAtlas& atlas)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SHADOW_VIEWS_BINDING, atlas.viewBuffer.handle);
+
+    glActiveTexture(GL_TEXTURE0 + SHADOW_ATLAS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, atlas.texture);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void GetFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    // Rows of the matrix, glm stores columns
+    glm::vec4 rows[4];
+    for (u32 i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+    planes[0] = rows[3] + rows[0];
+    planes[1] = rows[3] - rows[0];
+    planes[2] = rows[3] + rows[1];
+    planes[3] = rows[3] - rows[1];
+    planes[4] = rows[3] + rows[2];
+    planes[5] = rows[3] - rows[2];
+}
+
+bool IsBoxInFrustum(const glm::vec4 planes[6], const glm::vec3& center, const glm::vec3& extents)
+{
+    for (u32 i = 0; i < 6; ++i)
+    {
+        glm::vec3 normal = glm::vec3(planes[i]);
+        if (glm::dot(normal, center) + planes[i].w + glm::dot(glm::abs(normal), extents) < 0.0f)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+//
+// shadow_atlas.h: Shadow maps of every light in tiles of one depth texture. Static lights keep
+// what was rendered until a light changes or an entity within its reach moves. Dynamic lights
+// are rendered again every few frames, spread over the frames. A directional light has one
+// tile covering the scene and a point light has one per cube face.
+//
+
+#pragma once
+#ifndef SHADOW_ATLAS_H
+#define SHADOW_ATLAS_H
+
+#include <glad/glad.h>
+
+#define SHADOW_ATLAS_SIZE        4096
+#define SHADOW_TILE_SIZE         1024
+#define SHADOW_MAX_VIEWS         16    // Tiles in the atlas
+#define SHADOW_VIEWS_BINDING     5     // Storage block binding of the views
+#define SHADOW_ATLAS_UNIT        1     // Texture unit the lighting samples the atlas from
+#define SHADOW_DYNAMIC_INTERVAL  4     // Frames between two renders of a dynamic light
+#define SHADOW_POINT_RANGE       25.0f // Past this the attenuation of the point lights is negligible
+#define SHADOW_POINT_NEAR        0.05f
+#define SHADOW_NONE              UINT32_MAX
+
+// Point lights take SHADOW_CUBE_FACES views in a row, in the +X, -X, +Y, -Y, +Z, -Z order
+#define SHADOW_CUBE_FACES        6
+
+#define SHADOW_VIEW_FIELDS(FIELD)                          \
+    FIELD(glm::mat4, viewProjection, "viewProjection")     \
+    FIELD(glm::vec4, atlasRect,      "atlasRect")
+GPU_STRUCT(ShadowView, GPU_STD430, SHADOW_VIEW_FIELDS)
+
+struct ShadowLight
+{
+    u32               firstView; // SHADOW_NONE when the light has no room in the atlas
+    u32               viewCount;
+    bool              valid;     // Rendered, and nothing in its reach moved since
+    bool              rendered;  // At least once, so the tiles can be sampled
+    u32               type;      // Light as it was rendered
+    glm::vec3         direction;
+    glm::vec3         position;
+    std::vector<bool> casters;   // Entities within reach when it was rendered
+};
+
+struct ShadowAtlas
+{
+    bool   enabled;
+    GLuint texture;    // Depth, compared when sampled
+    Buffer viewBuffer; // ShadowView of every tile
+
+    ShadowView               views[SHADOW_MAX_VIEWS];
+    std::vector<ShadowLight> lights;             // One per light of the scene
+    std::vector<u32>         pendingLights;      // To render this frame
+    u32                      usedViews;
+    u64                      frameIndex;
+
+    // Stats of the last frame, for the GUI
+    u32 renderedViews;
+    u32 cachedViews;
+    u32 drawnSubmeshes;
+    u32 culledSubmeshes;
+    u32 staticRenders; // Totals since the start
+    u32 dynamicRenders;
+};
+
+struct App;
+
+void InitShadowAtlas(ShadowAtlas& atlas);
+
+/**
+ * Call once per frame, once the transforms are updated. Finds the lights whose tiles must be
+ * rendered again this frame, listed in pendingLights, and uploads their views.
+ */
+void UpdateShadowAtlas(App* app);
+
+/**
+ * First view of the light for the shaders, -1 if it has no shadow to sample.
+ */
+i32 GetLightShadowView(const ShadowAtlas& atlas, u32 lightIdx);
+
+/**
+ * Whether the entity is drawn into the shadow maps. The water only receives them.
+ */
+bool IsShadowCaster(const App* app, u32 entityIdx);
+
+/**
+ * Binds the views and the atlas to the binding and unit the shaders declare.
+ */
+void BindShadowAtlas(const ShadowAtlas& atlas);
+
+/**
+ * Planes of the frustum of a view projection, pointing inwards.
+ */
+void GetFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
+bool IsBoxInFrustum(const glm::vec4 planes[6], const glm::vec3& center, const glm::vec3& extents);
+
+#endif // SHADOW_ATLAS_H
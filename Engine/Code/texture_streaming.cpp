@@ -0,0 +1,248 @@
+#include "Global.h"
+
+u32 GetMipLevelCount(glm::ivec2 size)
+{
+    u32 levels = 1;
+    for (i32 largest = glm::max(size.x, size.y); largest > 1; largest /= 2)
+        levels++;
+    return levels;
+}
+
+u64 GetTextureBytes(glm::ivec2 size, u32 firstLevel, u32 levelCount)
+{
+    // Three channel formats are padded to four by the drivers
+    u64 bytes = 0;
+    for (u32 level = firstLevel; level < levelCount; ++level)
+    {
+        glm::ivec2 levelSize = glm::max(size >> (i32)level, glm::ivec2(1, 1));
+        bytes += (u64)levelSize.x * levelSize.y * 4;
+    }
+    return bytes;
+}
+
+static u64 GetResidentBytes(const Texture& texture)
+{
+    return GetTextureBytes(texture.size, texture.residentLevel, texture.levelCount);
+}
+
+// Level whose largest side is TEXTURE_STREAMING_MIN_SIZE, the textures keep at least that
+static u32 GetCoarsestStreamingLevel(const Texture& texture)
+{
+    u32 level = 0;
+    while (level + 1 < texture.levelCount && glm::max(texture.size.x, texture.size.y) >> level > TEXTURE_STREAMING_MIN_SIZE)
+        level++;
+    return level;
+}
+
+static bool IsStreamable(const Texture& texture)
+{
+    return texture.streamed && texture.handle;
+}
+
+// Replaces the texture with one starting at the given level of the full chain
+static bool SetTextureLevel(App* app, u32 textureIdx, u32 level)
+{
+    TRACE_FUNCTION();
+
+    Texture& texture = app->textures[textureIdx];
+
+    GLint format = 0;
+    glBindTexture(GL_TEXTURE_2D, texture.handle);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // The coarser levels are already in memory, the finer ones come from the file
+    GLuint source = texture.handle;
+    u32 sourceLevel = level - texture.residentLevel;
+    if (level < texture.residentLevel)
+    {
+        Image image = LoadImage(texture.filepath.c_str());
+        if (!image.pixels)
+            return false;
+
+        source = CreateTexture2DFromImage(image);
+        sourceLevel = level;
+        FreeImage(image);
+    }
+
+    glm::ivec2 size = glm::max(texture.size >> (i32)level, glm::ivec2(1, 1));
+    u32 levels = texture.levelCount - level;
+
+    GLuint handle = 0;
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexStorage2D(GL_TEXTURE_2D, levels, format, size.x, size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (u32 i = 0; i < levels; ++i)
+    {
+        glm::ivec2 levelSize = glm::max(size >> (i32)i, glm::ivec2(1, 1));
+        glCopyImageSubData(source, GL_TEXTURE_2D, sourceLevel + i, 0, 0, 0,
+                           handle, GL_TEXTURE_2D, i, 0, 0, 0,
+                           levelSize.x, levelSize.y, 1);
+    }
+
+    if (source != texture.handle)
+        glDeleteTextures(1, &source);
+    glDeleteTextures(1, &texture.handle);
+
+    TextureStreaming& streaming = app->textureStreaming;
+    streaming.residentBytes -= GetResidentBytes(texture);
+    texture.handle = handle;
+    texture.residentLevel = level;
+    streaming.residentBytes += GetResidentBytes(texture);
+
+    // Only the layer of this texture changes in the material table
+    UpdateMaterialTableTexture(app->materialTable, app->materials, app->textures, textureIdx);
+    return true;
+}
+
+// The textures are resident twice, on their own for the forward pass and in the layers of the
+// material table, and both count against the budget
+static u64 GetStreamingBytes(const App* app)
+{
+    return app->textureStreaming.residentBytes + app->materialTable.bytes;
+}
+
+// Drops a level of the texture needed the longest ago. Textures needed this frame are only
+// evicted if visibleToo, or if they have finer levels than needed.
+static bool EvictLeastRecentlyUsed(App* app, u32 keepIdx, bool visibleToo)
+{
+    TextureStreaming& streaming = app->textureStreaming;
+
+    u32 victimIdx = UINT32_MAX;
+    for (u32 i = 0; i < (u32)app->textures.size(); ++i)
+    {
+        const Texture& texture = app->textures[i];
+        if (i == keepIdx || !IsStreamable(texture) || texture.residentLevel >= GetCoarsestStreamingLevel(texture))
+            continue;
+
+        bool overResident = texture.residentLevel < texture.wantedLevel;
+        if (!visibleToo && !overResident && texture.lastUsedFrame == streaming.frameIndex)
+            continue;
+
+        if (victimIdx == UINT32_MAX)
+        {
+            victimIdx = i;
+            continue;
+        }
+
+        // Oldest first, then the one with more memory to give back
+        const Texture& victim = app->textures[victimIdx];
+        if (texture.lastUsedFrame < victim.lastUsedFrame ||
+            (texture.lastUsedFrame == victim.lastUsedFrame && GetResidentBytes(texture) > GetResidentBytes(victim)))
+            victimIdx = i;
+    }
+
+    if (victimIdx == UINT32_MAX)
+        return false;
+
+    if (!SetTextureLevel(app, victimIdx, app->textures[victimIdx].residentLevel + 1))
+        return false;
+
+    streaming.evicted++;
+    return true;
+}
+
+void InitTextureStreaming(TextureStreaming& streaming)
+{
+    streaming.enabled = true;
+    streaming.budgetMB = TEXTURE_STREAMING_DEFAULT_BUDGET;
+}
+
+void UpdateTextureStreaming(App* app)
+{
+    TRACE_FUNCTION();
+
+    TextureStreaming& streaming = app->textureStreaming;
+    streaming.frameIndex++;
+
+    streaming.residentBytes = 0;
+    for (Texture& texture : app->textures)
+    {
+        if (IsStreamable(texture))
+        {
+            texture.wantedLevel = GetCoarsestStreamingLevel(texture);
+            streaming.residentBytes += GetResidentBytes(texture);
+        }
+    }
+
+    if (!streaming.enabled)
+        return;
+
+    // A texture spread over the bounds of an entity needs one texel per pixel they cover
+    const f32 pixelsPerUnit = app->displaySize.y * 0.5f * app->camera.projection[1][1];
+    for (const Entity& entity : app->entities)
+    {
+        const Mesh& mesh = app->meshes[entity.modelIndex];
+        const glm::mat4& world = app->transforms.worldMatrices[entity.transformIndex];
+        f32 scale = glm::max(glm::length(glm::vec3(world[0])), glm::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+        glm::vec3 center = glm::vec3(world * glm::vec4(mesh.boundsCenter, 1.0f));
+        f32 distance = glm::max(glm::length(center - app->camera.cameraPos) - mesh.boundsRadius * scale, app->camera.zNear);
+        f32 projectedSize = glm::max(2.0f * mesh.boundsRadius * scale * pixelsPerUnit / distance, 1.0f);
+
+        for (u32 i : entity.submeshIndices)
+        {
+            const Material& material = app->materials[entity.materialIdx[i]];
+            for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+            {
+                u32 textureIdx = material.textureIdx[slot];
+                if (textureIdx == UINT32_MAX || !IsStreamable(app->textures[textureIdx]))
+                    continue;
+
+                Texture& texture = app->textures[textureIdx];
+                f32 texelsPerPixel = glm::max(texture.size.x, texture.size.y) / projectedSize;
+                u32 level = texelsPerPixel > 1.0f ? (u32)glm::log2(texelsPerPixel) : 0;
+                texture.wantedLevel = glm::min(texture.wantedLevel, level);
+                texture.lastUsedFrame = streaming.frameIndex;
+            }
+        }
+    }
+
+    const u64 budget = (u64)streaming.budgetMB * 1024 * 1024;
+
+    for (u32 load = 0; load < TEXTURE_STREAMING_LOADS_PER_FRAME; ++load)
+    {
+        // The texture furthest from the level it needs
+        u32 textureIdx = UINT32_MAX;
+        u32 missingLevels = 0;
+        for (u32 i = 0; i < (u32)app->textures.size(); ++i)
+        {
+            const Texture& texture = app->textures[i];
+            if (IsStreamable(texture) && texture.residentLevel > texture.wantedLevel + missingLevels)
+            {
+                textureIdx = i;
+                missingLevels = texture.residentLevel - texture.wantedLevel;
+            }
+        }
+        if (textureIdx == UINT32_MAX)
+            break;
+
+        // Room is made with the textures not needed this frame, then the level is lowered to
+        // what fits. The new levels take room twice, and the file is decoded into a temporary
+        // texture with the full chain.
+        Texture& texture = app->textures[textureIdx];
+        u32 level = texture.wantedLevel;
+        u64 residentBytes = GetResidentBytes(texture);
+        u64 decodeBytes = GetTextureBytes(texture.size, 0, texture.levelCount);
+        while (GetStreamingBytes(app) + 2 * (GetTextureBytes(texture.size, level, texture.levelCount) - residentBytes) + decodeBytes > budget)
+        {
+            if (!EvictLeastRecentlyUsed(app, textureIdx, false) && ++level >= texture.residentLevel)
+                break;
+        }
+
+        if (level < texture.residentLevel && SetTextureLevel(app, textureIdx, level))
+            streaming.streamedIn++;
+    }
+
+    // The budget can be lowered at any time
+    while (GetStreamingBytes(app) > budget)
+    {
+        if (!EvictLeastRecentlyUsed(app, UINT32_MAX, true))
+            break;
+    }
+}
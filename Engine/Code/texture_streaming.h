@@ -0,0 +1,45 @@
+//
+// texture_streaming.h: Keeps the material textures at the mip level the entities drawing them
+// need on screen, under a memory budget. The finest level a texture needs comes from the
+// projected size of those entities. Finer levels are decoded again from the file, coarser ones
+// are copied out of the resident texture, and when the budget would be exceeded the least
+// recently needed textures drop to coarser levels first.
+//
+
+#pragma once
+#ifndef TEXTURE_STREAMING_H
+#define TEXTURE_STREAMING_H
+
+#define TEXTURE_STREAMING_MIN_SIZE        64  // Textures are never evicted below this size
+#define TEXTURE_STREAMING_LOADS_PER_FRAME 1   // Each one decodes its file, so they are spread over frames
+#define TEXTURE_STREAMING_DEFAULT_BUDGET  128 // MB
+
+struct TextureStreaming
+{
+    bool enabled;
+    i32  budgetMB;
+    u64  residentBytes; // Of the streamed textures
+    u64  frameIndex;
+    u32  streamedIn;    // Totals since the start, for the GUI
+    u32  evicted;
+};
+
+struct App;
+
+void InitTextureStreaming(TextureStreaming& streaming);
+
+/**
+ * Call once per frame, once the transforms are updated. Streams in at most a few textures and
+ * evicts what's needed to stay under the budget, updating the layers of the textures changed
+ * in the material table. The budget covers the textures and their copies in the table.
+ */
+void UpdateTextureStreaming(App* app);
+
+u32 GetMipLevelCount(glm::ivec2 size);
+
+/**
+ * Memory of the levels from firstLevel to the end of the chain of a texture of this size.
+ */
+u64 GetTextureBytes(glm::ivec2 size, u32 firstLevel, u32 levelCount);
+
+#endif // TEXTURE_STREAMING_H
@@ -0,0 +1,248 @@
+#include "Global.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define TRANSFORM_SIMD 1
+#include <xmmintrin.h>
+#else
+#define TRANSFORM_SIMD 0
+#endif
+
+static u32 CountTrailingZeros(u64 value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+static void SetBit(std::vector<u64>& bits, u32 index)
+{
+    bits[index / 64] |= 1ull << (index % 64);
+}
+
+static bool IsBitSet(const std::vector<u64>& bits, u32 index)
+{
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static void ResizeTransformArrays(TransformSystem& transforms, u32 capacity)
+{
+    std::vector<f32>* components[] = {
+        &transforms.positionX, &transforms.positionY, &transforms.positionZ,
+        &transforms.rotationX, &transforms.rotationY, &transforms.rotationZ,
+        &transforms.scaleX, &transforms.scaleY, &transforms.scaleZ };
+
+    for (std::vector<f32>* component : components)
+        component->resize(capacity, 0.0f);
+
+    transforms.parents.resize(capacity, TRANSFORM_NO_PARENT);
+
+    transforms.worldMatrices.resize(capacity, glm::mat4(1.0f));
+    transforms.dirtyBits.resize((capacity + 63) / 64, 0);
+    transforms.changedBits.resize((capacity + 63) / 64, 0);
+    transforms.childBits.resize((capacity + 63) / 64, 0);
+}
+
+u32 AddTransform(TransformSystem& transforms, const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale, u32 parent)
+{
+    ASSERT(parent == TRANSFORM_NO_PARENT || parent < transforms.count, "Parents must be added before their children");
+
+    u32 index = transforms.count++;
+    if (transforms.count > transforms.positionX.size())
+        ResizeTransformArrays(transforms, Align(transforms.count, 4));
+
+    transforms.parents[index] = parent;
+    if (parent != TRANSFORM_NO_PARENT)
+        SetBit(transforms.childBits, index);
+
+    SetPosition(transforms, index, position);
+    SetRotation(transforms, index, rotation);
+    SetScale(transforms, index, scale);
+    return index;
+}
+
+glm::vec3 GetPosition(const TransformSystem& transforms, u32 index)
+{
+    return glm::vec3(transforms.positionX[index], transforms.positionY[index], transforms.positionZ[index]);
+}
+
+glm::vec3 GetRotation(const TransformSystem& transforms, u32 index)
+{
+    return glm::vec3(transforms.rotationX[index], transforms.rotationY[index], transforms.rotationZ[index]);
+}
+
+glm::vec3 GetScale(const TransformSystem& transforms, u32 index)
+{
+    return glm::vec3(transforms.scaleX[index], transforms.scaleY[index], transforms.scaleZ[index]);
+}
+
+void SetPosition(TransformSystem& transforms, u32 index, const glm::vec3& position)
+{
+    transforms.positionX[index] = position.x;
+    transforms.positionY[index] = position.y;
+    transforms.positionZ[index] = position.z;
+    SetBit(transforms.dirtyBits, index);
+}
+
+void SetRotation(TransformSystem& transforms, u32 index, const glm::vec3& rotation)
+{
+    transforms.rotationX[index] = rotation.x;
+    transforms.rotationY[index] = rotation.y;
+    transforms.rotationZ[index] = rotation.z;
+    SetBit(transforms.dirtyBits, index);
+}
+
+void SetScale(TransformSystem& transforms, u32 index, const glm::vec3& scale)
+{
+    transforms.scaleX[index] = scale.x;
+    transforms.scaleY[index] = scale.y;
+    transforms.scaleZ[index] = scale.z;
+    SetBit(transforms.dirtyBits, index);
+}
+
+void MarkAllTransformsDirty(TransformSystem& transforms)
+{
+    for (u32 i = 0; i < transforms.count; ++i)
+        SetBit(transforms.dirtyBits, i);
+}
+
+// Composes world = T * R * S for the 4 transforms starting at first (R as glm::eulerAngleXYZ)
+static void ComposeWorldMatrices4(TransformSystem& transforms, u32 first)
+{
+    f32 c1[4], s1[4], c2[4], s2[4], c3[4], s3[4];
+    for (u32 i = 0; i < 4; ++i)
+    {
+        f32 x = glm::radians(transforms.rotationX[first + i]);
+        f32 y = glm::radians(transforms.rotationY[first + i]);
+        f32 z = glm::radians(transforms.rotationZ[first + i]);
+        c1[i] = cosf(x); s1[i] = -sinf(x);
+        c2[i] = cosf(y); s2[i] = -sinf(y);
+        c3[i] = cosf(z); s3[i] = -sinf(z);
+    }
+
+#if TRANSFORM_SIMD
+    __m128 vc1 = _mm_loadu_ps(c1), vs1 = _mm_loadu_ps(s1);
+    __m128 vc2 = _mm_loadu_ps(c2), vs2 = _mm_loadu_ps(s2);
+    __m128 vc3 = _mm_loadu_ps(c3), vs3 = _mm_loadu_ps(s3);
+    __m128 sx = _mm_loadu_ps(&transforms.scaleX[first]);
+    __m128 sy = _mm_loadu_ps(&transforms.scaleY[first]);
+    __m128 sz = _mm_loadu_ps(&transforms.scaleZ[first]);
+    __m128 s1s2 = _mm_mul_ps(vs1, vs2);
+    __m128 c1s2 = _mm_mul_ps(vc1, vs2);
+
+    // Each register holds one matrix element of the 4 transforms
+    __m128 columns[4][4];
+    columns[0][0] = _mm_mul_ps(_mm_mul_ps(vc2, vc3), sx);
+    columns[0][1] = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(vc1, vs3)), _mm_mul_ps(s1s2, vc3)), sx);
+    columns[0][2] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vs1, vs3), _mm_mul_ps(c1s2, vc3)), sx);
+    columns[1][0] = _mm_mul_ps(_mm_mul_ps(vc2, vs3), sy);
+    columns[1][1] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc1, vc3), _mm_mul_ps(s1s2, vs3)), sy);
+    columns[1][2] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(c1s2, vs3), _mm_mul_ps(vs1, vc3)), sy);
+    columns[2][0] = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), vs2), sz);
+    columns[2][1] = _mm_mul_ps(_mm_mul_ps(vs1, vc2), sz);
+    columns[2][2] = _mm_mul_ps(_mm_mul_ps(vc1, vc2), sz);
+    columns[3][0] = _mm_loadu_ps(&transforms.positionX[first]);
+    columns[3][1] = _mm_loadu_ps(&transforms.positionY[first]);
+    columns[3][2] = _mm_loadu_ps(&transforms.positionZ[first]);
+    columns[0][3] = columns[1][3] = columns[2][3] = _mm_setzero_ps();
+    columns[3][3] = _mm_set1_ps(1.0f);
+
+    // Transposing turns the 4 elements of a column into the column of each matrix
+    for (u32 c = 0; c < 4; ++c)
+    {
+        _MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+        for (u32 i = 0; i < 4; ++i)
+            _mm_storeu_ps(&transforms.worldMatrices[first + i][c][0], columns[c][i]);
+    }
+#else
+    for (u32 i = 0; i < 4; ++i)
+    {
+        glm::mat4& world = transforms.worldMatrices[first + i];
+        glm::vec3 scale = GetScale(transforms, first + i);
+        world[0] = glm::vec4(c2[i] * c3[i], -c1[i] * s3[i] + s1[i] * s2[i] * c3[i], s1[i] * s3[i] + c1[i] * s2[i] * c3[i], 0.0f) * scale.x;
+        world[1] = glm::vec4(c2[i] * s3[i], c1[i] * c3[i] + s1[i] * s2[i] * s3[i], -s1[i] * c3[i] + c1[i] * s2[i] * s3[i], 0.0f) * scale.y;
+        world[2] = glm::vec4(-s2[i], s1[i] * c2[i], c1[i] * c2[i], 0.0f) * scale.z;
+        world[3] = glm::vec4(GetPosition(transforms, first + i), 1.0f);
+    }
+#endif
+}
+
+static void MultiplyMatrices(const glm::mat4& a, const glm::mat4& b, glm::mat4& result)
+{
+#if TRANSFORM_SIMD
+    __m128 a0 = _mm_loadu_ps(&a[0][0]);
+    __m128 a1 = _mm_loadu_ps(&a[1][0]);
+    __m128 a2 = _mm_loadu_ps(&a[2][0]);
+    __m128 a3 = _mm_loadu_ps(&a[3][0]);
+    for (u32 c = 0; c < 4; ++c)
+    {
+        __m128 column = _mm_mul_ps(a0, _mm_set1_ps(b[c][0]));
+        column = _mm_add_ps(column, _mm_mul_ps(a1, _mm_set1_ps(b[c][1])));
+        column = _mm_add_ps(column, _mm_mul_ps(a2, _mm_set1_ps(b[c][2])));
+        column = _mm_add_ps(column, _mm_mul_ps(a3, _mm_set1_ps(b[c][3])));
+        _mm_storeu_ps(&result[c][0], column);
+    }
+#else
+    result = a * b;
+#endif
+}
+
+u32 UpdateTransforms(TransformSystem& transforms)
+{
+    // The children of dirty transforms must be recomposed too
+    bool anyDirty = false;
+    bool anyChild = false;
+    for (u32 word = 0; word < transforms.dirtyBits.size(); ++word)
+    {
+        anyDirty |= transforms.dirtyBits[word] != 0;
+        anyChild |= transforms.childBits[word] != 0;
+    }
+    transforms.worldChanged = anyDirty;
+
+    if (anyDirty && anyChild)
+    {
+        for (u32 i = 0; i < transforms.count; ++i)
+        {
+            u32 parent = transforms.parents[i];
+            if (parent != TRANSFORM_NO_PARENT && IsBitSet(transforms.dirtyBits, parent))
+                SetBit(transforms.dirtyBits, i);
+        }
+    }
+
+    u32 changedCount = 0;
+    for (u32 word = 0; word < transforms.dirtyBits.size(); ++word)
+    {
+        u64 dirty = transforms.dirtyBits[word];
+
+        // Groups of 4 consecutive transforms with at least one of them dirty
+        u64 composed = 0;
+        for (u32 group = 0; group < 16 && (dirty >> (group * 4)) != 0; ++group)
+        {
+            if ((dirty >> (group * 4)) & 0xF)
+            {
+                ComposeWorldMatrices4(transforms, word * 64 + group * 4);
+                composed |= 0xFull << (group * 4);
+            }
+        }
+
+        // Every composed child (dirty or not) only has its local matrix now. Going in order,
+        // the world matrix of its parent is already final.
+        for (u64 bits = composed & transforms.childBits[word]; bits != 0; bits &= bits - 1)
+        {
+            u32 index = word * 64 + CountTrailingZeros(bits);
+            glm::mat4 local = transforms.worldMatrices[index];
+            MultiplyMatrices(transforms.worldMatrices[transforms.parents[index]], local, transforms.worldMatrices[index]);
+        }
+
+        transforms.dirtyBits[word] = 0;
+        transforms.changedBits[word] = dirty;
+
+        for (u64 bits = dirty; bits != 0; bits &= bits - 1)
+            changedCount++;
+    }
+
+    return changedCount;
+}
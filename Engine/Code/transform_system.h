@@ -0,0 +1,62 @@
+//
+// transform_system.h: Entity transforms stored as structure of arrays. World matrices are only
+// recomposed for the transforms that changed, 4 at a time with SSE.
+//
+
+#pragma once
+#ifndef TRANSFORM_SYSTEM_H
+#define TRANSFORM_SYSTEM_H
+
+#define TRANSFORM_NO_PARENT UINT32_MAX
+
+struct TransformSystem
+{
+    u32 count;
+
+    // Local transform, one array per component so 4 consecutive transforms can be loaded at
+    // once. The arrays are padded to a multiple of 4.
+    std::vector<f32> positionX, positionY, positionZ;
+    std::vector<f32> rotationX, rotationY, rotationZ; // Euler angles (XYZ), in degrees
+    std::vector<f32> scaleX, scaleY, scaleZ;
+    std::vector<u32> parents; // Always before their children, so a single pass propagates the matrices
+
+    std::vector<glm::mat4> worldMatrices;
+
+    std::vector<u64> dirtyBits;   // The local transform changed, the world matrix must be recomposed
+    std::vector<u64> changedBits; // The matrices changed during the last UpdateTransforms
+    std::vector<u64> childBits;   // Transforms with a parent
+    bool             worldChanged; // Some world matrix changed during the last UpdateTransforms
+};
+
+/**
+ * The transform is relative to parent, which must have been added before.
+ */
+u32 AddTransform(TransformSystem& transforms, const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale, u32 parent = TRANSFORM_NO_PARENT);
+
+glm::vec3 GetPosition(const TransformSystem& transforms, u32 index);
+glm::vec3 GetRotation(const TransformSystem& transforms, u32 index);
+glm::vec3 GetScale(const TransformSystem& transforms, u32 index);
+
+void SetPosition(TransformSystem& transforms, u32 index, const glm::vec3& position);
+void SetRotation(TransformSystem& transforms, u32 index, const glm::vec3& rotation);
+void SetScale(TransformSystem& transforms, u32 index, const glm::vec3& scale);
+
+/**
+ * Forces every transform to be recomposed and reported as changed on the next update
+ * (e.g. after the per-object constants have been moved).
+ */
+void MarkAllTransformsDirty(TransformSystem& transforms);
+
+/**
+ * Recomposes the world matrices of the dirty transforms (and their descendants). Returns how
+ * many transforms changed, which can then be checked with IsTransformChanged to upload only
+ * their constants.
+ */
+u32 UpdateTransforms(TransformSystem& transforms);
+
+inline bool IsTransformChanged(const TransformSystem& transforms, u32 index)
+{
+    return (transforms.changedBits[index / 64] >> (index % 64)) & 1;
+}
+
+#endif // TRANSFORM_SYSTEM_H
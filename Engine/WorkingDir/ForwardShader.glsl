@@ -15,14 +15,28 @@ layout(location=4) in vec3 aBitangent;
 
 out vec2 vTexCoord;
 
-uniform mat4 viewMatrix;
-uniform mat4 projection;
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+// Quantized positions are stored relative to the submesh bounds
+uniform vec3 uPositionOffset;
+uniform vec3 uPositionScale;
 
 void main()
 {
     vTexCoord = aTexCoord;
 
-    gl_Position = projection * viewMatrix * vec4(aPosition, 1);
+    vec3 position = uPositionOffset + aPosition * uPositionScale;
+
+    gl_Position = uViewProjection * vec4(position, 1);
 
     gl_Position.z = -gl_Position.z;
 }
@@ -10,6 +10,7 @@ struct Light
     vec3 direction;
     vec3 position;
     float intensity;
+    int shadowView; // First of its views in the shadow atlas, -1 if it has none
 };
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -24,17 +25,38 @@ layout(location=4) in vec3 aBitangent;
 
 layout(binding = 0, std140) uniform GlobalParams
 {
-    vec3 uCameraPosition;
     uint uLightCount;
     Light uLight[16];
 };
 
-layout(binding = 1, std140) uniform LocalParams
+// Per-object constants of every entity, the draws pick theirs with the base instance
+struct ObjectParams
 {
-    mat4 uWorldMatrix;
-    mat4 uWorldViewPorjectionMatrix;
+    mat4 worldMatrix;
 };
 
+layout(binding = 3, std430) readonly buffer ObjectBuffer
+{
+    ObjectParams uObjects[];
+};
+
+layout(location=15) in uint aObjectIndex; // Instanced, holds the base instance of the draw
+
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+// Quantized positions are stored relative to the submesh bounds
+uniform vec3 uPositionOffset;
+uniform vec3 uPositionScale;
+
 out vec2 vTexCoord;
 out vec3 vPosition;
 out vec3 vNormal;
@@ -46,16 +68,19 @@ void main()
 {
     vTexCoord = aTexCoord;
 
+    vec3 position = uPositionOffset + aPosition * uPositionScale;
+    mat4 worldMatrix = uObjects[aObjectIndex].worldMatrix;
+
     //gl_Position = uWorldViewPorjectionMatrix * vec4(aPosition, 1);
     //gl_Position.z = -gl_Position.z;
 
-    vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
+    vPosition = vec3(worldMatrix * vec4(position, 1.0));
 
-    vNormal = vec3(uWorldMatrix * vec4(aNormal, 0.0));
+    vNormal = vec3(worldMatrix * vec4(aNormal, 0.0));
 
-    vViewDir = normalize(uCameraPosition - vPosition);
+    vViewDir = normalize(uCameraPosition.xyz - vPosition);
 
-    gl_Position = uWorldViewPorjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjection * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -67,11 +92,106 @@ in vec3 vPosition;
 in vec3 vNormal;
 in vec3 vViewDir;
 
-uniform sampler2D uTexture;
+// Materials of every loaded model, their textures are layers of the uMaterialTextures arrays
+struct Material
+{
+    vec3 albedo;
+    float smoothness;
+    vec3 emissive;
+    uint albedoTexture; // Array in the high 8 bits, first resident level, layer in the low 16, all ones if none
+    uint emissiveTexture;
+    uint specularTexture;
+    uint normalsTexture;
+    uint bumpTexture;
+};
+
+layout(binding = 4, std430) readonly buffer MaterialBuffer
+{
+    Material uMaterials[];
+};
+
+layout(binding = 8) uniform sampler2DArray uMaterialTextures[8];
+
+uniform uint uMaterialIndex;
+
+// Shadow maps of the lights, each view is a tile of the atlas
+struct ShadowView
+{
+    mat4 viewProjection;
+    vec4 atlasRect; // Offset and size of the tile, in atlas uvs
+};
+
+layout(binding = 5, std430) readonly buffer ShadowBuffer
+{
+    ShadowView uShadowViews[];
+};
+
+layout(binding = 1) uniform sampler2DShadow uShadowAtlas;
+
+// 0 in the shadow of the light, 1 lit. Point lights have a view per cube face, in the +X, -X,
+// +Y, -Y, +Z, -Z order.
+float lightVisibility(Light light, vec3 position, vec3 normal)
+{
+    if (light.shadowView < 0)
+        return 1.0;
+
+    int view = light.shadowView;
+    if (light.type == 1u)
+    {
+        vec3 d = position - light.position;
+        vec3 a = abs(d);
+        if (a.x >= a.y && a.x >= a.z)
+            view += d.x > 0.0 ? 0 : 1;
+        else if (a.y >= a.z)
+            view += d.y > 0.0 ? 2 : 3;
+        else
+            view += d.z > 0.0 ? 4 : 5;
+    }
+
+    // Pushed along the normal so the surface doesn't shadow itself
+    vec4 clip = uShadowViews[view].viewProjection * vec4(position + normal * 0.02, 1.0);
+    vec3 ndc = clip.xyz / clip.w;
+    if (any(greaterThan(abs(ndc), vec3(1.0))))
+        return 1.0;
+
+    // Kept half a texel inside the tile, the filtering would read the neighbours otherwise
+    vec4 rect = uShadowViews[view].atlasRect;
+    vec2 halfTexel = 0.5 / vec2(textureSize(uShadowAtlas, 0));
+    vec2 uv = clamp(rect.xy + (ndc.xy * 0.5 + 0.5) * rect.zw, rect.xy + halfTexel, rect.xy + rect.zw - halfTexel);
+    return texture(uShadowAtlas, vec3(uv, ndc.z * 0.5 + 0.5));
+}
+
+// Levels finer than minLevel aren't resident in the layer, so the level is picked here
+vec4 sampleMaterialLayer(sampler2DArray array, vec3 coord, vec2 dx, vec2 dy, float minLevel)
+{
+    vec2 size = vec2(textureSize(array, 0).xy);
+    float level = 0.5 * log2(max(dot(dx * size, dx * size), dot(dy * size, dy * size)));
+    return textureLod(array, coord, max(level, minLevel));
+}
+
+// The arrays are indexed with constants, so the slot can differ between the fragments of a draw
+vec4 sampleMaterialTexture(uint slot, vec2 uv, vec4 fallback)
+{
+    vec2 dx = dFdx(uv);
+    vec2 dy = dFdy(uv);
+    vec3 coord = vec3(uv, float(slot & 0xFFFFu));
+    float minLevel = float((slot >> 16) & 0xFFu);
+    switch (slot >> 24)
+    {
+    case 0u: return sampleMaterialLayer(uMaterialTextures[0], coord, dx, dy, minLevel);
+    case 1u: return sampleMaterialLayer(uMaterialTextures[1], coord, dx, dy, minLevel);
+    case 2u: return sampleMaterialLayer(uMaterialTextures[2], coord, dx, dy, minLevel);
+    case 3u: return sampleMaterialLayer(uMaterialTextures[3], coord, dx, dy, minLevel);
+    case 4u: return sampleMaterialLayer(uMaterialTextures[4], coord, dx, dy, minLevel);
+    case 5u: return sampleMaterialLayer(uMaterialTextures[5], coord, dx, dy, minLevel);
+    case 6u: return sampleMaterialLayer(uMaterialTextures[6], coord, dx, dy, minLevel);
+    case 7u: return sampleMaterialLayer(uMaterialTextures[7], coord, dx, dy, minLevel);
+    }
+    return fallback;
+}
 
 layout(binding = 0, std140) uniform GlobalParams
 {
-    vec3 uCameraPosition;
     uint uLightCount;
     Light uLight[16];
 };
@@ -81,9 +201,16 @@ layout(location=1) out vec4 oNormals;
 layout(location=2) out vec4 oPosition;
 void main()
 {
+    // Only the members read are active, which is how the engine knows the slots to load, so
+    // the material isn't copied as a whole
+    uint albedoTexture = uMaterials[uMaterialIndex].albedoTexture;
+    vec4 albedoColor = vec4(uMaterials[uMaterialIndex].albedo, 1.0);
+    vec3 albedo = sampleMaterialTexture(albedoTexture, vTexCoord, albedoColor).rgb;
+
     vec3 lightStrenght = vec3(0.0);
     for(int i = 0; i< uLightCount; ++i)
     {
+        float visibility = lightVisibility(uLight[i], vPosition, normalize(vNormal));
         if(uLight[i].type == 0)
         {
             float ambientStrenght = 0.2;
@@ -100,7 +227,7 @@ void main()
             float spec = pow(max(dot(normalize(vViewDir), reflectDir), 0.0), 32);
             vec3 specular = specularStrength * spec * uLight[i].color;
 
-            lightStrenght += (ambient + diffuse + specular) * texture(uTexture, vTexCoord).rgb;
+            lightStrenght += (ambient + (diffuse + specular) * visibility) * albedo;
         }
         if(uLight[i].type == 1)
         {
@@ -112,8 +239,8 @@ void main()
             float attenuation = 1.0 /(dist * dist);
 
             attenuation *= 2;
-            diffuse *= attenuation;
-            lightStrenght += (diffuse + ambient) * texture(uTexture, vTexCoord).rgb;
+            diffuse *= attenuation * visibility;
+            lightStrenght += (diffuse + ambient) * albedo;
         }
         
     }
@@ -126,6 +253,59 @@ void main()
 #endif
 #endif
 
+///////////////////////////////////////////////////////////////////////
+#ifdef SHADOW_DEPTH
+
+// Depth of the shadow casters into one tile of the shadow atlas. Only the positions are read.
+
+struct ShadowView
+{
+    mat4 viewProjection;
+    vec4 atlasRect;
+};
+
+layout(binding = 5, std430) readonly buffer ShadowBuffer
+{
+    ShadowView uShadowViews[];
+};
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+struct ObjectParams
+{
+    mat4 worldMatrix;
+};
+
+layout(binding = 3, std430) readonly buffer ObjectBuffer
+{
+    ObjectParams uObjects[];
+};
+
+layout(location=15) in uint aObjectIndex; // Instanced, holds the base instance of the draw
+
+// Quantized positions are stored relative to the submesh bounds
+uniform vec3 uPositionOffset;
+uniform vec3 uPositionScale;
+
+uniform uint uShadowView;
+
+void main()
+{
+    vec3 position = uPositionOffset + aPosition * uPositionScale;
+    gl_Position = uShadowViews[uShadowView].viewProjection * uObjects[aObjectIndex].worldMatrix * vec4(position, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+
+#endif
+#endif
+
 
 // NOTE: You can write several shaders in the same file if you want as
 // long as you embrace them within an #ifdef block (as you can see above).
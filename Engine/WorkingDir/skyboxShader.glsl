@@ -9,13 +9,22 @@ layout (location = 0) in vec3 aPos;
 
 out vec3 TexCoords;
 
-uniform mat4 projection;
-uniform mat4 view;
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
 
 void main()
 {
     TexCoords = -aPos;
-    vec4 pos = projection * view * vec4(aPos, 1.0);
+    // Only the rotation of the camera, the sky is infinitely far
+    vec4 pos = uProjection * mat4(mat3(uView)) * vec4(aPos, 1.0);
     gl_Position = pos.xyww;
 } 
 
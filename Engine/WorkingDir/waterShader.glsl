@@ -8,8 +8,33 @@
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 
-uniform mat4 projectionMatrix;
-uniform mat4 worldViewMatrix;
+// Per-object constants of every entity, the draws pick theirs with the base instance
+struct ObjectParams
+{
+    mat4 worldMatrix;
+};
+
+layout(binding = 3, std430) readonly buffer ObjectBuffer
+{
+    ObjectParams uObjects[];
+};
+
+layout(location=15) in uint aObjectIndex; // Instanced, holds the base instance of the draw
+
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+// Quantized positions are stored relative to the submesh bounds
+uniform vec3 uPositionOffset;
+uniform vec3 uPositionScale;
 
 out Data
 {
@@ -19,22 +44,35 @@ out Data
 
 void main(void)
 {
-	VSOut.positionViewspace = vec3(worldViewMatrix * vec4(position,1));
+	vec3 meshPosition = uPositionOffset + position * uPositionScale;
+	mat4 worldViewMatrix = uView * uObjects[aObjectIndex].worldMatrix;
+	VSOut.positionViewspace = vec3(worldViewMatrix * vec4(meshPosition,1));
 	VSOut.normalViewspace = vec3(worldViewMatrix * vec4(normal,0));
-	gl_Position = projectionMatrix * vec4(VSOut.positionViewspace, 1.0);
+	gl_Position = uProjection * vec4(VSOut.positionViewspace, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-uniform vec2 viewportSize;
-uniform mat4 modelViewMatrix;
-uniform mat4 viewMatrixInv;
-uniform mat4 projectionMatrixInv;
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+uniform int reflectionMode; // 0 planar, 1 screen-space
 uniform sampler2D reflectionMap;
 uniform sampler2D refractionMap;
 uniform sampler2D reflectionDepth;
 uniform sampler2D refractionDepth;
 uniform sampler2D dudvMap;
+uniform sampler2D sceneColor; // The frame before the water, for screen-space reflections
+uniform sampler2D sceneDepth;
+uniform samplerCube skybox;
 
 in Data{
 	vec3 positionViewspace;
@@ -48,21 +86,83 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0)
 	return F0 + (1.0 - F0) * pow(1.0 - cosTheta, 5.0);
 }
 
-vec3 reconstructPixelPosition(float depth)
+vec3 reconstructPixelPosition(vec2 texCoords, float depth)
 {
-	vec2 texCoords = gl_FragCoord.xy / viewportSize;
 	vec3 positionNDC = vec3(texCoords * 2.0 - vec2(1.0), depth * 2.0 - 1.0);
-	vec4 positionEyespace = projectionMatrixInv * vec4(positionNDC, 1.0);
+	vec4 positionEyespace = uProjectionInv * vec4(positionNDC, 1.0);
 	positionEyespace.xyz /= positionEyespace.w;
 	return positionEyespace.xyz;
 }
 
+vec3 reconstructPixelPosition(float depth)
+{
+	return reconstructPixelPosition(gl_FragCoord.xy * uViewport.zw, depth);
+}
+
+vec2 projectToScreen(vec3 positionViewspace)
+{
+	vec4 positionClip = uProjection * vec4(positionViewspace, 1.0);
+	return positionClip.xy / positionClip.w * 0.5 + vec2(0.5);
+}
+
+// Positive when the point is behind the scene surface seen through it
+float depthBehindScene(vec3 positionViewspace, vec2 texCoords)
+{
+	float sceneZ = reconstructPixelPosition(texCoords, texture(sceneDepth, texCoords).x).z;
+	return sceneZ - positionViewspace.z;
+}
+
+// Marches the reflected ray in view space against the scene depth, with growing steps, and
+// refines the first hit with a binary search. The alpha is 0 on misses and fades the hits
+// close to the screen borders.
+vec4 screenSpaceReflection(vec3 origin, vec3 R, vec2 distortion)
+{
+	const int maxSteps = 48;
+	const int refineSteps = 6;
+	const float thickness = 0.5;
+
+	vec3 previous = origin;
+	float stepLength = 0.1;
+	for (int i = 0; i < maxSteps; ++i)
+	{
+		vec3 current = previous + R * stepLength;
+		vec2 texCoords = projectToScreen(current);
+		if (current.z > 0.0 || any(lessThan(texCoords, vec2(0.0))) || any(greaterThan(texCoords, vec2(1.0))))
+			break;
+
+		float behind = depthBehindScene(current, texCoords);
+		if (behind > 0.0)
+		{
+			// Rays passing far behind an object don't hit it
+			if (behind > thickness + stepLength)
+				break;
+
+			for (int j = 0; j < refineSteps; ++j)
+			{
+				vec3 middle = 0.5 * (previous + current);
+				if (depthBehindScene(middle, projectToScreen(middle)) > 0.0)
+					current = middle;
+				else
+					previous = middle;
+			}
+
+			vec2 hitTexCoords = projectToScreen(current);
+			vec2 edgeFade = smoothstep(0.0, 0.1, hitTexCoords) * (1.0 - smoothstep(0.9, 1.0, hitTexCoords));
+			return vec4(texture(sceneColor, hitTexCoords + distortion).rgb, edgeFade.x * edgeFade.y);
+		}
+
+		previous = current;
+		stepLength *= 1.1;
+	}
+	return vec4(0.0);
+}
+
 void main()
 {
     vec3 N = normalize(FSIn.normalViewspace);
     vec3 V = normalize(-FSIn.positionViewspace);
-    vec3 Pw = vec3(viewMatrixInv * vec4(FSIn.positionViewspace, 1.0));//in world space
-    vec2 texCoord = gl_FragCoord.xy / viewportSize;
+    vec3 Pw = vec3(uViewInv * vec4(FSIn.positionViewspace, 1.0));//in world space
+    vec2 texCoord = gl_FragCoord.xy * uViewport.zw;
     
     const vec2 waveLength = vec2(2.0);
     const vec2 waveStrength = vec2(0.05);
@@ -72,7 +172,22 @@ void main()
 
     vec2 reflectionTexCoord = vec2(texCoord.s, 1.0 - texCoord.t) + distortion;
     vec2 refractionTexCoord = texCoord + distortion;
-    vec3 reflectionColor = texture(reflectionMap, reflectionTexCoord).rgb;
+
+    // A copy of the whole scene also holds what's in front of the water, don't distort into it
+    if (reconstructPixelPosition(texture(refractionDepth, refractionTexCoord).x).z > FSIn.positionViewspace.z)
+        refractionTexCoord = texCoord;
+    vec3 reflectionColor;
+    if (reflectionMode == 1)
+    {
+        vec3 R = reflect(-V, N);
+        vec4 hit = screenSpaceReflection(FSIn.positionViewspace, R, distortion);
+        vec3 skyColor = texture(skybox, -(mat3(uViewInv) * R)).rgb;
+        reflectionColor = mix(skyColor, hit.rgb, hit.a);
+    }
+    else
+    {
+        reflectionColor = texture(reflectionMap, reflectionTexCoord).rgb;
+    }
     vec3 refractionColor = texture(refractionMap, refractionTexCoord).rgb;
 
     float distortedGroundDepth = texture(refractionDepth, refractionTexCoord).x;
@@ -92,6 +207,164 @@ void main()
 #endif
 
 
+///////////////////////////////////////////////////////////////////////
+// Scene seen from the water reflection and refraction cameras. Only the
+// geometry on the side of the water kept by uClipPlane is rasterized.
+///////////////////////////////////////////////////////////////////////
+#ifdef WATER_SCENE
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+layout(location=2) in vec2 aTexCoord;
+
+// Per-object constants of every entity, the draws pick theirs with the base instance
+struct ObjectParams
+{
+    mat4 worldMatrix;
+};
+
+layout(binding = 3, std430) readonly buffer ObjectBuffer
+{
+    ObjectParams uObjects[];
+};
+
+layout(location=15) in uint aObjectIndex; // Instanced, holds the base instance of the draw
+
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+uniform vec4 uClipPlane; // World space, the positive side is kept
+
+// Quantized positions are stored relative to the submesh bounds
+uniform vec3 uPositionOffset;
+uniform vec3 uPositionScale;
+
+out vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = aTexCoord;
+
+    vec4 worldPosition = uObjects[aObjectIndex].worldMatrix * vec4(uPositionOffset + aPosition * uPositionScale, 1.0);
+    gl_ClipDistance[0] = dot(worldPosition, uClipPlane);
+    gl_Position = uViewProjection * worldPosition;
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+// Materials of every loaded model, their textures are layers of the uMaterialTextures arrays
+struct Material
+{
+    vec3 albedo;
+    float smoothness;
+    vec3 emissive;
+    uint albedoTexture; // Array in the high 8 bits, first resident level, layer in the low 16, all ones if none
+    uint emissiveTexture;
+    uint specularTexture;
+    uint normalsTexture;
+    uint bumpTexture;
+};
+
+layout(binding = 4, std430) readonly buffer MaterialBuffer
+{
+    Material uMaterials[];
+};
+
+layout(binding = 8) uniform sampler2DArray uMaterialTextures[8];
+
+uniform uint uMaterialIndex;
+
+// Levels finer than minLevel aren't resident in the layer, so the level is picked here
+vec4 sampleMaterialLayer(sampler2DArray array, vec3 coord, vec2 dx, vec2 dy, float minLevel)
+{
+    vec2 size = vec2(textureSize(array, 0).xy);
+    float level = 0.5 * log2(max(dot(dx * size, dx * size), dot(dy * size, dy * size)));
+    return textureLod(array, coord, max(level, minLevel));
+}
+
+// The arrays are indexed with constants, so the slot can differ between the fragments of a draw
+vec4 sampleMaterialTexture(uint slot, vec2 uv, vec4 fallback)
+{
+    vec2 dx = dFdx(uv);
+    vec2 dy = dFdy(uv);
+    vec3 coord = vec3(uv, float(slot & 0xFFFFu));
+    float minLevel = float((slot >> 16) & 0xFFu);
+    switch (slot >> 24)
+    {
+    case 0u: return sampleMaterialLayer(uMaterialTextures[0], coord, dx, dy, minLevel);
+    case 1u: return sampleMaterialLayer(uMaterialTextures[1], coord, dx, dy, minLevel);
+    case 2u: return sampleMaterialLayer(uMaterialTextures[2], coord, dx, dy, minLevel);
+    case 3u: return sampleMaterialLayer(uMaterialTextures[3], coord, dx, dy, minLevel);
+    case 4u: return sampleMaterialLayer(uMaterialTextures[4], coord, dx, dy, minLevel);
+    case 5u: return sampleMaterialLayer(uMaterialTextures[5], coord, dx, dy, minLevel);
+    case 6u: return sampleMaterialLayer(uMaterialTextures[6], coord, dx, dy, minLevel);
+    case 7u: return sampleMaterialLayer(uMaterialTextures[7], coord, dx, dy, minLevel);
+    }
+    return fallback;
+}
+
+layout(location=0) out vec4 oColor;
+
+void main()
+{
+    // Only the members read are active, which is how the engine knows the slots to load, so
+    // the material isn't copied as a whole
+    uint albedoTexture = uMaterials[uMaterialIndex].albedoTexture;
+    vec4 albedoColor = vec4(uMaterials[uMaterialIndex].albedo, 1.0);
+    oColor = sampleMaterialTexture(albedoTexture, vTexCoord, albedoColor);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// Bounds of the water drawn against the scene depth by the occlusion
+// query. Nothing is written, only the samples passing count.
+///////////////////////////////////////////////////////////////////////
+#ifdef WATER_OCCLUSION
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+layout(binding = 2, std140) uniform ViewParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    mat4 uViewInv;
+    mat4 uProjectionInv;
+    vec4 uCameraPosition;
+    vec4 uViewport; // Size in pixels, then its inverse
+};
+
+uniform mat4 uBoxMatrix; // Unit cube to world space
+
+void main()
+{
+    gl_Position = uViewProjection * uBoxMatrix * vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+
+#endif
+#endif
+
 // NOTE: You can write several shaders in the same file if you want as
 // long as you embrace them within an #ifdef block (as you can see above).
 // The third parameter of the LoadProgram function in engine.cpp allows